@@ -21,10 +21,25 @@ void showSimParamsAdvanced(genericfsim::manager::SimulationConfig& config, int s
 	ImGui::Checkbox("Stop particles", &config.simulatorConfig.stopParticles);
 	ImGui::SameLine();
 	ImGui::Checkbox("Top is solid", &config.isTopOfContainerSolid);
+	ImGui::RadioButton("Atomic P2G", (int*)&config.simulatorConfig.p2gScheduling, (int)Simulator::P2GScheduling::ATOMIC);
+	ImGui::SameLine();
+	ImGui::RadioButton("Colored P2G", (int*)&config.simulatorConfig.p2gScheduling, (int)Simulator::P2GScheduling::COLORED);
+	ImGui::SameLine();
+	ImGui::RadioButton("Gather P2G", (int*)&config.simulatorConfig.p2gScheduling, (int)Simulator::P2GScheduling::GATHER);
+	ImGui::RadioButton("Euler advection", (int*)&config.simulatorConfig.advectionType, (int)Simulator::AdvectionType::EULER);
+	ImGui::SameLine();
+	ImGui::RadioButton("RK2 advection", (int*)&config.simulatorConfig.advectionType, (int)Simulator::AdvectionType::RK2);
+	ImGui::SameLine();
+	ImGui::RadioButton("RK3 advection", (int*)&config.simulatorConfig.advectionType, (int)Simulator::AdvectionType::RK3);
+	ImGui::RadioButton("Dense neighbour grid", (int*)&config.neighbourGridType, static_cast<int>(NeighbourGridType::DENSE));
+	ImGui::SameLine();
+	ImGui::RadioButton("Compact neighbour hash (on restart)", (int*)&config.neighbourGridType, static_cast<int>(NeighbourGridType::COMPACT_HASH));
 	ImGui::RadioButton("Bridson solver", (int*)&config.gridSolverType, static_cast<int>(SimulationConfig::GridSolverType::BRIDSON));
 	ImGui::SameLine();
 	ImGui::RadioButton("Basic solver", (int*)&config.gridSolverType, static_cast<int>(SimulationConfig::GridSolverType::BASIC));
-	if (config.gridSolverType == SimulationConfig::GridSolverType::BRIDSON)
+	ImGui::SameLine();
+	ImGui::RadioButton("Multigrid solver", (int*)&config.gridSolverType, static_cast<int>(SimulationConfig::GridSolverType::MULTIGRID));
+	if (config.gridSolverType == SimulationConfig::GridSolverType::BRIDSON || config.gridSolverType == SimulationConfig::GridSolverType::MULTIGRID)
 	{
 		ImGui::SetNextItemWidth(screenWidth * 0.18f);
 		ImGui::SliderFloat("density", &config.fluidDensity, 0.1f, 30.0f);
@@ -32,6 +47,15 @@ void showSimParamsAdvanced(genericfsim::manager::SimulationConfig& config, int s
 		ImGui::SetNextItemWidth(screenWidth * 0.18f);
 		ImGui::SliderFloat("solver tolerance", &config.residualTolerance, 1e-8f, 1e-4f, "%e");
 	}
+	if (config.gridSolverType == SimulationConfig::GridSolverType::BRIDSON)
+	{
+		ImGui::Text("Preconditioner ordering:");
+		ImGui::SameLine();
+		ImGui::RadioButton("Lexicographic", (int*)&config.preconditionerOrdering, static_cast<int>(PreconditionerOrdering::LEXICOGRAPHIC));
+		ImGui::SameLine();
+		ImGui::RadioButton("Wavefront", (int*)&config.preconditionerOrdering, static_cast<int>(PreconditionerOrdering::WAVEFRONT));
+		ImGui::Checkbox("Warm start", &config.warmStartPressure);
+	}
 
 	ImGui::Checkbox("Gravity", &config.simulatorConfig.gravityEnabled);
 	ImGui::SameLine(0, 30);
@@ -48,6 +72,9 @@ void showSimParamsAdvanced(genericfsim::manager::SimulationConfig& config, int s
 	ImGui::SetNextItemWidth(screenWidth * 0.40f);
 	ImGui::SliderInt("N", &config.incompressibilityIterationCount, 1, 600);
 	ImGui::SetNextItemWidth(screenWidth * 0.40f);
+	ImGui::SliderInt("Extrapolation layers", &config.velocityExtrapolationLayerCount, 1, 10);
+	ImGui::Checkbox("Sparse sweeps (only the tiles around the particles)", &config.sparseGrid);
+	ImGui::SetNextItemWidth(screenWidth * 0.40f);
 	ImGui::SliderFloat("Average P", &config.averagePressure, 0.01f, 20.0f);
 	ImGui::SetNextItemWidth(screenWidth * 0.40f);
 	ImGui::SliderFloat("Pressure k", &config.pressureK, 0.5f, 10.0f);
@@ -55,6 +82,24 @@ void showSimParamsAdvanced(genericfsim::manager::SimulationConfig& config, int s
 	ImGui::SliderFloat("G", &config.simulatorConfig.gravity, -0.01f, -1000.0f);
 	ImGui::SetNextItemWidth(screenWidth * 0.40f);
 	ImGui::SliderFloat("Flip", &config.simulatorConfig.flipRatio, 0.0f, 1.0f);
+	ImGui::SetNextItemWidth(screenWidth * 0.40f);
+	ImGui::SliderInt("Particle sort interval", &config.simulatorConfig.particleSortInterval, 0, 200);
+	ImGui::SetNextItemWidth(screenWidth * 0.40f);
+	ImGui::SliderInt("Push apart iterations", &config.simulatorConfig.pushApartIterationCount, 1, 10);
+	ImGui::Checkbox("Adaptive time step", &config.simulatorConfig.adaptiveTimeStepping);
+	if (config.simulatorConfig.adaptiveTimeStepping) {
+		ImGui::SetNextItemWidth(screenWidth * 0.40f);
+		ImGui::SliderFloat("CFL number", &config.simulatorConfig.cflNumber, 0.1f, 5.0f);
+		ImGui::SetNextItemWidth(screenWidth * 0.40f);
+		ImGui::SliderInt("Max advection substeps", &config.simulatorConfig.maxAdvectionSubstepCount, 1, 16);
+		ImGui::SetNextItemWidth(screenWidth * 0.40f);
+		ImGui::SliderInt("Max grid steps", &config.simulatorConfig.maxStepCount, 1, 16);
+	}
+	ImGui::Checkbox("Narrow band (particles only near the surface)", &config.simulatorConfig.narrowBandEnabled);
+	if (config.simulatorConfig.narrowBandEnabled) {
+		ImGui::SetNextItemWidth(screenWidth * 0.40f);
+		ImGui::SliderInt("Band layers", &config.simulatorConfig.narrowBandLayerCount, 2, 10);
+	}
 
 	ImGui::End();
 }
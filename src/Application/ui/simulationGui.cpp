@@ -298,13 +298,13 @@ void startSimulatorGui() {
                 }
 
                 if (inspectionMode == 0) {
-                    auto& cell = simulationManager->getCellAt(cellX, cellY, 1);
+                    auto cell = simulationManager->getCellAt(cellX, cellY, 1);
                     ImGui::Text("Cell x: %d  y: %d  type: %s  v.x: %.3lf v.y: %.3lf v.z: %.3lf v2.x: %.3lf v2.y: %.3lf v2.z: %.3lf  p: %.3lf", cellX, cellY,
-                        (cell.type == CellType::SOLID ? "solid" : (cell.type == CellType::WATER ? "water" : "air  ")), cell.faces[0].v.load(), cell.faces[1].v.load(), cell.faces[2].v.load(), 
-                        cell.faces[0].v2, cell.faces[1].v2, cell.faces[2].v2, cell.avgPNum.load());
+                        (cell.type == CellType::SOLID ? "solid" : (cell.type == CellType::WATER ? "water" : "air  ")), cell.faces[0].v, cell.faces[1].v, cell.faces[2].v, 
+                        cell.faces[0].v2, cell.faces[1].v2, cell.faces[2].v2, cell.avgPNum);
                 }
                 if (inspectionMode == 1) {
-                    auto& particle = simulationManager->getParticleData(particleIndex);
+                    auto particle = simulationManager->getParticleData(particleIndex);
                     ImGui::Text("Particle index: %d  pos.x: %.3lf pos.y: %.3lf  v.x: %.3lf v.y: %.3lf", particleIndex, particle.pos.x, particle.pos.y, particle.v.x, particle.v.y);
                 }
             }
@@ -0,0 +1,97 @@
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <omp.h>
+#include "simulator/simulator.h"
+#include "simulator/macGrid/bridsonSolverGrid.h"
+
+using namespace genericfsim;
+using P2GScheduling = simulator::Simulator::P2GScheduling;
+
+/**
+ * Times the P2G transfer of the ATOMIC and COLORED schedulings on a headless 3D dam break, for each particle count and
+ * thread count (1, 2, 4, ... up to the OpenMP maximum).
+ *
+ * Usage: p2g_benchmark [particle counts...] (100000 500000 1000000 by default)
+ */
+
+namespace {
+
+constexpr double dt = 0.01;
+constexpr int warmupStepCount = 2;
+constexpr int measuredStepCount = 5;
+constexpr int particlesPerCell = 8;
+
+struct Timing {
+	double p2g = 0.0;		//in ms per step
+	double step = 0.0;
+};
+
+/**
+ * Recovers the duration of the last step from two consecutive sliding averages of the simulator.
+ */
+double lastStepDuration(long long average, long long previousAverage) {
+	return (average - simulator::Simulator::stepDurationSmoothing * previousAverage) / (1.0 - simulator::Simulator::stepDurationSmoothing);
+}
+
+Timing runScene(int particleNum, int threadNum, P2GScheduling scheduling) {
+	omp_set_num_threads(threadNum);
+	std::srand(1);
+	//the particles fill one octant of a cubic box with particlesPerCell particles in each cell
+	const double size = std::round(std::cbrt(double(particleNum) * 8.0 / particlesPerCell));
+	const glm::dvec3 dimensions(size, size, size);
+	auto grid = std::make_shared<macgrid::BridsonSolverGrid>(dimensions, 1.0, false, 1.0);
+	grid->incompressibilityMaxIterationCount = 80;
+	grid->averagePressure = particlesPerCell;
+	auto particles = std::make_shared<particles::HashedParticles>(particleNum, 0.3, grid->dimensions, grid->cellD, false, dimensions.z / 2);
+
+	simulator::Simulator::SimulatorConfig config;
+	config.p2gScheduling = scheduling;
+	simulator::Simulator simulator(config, particles, grid);
+	for (int step = 0; step < warmupStepCount; step++)
+		simulator.simulate(dt);
+
+	Timing timing;
+	long long previousP2G = simulator.getStepDuration().at("P2GTransfer");
+	for (int step = 0; step < measuredStepCount; step++) {
+		const auto start = std::chrono::high_resolution_clock::now();
+		simulator.simulate(dt);
+		timing.step += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		const long long p2g = simulator.getStepDuration().at("P2GTransfer");
+		timing.p2g += lastStepDuration(p2g, previousP2G) / 1000.0;
+		previousP2G = p2g;
+	}
+	timing.p2g /= measuredStepCount;
+	timing.step /= measuredStepCount;
+	return timing;
+}
+
+}
+
+int main(int argc, char** argv) {
+	std::vector<int> particleNums;
+	for (int i = 1; i < argc; i++)
+		particleNums.push_back(std::atoi(argv[i]));
+	if (particleNums.empty())
+		particleNums = { 100000, 500000, 1000000 };
+	std::vector<int> threadNums;
+	for (int threadNum = 1; threadNum < omp_get_max_threads(); threadNum *= 2)
+		threadNums.push_back(threadNum);
+	threadNums.push_back(omp_get_max_threads());
+
+	std::printf("%10s %8s %16s %16s %17s %17s %8s\n", "particles", "threads", "atomic P2G ms", "colored P2G ms",
+		"atomic step ms", "colored step ms", "speedup");
+	for (int particleNum : particleNums) {
+		for (int threadNum : threadNums) {
+			const Timing atomic = runScene(particleNum, threadNum, P2GScheduling::ATOMIC);
+			const Timing colored = runScene(particleNum, threadNum, P2GScheduling::COLORED);
+			std::printf("%10d %8d %16.2f %16.2f %17.2f %17.2f %8.2f\n", particleNum, threadNum, atomic.p2g, colored.p2g,
+				atomic.step, colored.step, atomic.p2g / colored.p2g);
+			std::fflush(stdout);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include "simulator/particles/hashedParticles.h"
+#include "simulator/macGrid/bridsonSolverGrid.h"
+
+using namespace genericfsim;
+
+/**
+ * Measures the per element cost of the std::function overloads of HashedParticles::forEach and MacGrid::forEachCell
+ * against the templated visitors, with a loop body that only sums a few values (single threaded).
+ *
+ * Usage: visitor_benchmark [particle count] (1000000 by default)
+ */
+
+namespace {
+
+constexpr int repeatCount = 20;
+
+/**
+ * Runs a visit repeatCount times and returns the time per element in ns.
+ */
+template<typename F>
+double timePerElement(long long elementNum, F&& visit) {
+	const auto start = std::chrono::high_resolution_clock::now();
+	for (int i = 0; i < repeatCount; i++)
+		visit();
+	const double ns = std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count();
+	return ns / (double(elementNum) * repeatCount);
+}
+
+void printResult(const char* name, double templated, double function, double checksum) {
+	std::printf("%-24s %12.3f %16.3f %12.3f   (checksum %g)\n", name, templated, function, function - templated, checksum);
+}
+
+}
+
+int main(int argc, char** argv) {
+	const int particleNum = argc > 1 ? std::atoi(argv[1]) : 1000000;
+	std::srand(1);
+	const glm::dvec3 dimensions(100, 100, 100);
+	macgrid::BridsonSolverGrid grid(dimensions, 1.0, false, 1.0);
+	particles::HashedParticles particles(particleNum, 0.3, grid.dimensions, grid.cellD, false, dimensions.z / 2);
+
+	std::printf("%-24s %12s %16s %12s\n", "ns per element", "template", "std::function", "overhead");
+
+	double templatedSum = 0.0;
+	double functionSum = 0.0;
+	const auto particleVisitor = [&](double& sum) {
+		return [&sum](particles::Particle& particle, int) {
+			sum += particle.pos.x + particle.v.y;
+		};
+	};
+	const double particleTemplated = timePerElement(particleNum, [&]() {
+		particles.forEach(false, particleVisitor(templatedSum));
+	});
+	const double particleFunction = timePerElement(particleNum, [&]() {
+		particles.forEach(false, std::function<void(particles::Particle&, int)>(particleVisitor(functionSum)));
+	});
+	printResult("HashedParticles::forEach", particleTemplated, particleFunction, templatedSum - functionSum);
+
+	templatedSum = 0.0;
+	functionSum = 0.0;
+	const long long cellNum = static_cast<long long>(grid.gridSize.x) * grid.gridSize.y * grid.gridSize.z;
+	const auto cellVisitor = [&](double& sum) {
+		return [&sum](glm::ivec3 pos, macgrid::MacGridCell& cell) {
+			sum += cell.avgPNum + pos.x;
+		};
+	};
+	const double cellTemplated = timePerElement(cellNum, [&]() {
+		grid.forEachCell(false, true, cellVisitor(templatedSum));
+	});
+	const double cellFunction = timePerElement(cellNum, [&]() {
+		grid.forEachCell(false, true, std::function<void(glm::ivec3, macgrid::MacGridCell&)>(cellVisitor(functionSum)));
+	});
+	printResult("MacGrid::forEachCell", cellTemplated, cellFunction, templatedSum - functionSum);
+	return EXIT_SUCCESS;
+}
@@ -13,19 +13,38 @@ SimulationManager::SimulationManager(const glm::dvec3& dimensions, const Simulat
 	this->currentConfig = config;
 	this->currentParticleNum = particleNum;
 
-	if(config.gridSolverType == SimulationConfig::GridSolverType::BRIDSON)
-		macGrid = std::make_shared<BridsonSolverGrid>(dimensions, config.gridResolution, twoD, config.fluidDensity);
-	else
-		macGrid = std::make_shared<BasicMacGrid>(dimensions, config.gridResolution, twoD);
+	macGrid = createMacGrid(config);
+	applyGridConfig(config);
+
+	hashedParticles = std::make_shared<HashedParticles>(particleNum, config.particleRadius, macGrid->dimensions, macGrid->cellD, twoD, dimensions.z / 2, config.neighbourGridType);
+	simulator = std::make_shared<Simulator>(config.simulatorConfig, hashedParticles, macGrid);
+}
+
+std::shared_ptr<MacGrid> SimulationManager::createMacGrid(const SimulationConfig& config) const {
+	switch (config.gridSolverType) {
+	case SimulationConfig::GridSolverType::BRIDSON:
+		return std::make_shared<BridsonSolverGrid>(dimensions, config.gridResolution, twoD, config.fluidDensity);
+	case SimulationConfig::GridSolverType::MULTIGRID:
+		return std::make_shared<MultigridSolverGrid>(dimensions, config.gridResolution, twoD, config.fluidDensity);
+	default:
+		return std::make_shared<BasicMacGrid>(dimensions, config.gridResolution, twoD);
+	}
+}
+
+void SimulationManager::applyGridConfig(const SimulationConfig& config) {
 	macGrid->averagePressure = config.averagePressure;
 	macGrid->incompressibilityMaxIterationCount = config.incompressibilityIterationCount;
 	macGrid->isTopOfContainerSolid = config.isTopOfContainerSolid;
 	macGrid->pressureEnabled = config.pressureEnabled;
 	macGrid->pressureK = config.pressureK;
 	macGrid->residualTolerance = config.residualTolerance;
-
-	hashedParticles = std::make_shared<HashedParticles>(particleNum, config.particleRadius, macGrid->dimensions, macGrid->cellD, twoD, dimensions.z / 2);
-	simulator = std::make_shared<Simulator>(config.simulatorConfig, hashedParticles, macGrid);
+	macGrid->fluidDensity = config.fluidDensity;
+	macGrid->velocityExtrapolationLayerCount = config.velocityExtrapolationLayerCount;
+	macGrid->sparseTilesEnabled = config.sparseGrid;
+	if (BridsonSolverGrid* bridsonGrid = dynamic_cast<BridsonSolverGrid*>(macGrid.get()); bridsonGrid != nullptr) {
+		bridsonGrid->preconditionerOrdering = config.preconditionerOrdering;
+		bridsonGrid->warmStartEnabled = config.warmStartPressure;
+	}
 }
 
 void SimulationManager::setConfig(const SimulationConfig& config) {
@@ -55,11 +74,10 @@ void SimulationManager::restartSimulation() {
 	restart = true;
 }
 
-const genericfsim::particles::Particle& SimulationManager::getParticleData(int index) {
+genericfsim::particles::ParticleState SimulationManager::getParticleData(int index) {
 	std::unique_lock lock(sharedDataMutex);
-	if (index < hashedParticles->getParticleNum())
-		return hashedParticles->getParticleAt(index);
-	return hashedParticles->getParticleAt(0);
+	Particle particle = hashedParticles->getParticleAt(index < hashedParticles->getParticleNum() ? index : 0);
+	return ParticleState{ particle.pos, particle.v };
 }
 
 int SimulationManager::getParticleIndex(const glm::dvec3& pos) {
@@ -67,7 +85,7 @@ int SimulationManager::getParticleIndex(const glm::dvec3& pos) {
 	double r = hashedParticles->getParticleR();
 	double r2 = r * r;
 	for (int p = 0; p < currentParticleNum; p++) {
-		glm::dvec3 p2p = pos - hashedParticles->getParticleAt(p).pos;
+		glm::dvec3 p2p = pos - glm::dvec3(hashedParticles->getParticleAt(p).pos);
 		double distance2 = glm::dot(p2p, p2p);
 		if (distance2 < r2)
 			return p;
@@ -103,7 +121,7 @@ glm::dvec3 SimulationManager::getCellD() {
 	return macGrid->cellD;
 }
 
-const MacGridCell& SimulationManager::getCellAt(const glm::dvec3& pos) {
+MacGridCell SimulationManager::getCellAt(const glm::dvec3& pos) {
 	std::unique_lock lock(sharedDataMutex);
 	const glm::dvec3 gridPos = pos * macGrid->cellDInv;
 	if(gridPos.x < getGridSize().x && gridPos.y < getGridSize().y && (gridPos.z < getGridSize().z || macGrid->twoD))
@@ -111,7 +129,7 @@ const MacGridCell& SimulationManager::getCellAt(const glm::dvec3& pos) {
 	return macGrid->cell(0, 0, 1);
 }
 
-const MacGridCell& SimulationManager::getCellAt(int x, int y, int z) {
+MacGridCell SimulationManager::getCellAt(int x, int y, int z) {
 	std::unique_lock lock(sharedDataMutex);
 	if (x < getGridSize().x && y < getGridSize().y && (z < getGridSize().z || macGrid->twoD))
 		return macGrid->cell(x, y, macGrid->twoD ? 1 : z);
@@ -174,20 +192,11 @@ void SimulationManager::simulationThreadWorker() {
 			std::unique_lock lock(sharedDataMutex);
 
 			if (config.gridResolution != currentConfig.gridResolution || config.gridSolverType != currentConfig.gridSolverType) {
-				if (config.gridSolverType == SimulationConfig::GridSolverType::BRIDSON)
-					macGrid = std::make_shared<BridsonSolverGrid>(dimensions, config.gridResolution, twoD, config.fluidDensity);
-				else
-					macGrid = std::make_shared<BasicMacGrid>(dimensions, config.gridResolution, twoD);
+				macGrid = createMacGrid(config);
 				hashedParticles->updateGridParams(macGrid->cellD, macGrid->dimensions);
 				simulator->setNewMacGrid(macGrid);
 			}
-			macGrid->averagePressure = config.averagePressure;
-			macGrid->incompressibilityMaxIterationCount = config.incompressibilityIterationCount;
-			macGrid->isTopOfContainerSolid = config.isTopOfContainerSolid;
-			macGrid->pressureEnabled = config.pressureEnabled;
-			macGrid->pressureK = config.pressureK;
-			macGrid->residualTolerance = config.residualTolerance;
-			macGrid->fluidDensity = config.fluidDensity;
+			applyGridConfig(config);
 
 			if (particleNum != currentParticleNum) {
 				hashedParticles->setParticleNum(particleNum);
@@ -211,7 +220,7 @@ void SimulationManager::simulationThreadWorker() {
 			if (restart) {
 				restart = false;
 				hashedParticles = std::make_shared<HashedParticles>(particleNum, config.particleRadius,
-																	macGrid->dimensions, macGrid->cellD, twoD, dimensions.z / 2);
+																	macGrid->dimensions, macGrid->cellD, twoD, dimensions.z / 2, config.neighbourGridType);
 				simulator->setNewHashedParticles(hashedParticles);
 			}
 
@@ -226,7 +235,7 @@ void SimulationManager::simulationThreadWorker() {
 				float density = 0;
 				auto cells = macGrid->getCellsAround(p.pos);
 				for (auto& c : cells)
-					density += trilinearInterpoll(p.pos, c.cell.pos, macGrid->cellDInv) * c.cell.avgPNum;
+					density += trilinearInterpoll(p.pos, c.pos, macGrid->cellDInv) * c.avgPNum;
 				particleData[index].density = density;
 			});
 
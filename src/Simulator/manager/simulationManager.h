@@ -3,6 +3,7 @@
 #include "../simulator/simulator.h"
 #include "../simulator/macGrid/basicMacGrid.h"
 #include "../simulator/macGrid/bridsonSolverGrid.h"
+#include "../simulator/macGrid/multigridSolverGrid.h"
 #include "../simulator/particles/hashedParticles.h"
 
 #include <vector>
@@ -20,6 +21,8 @@ using P2G2PType = genericfsim::simulator::Simulator::P2G2PType;
 using RectengularObstacle = genericfsim::obstacle::RectengularObstacle;
 using SphericalObstacle = genericfsim::obstacle::SphericalObstacle;
 using Obstacle = genericfsim::obstacle::Obstacle;
+using PreconditionerOrdering = genericfsim::macgrid::BridsonSolverGrid::PreconditionerOrdering;
+using NeighbourGridType = genericfsim::particles::HashedParticles::NeighbourGridType;
 
 struct SimulationConfig {
 	float gridResolution;
@@ -31,11 +34,16 @@ struct SimulationConfig {
 	bool pressureEnabled;
 	float residualTolerance = 1e-6;
 	float fluidDensity = 1.0;
+	int velocityExtrapolationLayerCount = 2;
+	bool sparseGrid = false;	//only the sweeps are restricted to the tiles around the particles, the grid memory is not reduced
 	
 	enum class GridSolverType {
-		BRIDSON, BASIC
+		BRIDSON, BASIC, MULTIGRID
 	};
 	GridSolverType gridSolverType = GridSolverType::BRIDSON;
+	PreconditionerOrdering preconditionerOrdering = PreconditionerOrdering::LEXICOGRAPHIC;
+	bool warmStartPressure = false;
+	NeighbourGridType neighbourGridType = NeighbourGridType::DENSE;	//only applied when the particles are recreated (on restart)
 };
 
 /**
@@ -84,12 +92,12 @@ public:
 	std::vector<ParticleGfxData> getParticleGfxData();
 
 	/**
-	 * Gets a reference for a paricle with a certain index. Be careful, because the particle data might be changed by another thread.
+	 * Gets a copy of the state of a paricle with a certain index.
 	 * 
 	 * \param index - the particle index
-	 * \return - a const ref to the particle
+	 * \return - the position and velocity of the particle
 	 */
-	const genericfsim::particles::Particle& getParticleData(int index);
+	genericfsim::particles::ParticleState getParticleData(int index);
 
 	/**
 	 * Gets the index of the particle based on the pos.
@@ -100,19 +108,19 @@ public:
 	int getParticleIndex(const glm::dvec3& pos);
 
 	/**
-	 * Gets a const cell ref base on position in space. Be careful, because the particle data might be changed by another thread.
+	 * Gets a cell view base on position in space. Be careful, because the cell data might be changed by another thread.
 	 * 
 	 * \param pos - position in space
-	 * \return - const ref for the cell
+	 * \return - view of the cell
 	 */
-	const genericfsim::macgrid::MacGridCell& getCellAt(const glm::dvec3& pos);
+	genericfsim::macgrid::MacGridCell getCellAt(const glm::dvec3& pos);
 
 	/**
-	 * Gets a const cell ref base on the grid cell indexes. Be careful, because the particle data might be changed by another thread.
+	 * Gets a cell view base on the grid cell indexes. Be careful, because the cell data might be changed by another thread.
 	 *
-	 * \return - const ref for the cell
+	 * \return - view of the cell
 	 */
-	const genericfsim::macgrid::MacGridCell& getCellAt(int x, int y, int z);
+	genericfsim::macgrid::MacGridCell getCellAt(int x, int y, int z);
 
 	/**
 	 * Returns all the Obstacles currently stored in the simulator.
@@ -222,6 +230,8 @@ private:
 	const glm::dvec3 dimensions;
 
 	void simulationThreadWorker();
+	std::shared_ptr<genericfsim::macgrid::MacGrid> createMacGrid(const SimulationConfig& config) const;
+	void applyGridConfig(const SimulationConfig& config);
 
 private:
 	//Shared variables between the two threads
@@ -11,8 +11,11 @@ public:
 	int solveIncompressibility(bool parallel, double dt) override;
 
 private:
+	std::array<std::vector<glm::ivec3>, 2> colorCells;	//the fluid cells of the two colours of the parallel relaxation
+
 	void solveIncompressibilityParallel();
 	void solveIncompressibilitySingleThreaded();
+	inline void relaxCell(const glm::ivec3& pos);
 };
 
 }
@@ -2,327 +2,421 @@
 #include <iostream>
 #include <atomic>
 #include <mutex>
+#include <algorithm>
+#include <cmath>
+#include "../util/vectorOps.h"
 
 using namespace genericfsim::macgrid;
+using namespace genericfsim::util;
 
 BridsonSolverGrid::BridsonSolverGrid(const glm::dvec3& dimensions, float cellD, bool twoD, double fluidDensity = 1.0) : MacGrid(dimensions, cellD, twoD) {
 	this->fluidDensity = fluidDensity;
 }
 
-void parallelFor(bool parallel, int xStart, int xEnd, std::function<void(int)>&& func) {
-	if (parallel) {
-#pragma omp parallel for
-		for (int x = xStart; x < xEnd; x++) {
-			func(x);
-		}
-	}
-	else {
-		for (int x = xStart; x < xEnd; x++) {
-			func(x);
-		}
-	}
-}
-
-void reverseParallelFor(bool parallel, int xStart, int xEnd, std::function<void(int)>&& func) {
-	if (parallel) {
-#pragma omp parallel for
-		for (int x = xStart; x > xEnd; x--) {
-			func(x);
-		}
-	}
-	else {
-		for (int x = xStart; x > xEnd; x--) {
-			func(x);
-		}
-	}
-}
-
 void BridsonSolverGrid::calculateAMatrix(bool parallel, double dt) {
 	const double scale = dt / (fluidDensity * cellD.x * cellD.x);
 	parallelFor(parallel, 0, fluidCellCount, [&](int p) {
+		const auto& neighbours = fluidCellNeighbours[p];
 		AMatrixRow& row = aMatrix[p];
-		row.nonSolidNeighbours = 0;
-		row.xWater = 0;
-		row.yWater = 0;
-		row.zWater = 0;
-		const glm::ivec3 pos = fluidCellPositions[p];
-
-		if (cell<0,1>(pos).type == MacGridCell::CellType::WATER) {
-			row.nonSolidNeighbours += scale;
-			row.xWater = -scale;
-		}
-		else if (cell<0,1>(pos).type == MacGridCell::CellType::AIR)
-			row.nonSolidNeighbours += scale;
-		if (cell<0,-1>(pos).type != MacGridCell::CellType::SOLID)
-			row.nonSolidNeighbours += scale;
-
-		if (cell<1,1>(pos).type == MacGridCell::CellType::WATER) {
-			row.nonSolidNeighbours += scale;
-			row.yWater = -scale;
-		}
-		else if (cell<1,1>(pos).type == MacGridCell::CellType::AIR)
-			row.nonSolidNeighbours += scale;
-		if (cell<1,-1>(pos).type != MacGridCell::CellType::SOLID)
-			row.nonSolidNeighbours += scale;
-
-		if (cell<2,1>(pos).type == MacGridCell::CellType::WATER) {
-			row.nonSolidNeighbours += scale;
-			row.zWater = -scale;
-		}
-		else if (cell<2,1>(pos).type == MacGridCell::CellType::AIR)
-			row.nonSolidNeighbours += scale;
-		if (cell<2,-1>(pos).type != MacGridCell::CellType::SOLID)
-			row.nonSolidNeighbours += scale;
+		row.nonSolidNeighbours = neighbours.nonSolidCount * scale;
+		row.xWater = neighbours.next(0) >= 0 ? -scale : 0;
+		row.yWater = neighbours.next(1) >= 0 ? -scale : 0;
+		row.zWater = neighbours.next(2) >= 0 ? -scale : 0;
 	});
 }
 
-std::vector<double> BridsonSolverGrid::calculateRHS(bool parallel) {
-	std::vector<double> rhs(fluidCellCount, 0.0);
+void BridsonSolverGrid::reserveWorkspace() {
+	if (pressure.size() >= fluidCellCount)
+		return;
+	pressure.resize(fluidCellCount);
+	r.resize(fluidCellCount);
+	z.resize(fluidCellCount);
+	s.resize(fluidCellCount);
+	q_scratchpad.resize(fluidCellCount);
+}
+
+double BridsonSolverGrid::calculateRHS(bool parallel) {
 	const double scale = 1.0 / cellD.x;
-	parallelFor(parallel, 0, fluidCellCount, [&](int index) {
+	return parallelSum(parallel, 0, fluidCellCount, [&](int index) {
 		const glm::ivec3 pos = fluidCellPositions[index];
-		const auto& currentCell = cell(pos);
-		rhs[index] = -scale * (currentCell.faces[0].v2 + currentCell.faces[1].v2 + currentCell.faces[2].v2
+		const auto currentCell = cell(pos);
+		r[index] = -scale * (currentCell.faces[0].v2 + currentCell.faces[1].v2 + currentCell.faces[2].v2
 			- cell<0,-1>(pos).faces[0].v2 - cell<1,-1>(pos).faces[1].v2 - cell<2,-1>(pos).faces[2].v2) + (pressureEnabled ? (currentCell.avgPNum - averagePressure) * pressureK : 0.0);
+		pressure[index] = 0.0;
+		s[index] = 0.0;
+		return static_cast<double>(r[index]) * r[index];
 	});
-	return rhs;
 }
 
-void BridsonSolverGrid::calculatePreconditioner() {
-	preconditioner.assign(fluidCellCount, 0.0);
-	for (int index = 0; index < fluidCellCount; index++) {
-		const glm::ivec3 pos = fluidCellPositions[index];
+void BridsonSolverGrid::buildCellOrdering() {
+	const bool redBlack = preconditionerOrdering == PreconditionerOrdering::RED_BLACK;
+	const int groupNum = redBlack ? 2 : gridSize.x + gridSize.y + gridSize.z;
+	const auto groupOf = [redBlack](const glm::ivec3& pos) {
+		return redBlack ? (pos.x + pos.y + pos.z) % 2 : pos.x + pos.y + pos.z;
+	};
 
-		double eNeg = 0;
-		double eNegTau = 0;
-		if (const auto& currentCell = cell<0,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			const auto& Axneg = aMatrix[fluidCellId];
-			const double AxnegTimesPrecon = Axneg.xWater * preconditioner[fluidCellId];
-			eNeg += AxnegTimesPrecon * AxnegTimesPrecon;
-			eNegTau += AxnegTimesPrecon * (Axneg.yWater + Axneg.zWater) * preconditioner[fluidCellId];
-		}
-		if (const auto& currentCell = cell<1,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			const auto& Ayneg = aMatrix[fluidCellId];
-			const double AynegTimesPrecon = Ayneg.yWater * preconditioner[fluidCellId];
-			eNeg += AynegTimesPrecon * AynegTimesPrecon;
-			eNegTau += AynegTimesPrecon * (Ayneg.xWater + Ayneg.zWater) * preconditioner[fluidCellId];
+	orderedCells.resize(fluidCellCount);
+	orderedCellGroups.assign(groupNum + 1, 0);
+	for (int index = 0; index < fluidCellCount; index++)
+		orderedCellGroups[groupOf(fluidCellPositions[index]) + 1]++;
+	for (int group = 0; group < groupNum; group++)
+		orderedCellGroups[group + 1] += orderedCellGroups[group];
+	std::vector<int> nextPos(orderedCellGroups.begin(), orderedCellGroups.end() - 1);
+	for (int index = 0; index < fluidCellCount; index++)
+		orderedCells[nextPos[groupOf(fluidCellPositions[index])]++] = index;
+}
+
+template<typename F>
+void BridsonSolverGrid::forEachOrderedCell(bool parallel, bool reverse, F&& func) {
+	sumOrderedCells(parallel, reverse, [&](int index, int group) {
+		func(index, group);
+		return 0.0;
+	});
+}
+
+template<typename F>
+double BridsonSolverGrid::sumOrderedCells(bool parallel, bool reverse, F&& func) {
+	double result = 0.0;
+	if (preconditionerOrdering == PreconditionerOrdering::LEXICOGRAPHIC) {
+		if (reverse) {
+			for (int index = fluidCellCount - 1; index >= 0; index--)
+				result += func(index, 0);
 		}
-		if (const auto& currentCell = cell<2,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			const auto& Azneg = aMatrix[fluidCellId];
-			const double AznegTimesPrecon = Azneg.zWater * preconditioner[fluidCellId];
-			eNeg += AznegTimesPrecon * AznegTimesPrecon;
-			eNegTau += AznegTimesPrecon * (Azneg.xWater + Azneg.yWater) * preconditioner[fluidCellId];
+		else {
+			for (int index = 0; index < fluidCellCount; index++)
+				result += func(index, 0);
 		}
-		double e = aMatrix[index].nonSolidNeighbours - eNeg - eNegTau * tau;
-		if(e < sigma * aMatrix[index].nonSolidNeighbours)
-			e = (aMatrix[index].nonSolidNeighbours < 1e-6 ? 1.0 : aMatrix[index].nonSolidNeighbours);
-		preconditioner[index] = 1.0 / sqrt(e);
+		return result;
 	}
+	const int groupNum = orderedCellGroups.size() - 1;
+	for (int g = 0; g < groupNum; g++) {
+		const int group = reverse ? groupNum - 1 - g : g;
+		result += parallelSum(parallel, orderedCellGroups[group], orderedCellGroups[group + 1], [&](int i) {
+			return func(orderedCells[i], group);
+		});
+	}
+	return result;
 }
 
-void BridsonSolverGrid::applyPreconditioner(const std::vector<double>& r, std::vector<double>& q_scratchpad, std::vector<double>& result) {
-	const int xMult = gridSize.z * gridSize.y;
-	for (int index = 0; index < fluidCellCount; index++) {
-		const glm::ivec3 pos = fluidCellPositions[index];
+template<typename F>
+void BridsonSolverGrid::forEachWaterNeighbour(int index, F&& func) const {
+	const auto& neighbours = fluidCellNeighbours[index];
+	for (int axis = 0; axis < 3; axis++) {
+		if (const int next = neighbours.next(axis); next >= 0)
+			func(next, aMatrix[index].water(axis));
+		if (const int prev = neighbours.prev(axis); prev >= 0)
+			func(prev, aMatrix[prev].water(axis));
+	}
+}
+
+double BridsonSolverGrid::calculatePreconditionerAt(int index) const {
+	const auto& neighbours = fluidCellNeighbours[index];
+
+	double eNeg = 0;
+	double eNegTau = 0;
+	if (const int fluidCellId = neighbours.prev(0); fluidCellId >= 0) {
+		const auto& Axneg = aMatrix[fluidCellId];
+		const double AxnegTimesPrecon = Axneg.xWater * preconditioner[fluidCellId];
+		eNeg += AxnegTimesPrecon * AxnegTimesPrecon;
+		eNegTau += AxnegTimesPrecon * (Axneg.yWater + Axneg.zWater) * preconditioner[fluidCellId];
+	}
+	if (const int fluidCellId = neighbours.prev(1); fluidCellId >= 0) {
+		const auto& Ayneg = aMatrix[fluidCellId];
+		const double AynegTimesPrecon = Ayneg.yWater * preconditioner[fluidCellId];
+		eNeg += AynegTimesPrecon * AynegTimesPrecon;
+		eNegTau += AynegTimesPrecon * (Ayneg.xWater + Ayneg.zWater) * preconditioner[fluidCellId];
+	}
+	if (const int fluidCellId = neighbours.prev(2); fluidCellId >= 0) {
+		const auto& Azneg = aMatrix[fluidCellId];
+		const double AznegTimesPrecon = Azneg.zWater * preconditioner[fluidCellId];
+		eNeg += AznegTimesPrecon * AznegTimesPrecon;
+		eNegTau += AznegTimesPrecon * (Azneg.xWater + Azneg.yWater) * preconditioner[fluidCellId];
+	}
+	double e = aMatrix[index].nonSolidNeighbours - eNeg - eNegTau * tau;
+	if(e < sigma * aMatrix[index].nonSolidNeighbours)
+		e = (aMatrix[index].nonSolidNeighbours < 1e-6 ? 1.0 : aMatrix[index].nonSolidNeighbours);
+	return 1.0 / sqrt(e);
+}
+
+double BridsonSolverGrid::calculateRedBlackPreconditionerAt(int index, bool black) const {
+	double e = aMatrix[index].nonSolidNeighbours;
+	if (black) {
+		//all water neighbours of a black cell are red, so they precede it in the ordering
+		forEachWaterNeighbour(index, [&](int fluidCellId, double coefficient) {
+			double neighbourOffDiagonalSum = 0;
+			forEachWaterNeighbour(fluidCellId, [&](int, double c) {
+				neighbourOffDiagonalSum += c;
+			});
+			const double coefficientTimesPrecon = coefficient * preconditioner[fluidCellId];
+			e -= coefficientTimesPrecon * coefficientTimesPrecon;
+			e -= tau * coefficientTimesPrecon * (neighbourOffDiagonalSum - coefficient) * preconditioner[fluidCellId];
+		});
+	}
+	if (e < sigma * aMatrix[index].nonSolidNeighbours)
+		e = (aMatrix[index].nonSolidNeighbours < 1e-6 ? 1.0 : aMatrix[index].nonSolidNeighbours);
+	return 1.0 / sqrt(e);
+}
+
+void BridsonSolverGrid::calculatePreconditioner(bool parallel) {
+	preconditioner.assign(fluidCellCount, 0.0);
+	if (preconditionerOrdering != PreconditionerOrdering::LEXICOGRAPHIC)
+		buildCellOrdering();
+	const bool redBlack = preconditionerOrdering == PreconditionerOrdering::RED_BLACK;
+	forEachOrderedCell(parallel, false, [&](int index, int group) {
+		preconditioner[index] = redBlack ? calculateRedBlackPreconditionerAt(index, group == 1) : calculatePreconditionerAt(index);
+	});
+}
+
+double BridsonSolverGrid::applyPreconditioner(bool parallel) {
+	if (preconditionerOrdering == PreconditionerOrdering::RED_BLACK) {
+		forEachOrderedCell(parallel, false, [&](int index, int group) {
+			double qneg = 0;
+			if (group == 1) {
+				forEachWaterNeighbour(index, [&](int fluidCellId, double coefficient) {
+					qneg += coefficient * q_scratchpad[fluidCellId] * preconditioner[fluidCellId];
+				});
+			}
+			q_scratchpad[index] = (r[index] - qneg) * preconditioner[index];
+		});
+		return sumOrderedCells(parallel, true, [&](int index, int group) {
+			double tneg = 0;
+			if (group == 0) {
+				forEachWaterNeighbour(index, [&](int fluidCellId, double coefficient) {
+					tneg += coefficient * z[fluidCellId];
+				});
+			}
+			z[index] = (q_scratchpad[index] - tneg * preconditioner[index]) * preconditioner[index];
+			return static_cast<double>(z[index]) * r[index];
+		});
+	}
+
+	forEachOrderedCell(parallel, false, [&](int index, int) {
+		const auto& neighbours = fluidCellNeighbours[index];
 		double qneg = 0;
-		if (const auto& currentCell = cell<0,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
+		if (const int fluidCellId = neighbours.prev(0); fluidCellId >= 0)
 			qneg += aMatrix[fluidCellId].xWater * q_scratchpad[fluidCellId] * preconditioner[fluidCellId];
-		}
-		if (const auto& currentCell = cell<1,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
+		if (const int fluidCellId = neighbours.prev(1); fluidCellId >= 0)
 			qneg += aMatrix[fluidCellId].yWater * q_scratchpad[fluidCellId] * preconditioner[fluidCellId];
-		}
-		if (const auto& currentCell = cell<2,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
+		if (const int fluidCellId = neighbours.prev(2); fluidCellId >= 0)
 			qneg += aMatrix[fluidCellId].zWater * q_scratchpad[fluidCellId] * preconditioner[fluidCellId];
-		}
 		q_scratchpad[index] = (r[index] - qneg) * preconditioner[index];
-	}
-	for (int index = fluidCellCount - 1; index >= 0; index--) {
-		const glm::ivec3 pos = fluidCellPositions[index];
-		double tneg = 0;
+	});
+	return sumOrderedCells(parallel, true, [&](int index, int) {
+		const auto& neighbours = fluidCellNeighbours[index];
 		const auto& currentA = aMatrix[index];
-		if (const auto& currentCell = cell<0,1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			tneg += currentA.xWater * result[fluidCellId];
-		}
-		if (const auto& currentCell = cell<1,1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			tneg += currentA.yWater * result[fluidCellId];
-		}
-		if (const auto& currentCell = cell<2,1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			tneg += currentA.zWater * result[fluidCellId];
-		}
-		result[index] = (q_scratchpad[index] - tneg * preconditioner[index]) * preconditioner[index];
-	}
+		double tneg = 0;
+		if (const int fluidCellId = neighbours.next(0); fluidCellId >= 0)
+			tneg += currentA.xWater * z[fluidCellId];
+		if (const int fluidCellId = neighbours.next(1); fluidCellId >= 0)
+			tneg += currentA.yWater * z[fluidCellId];
+		if (const int fluidCellId = neighbours.next(2); fluidCellId >= 0)
+			tneg += currentA.zWater * z[fluidCellId];
+		z[index] = (q_scratchpad[index] - tneg * preconditioner[index]) * preconditioner[index];
+		return static_cast<double>(z[index]) * r[index];
+	});
 }
 
-void BridsonSolverGrid::applyAMatrix(bool parallel, const std::vector<double>& vec, std::vector<double>& result) {
-	const int xMult = gridSize.z * gridSize.y;
-	result.assign(fluidCellCount, 0.0);
-	parallelFor(parallel, 0, fluidCellCount, [&](int index) {
-		const glm::ivec3 pos = fluidCellPositions[index];
-		const auto& currentA = aMatrix[index];
-		double value = currentA.nonSolidNeighbours * vec[index];
-		if (const auto& currentCell = cell<0,1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			value += currentA.xWater * vec[fluidCellId];
-		}
-		if (const auto& currentCell = cell<1,1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			value += currentA.yWater * vec[fluidCellId];
-		}
-		if (const auto& currentCell = cell<2,1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			value += currentA.zWater * vec[fluidCellId];
-		}
-		if (const auto& currentCell = cell<0,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			value += aMatrix[fluidCellId].xWater * vec[fluidCellId];
-		}
-		if (const auto& currentCell = cell<1,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			value += aMatrix[fluidCellId].yWater * vec[fluidCellId];
-		}
-		if (const auto& currentCell = cell<2,-1>(pos); currentCell.type == MacGridCell::CellType::WATER) {
-			const int fluidCellId = currentCell.id;
-			value += aMatrix[fluidCellId].zWater * vec[fluidCellId];
-		}
-		result[index] = value;
-	});
+double BridsonSolverGrid::applyAMatrixAt(int index, const std::vector<Real>& vec) const {
+	const auto& neighbours = fluidCellNeighbours[index];
+	const auto& currentA = aMatrix[index];
+	double value = currentA.nonSolidNeighbours * vec[index];
+	for (int axis = 0; axis < 3; axis++) {
+		if (const int next = neighbours.next(axis); next >= 0)
+			value += currentA.water(axis) * vec[next];
+	}
+	for (int axis = 0; axis < 3; axis++) {
+		if (const int prev = neighbours.prev(axis); prev >= 0)
+			value += aMatrix[prev].water(axis) * vec[prev];
+	}
+	return value;
 }
 
-double dotProduct(bool parallel, const std::vector<double>& vec1, const std::vector<double>& vec2) {
+double BridsonSolverGrid::updateSearchAndApplyAMatrix(bool parallel, double beta) {
 	double result = 0.0;
 	if (parallel) {
-		#pragma omp parallel for reduction(+:result)
-		for (int i = 0; i < vec1.size(); i++) {
-			result += vec1[i] * vec2[i];
+#pragma omp parallel
+		{
+#pragma omp for
+			for (int index = 0; index < fluidCellCount; index++)
+				s[index] = s[index] * beta + z[index];
+#pragma omp for reduction(+:result)
+			for (int index = 0; index < fluidCellCount; index++) {
+				z[index] = applyAMatrixAt(index, s);
+				result += static_cast<double>(s[index]) * z[index];
+			}
 		}
 	}
 	else {
-		for (int i = 0; i < vec1.size(); i++) {
-			result += vec1[i] * vec2[i];
+		for (int index = 0; index < fluidCellCount; index++)
+			s[index] = s[index] * beta + z[index];
+		for (int index = 0; index < fluidCellCount; index++) {
+			z[index] = applyAMatrixAt(index, s);
+			result += static_cast<double>(s[index]) * z[index];
 		}
 	}
 	return result;
 }
 
-void multAdd(bool parallel, std::vector<double>& vec, const std::vector<double>& vec1, double scalar) {
+double BridsonSolverGrid::updatePressureAndResidual(bool parallel, double alpha) {
+	double max = 0.0;
 	if (parallel) {
-#pragma omp parallel for
-		for (int i = 0; i < vec.size(); i++) {
-			vec[i] += vec1[i] * scalar;
+#pragma omp parallel
+		{
+			double localMax = 0.0;
+#pragma omp for nowait
+			for (int index = 0; index < fluidCellCount; index++) {
+				pressure[index] += s[index] * alpha;
+				r[index] += z[index] * -alpha;
+				localMax = std::max<double>(localMax, std::abs(r[index]));
+			}
+#pragma omp critical
+			max = std::max(max, localMax);
 		}
 	}
 	else {
-		for (int i = 0; i < vec.size(); i++) {
-			vec[i] += vec1[i] * scalar;
+		for (int index = 0; index < fluidCellCount; index++) {
+			pressure[index] += s[index] * alpha;
+			r[index] += z[index] * -alpha;
+			max = std::max<double>(max, std::abs(r[index]));
 		}
 	}
+	return max;
 }
 
-void multSelfAndAdd(bool parallel, std::vector<double>& vec, const std::vector<double>& vec1, double scalar) {
+double BridsonSolverGrid::applyWarmStart(bool parallel, double dt) {
+	const double dtRatio = previousDt / dt;
+	parallelFor(parallel, 0, fluidCellCount, [&](int index) {
+		pressure[index] = previousPressure[cellIndex(fluidCellPositions[index])] * dtRatio;
+	});
+
+	double coldNorm = 0.0;
+	double warmNorm = 0.0;
+	double warmMax = 0.0;
+	const auto update = [&](int index, double& localColdNorm, double& localWarmNorm, double& localWarmMax) {
+		q_scratchpad[index] = r[index];
+		r[index] -= applyAMatrixAt(index, pressure);
+		localColdNorm += static_cast<double>(q_scratchpad[index]) * q_scratchpad[index];
+		localWarmNorm += static_cast<double>(r[index]) * r[index];
+		localWarmMax = std::max<double>(localWarmMax, std::abs(r[index]));
+	};
 	if (parallel) {
-#pragma omp parallel for
-		for (int i = 0; i < vec.size(); i++) {
-			vec[i] = vec[i] * scalar + vec1[i];
+#pragma omp parallel
+		{
+			double localColdNorm = 0.0;
+			double localWarmNorm = 0.0;
+			double localWarmMax = 0.0;
+#pragma omp for nowait
+			for (int index = 0; index < fluidCellCount; index++)
+				update(index, localColdNorm, localWarmNorm, localWarmMax);
+#pragma omp critical
+			{
+				coldNorm += localColdNorm;
+				warmNorm += localWarmNorm;
+				warmMax = std::max(warmMax, localWarmMax);
+			}
 		}
 	}
 	else {
-		for (int i = 0; i < vec.size(); i++) {
-			vec[i] = vec[i] * scalar + vec1[i];
-		}
+		for (int index = 0; index < fluidCellCount; index++)
+			update(index, coldNorm, warmNorm, warmMax);
+	}
+
+	//the previous pressure is a worse guess than zero (e.g. after a large splash), so start from zero
+	if (warmNorm >= coldNorm) {
+		std::swap(r, q_scratchpad);
+		std::fill(pressure.begin(), pressure.begin() + fluidCellCount, 0.0);
+		return -1.0;
+	}
+	//the residual decreases by about convergenceRate (on a log scale) per iteration
+	if (convergenceRate > 0.0 && warmNorm > 0.0)
+		iterationsSavedByWarmStart = std::lround(0.5 * std::log(coldNorm / warmNorm) / convergenceRate);
+	return warmMax;
+}
+
+void BridsonSolverGrid::storePressure(bool parallel, double dt) {
+	previousDt = dt;
+	//only the cells stored by the previous call have to be cleared
+	if (previousPressure.size() != cellCount) {
+		previousPressure.assign(cellCount, 0.0);
+		previousPressureCells.clear();
 	}
+	for (int gridIndex : previousPressureCells)
+		previousPressure[gridIndex] = 0.0;
+	previousPressureCells.resize(fluidCellCount);
+	parallelFor(parallel, 0, fluidCellCount, [&](int index) {
+		const int gridIndex = cellIndex(fluidCellPositions[index]);
+		previousPressureCells[index] = gridIndex;
+		previousPressure[gridIndex] = pressure[index];
+	});
 }
 
 int BridsonSolverGrid::solveIncompressibility(bool parallel, double dt) {
 	fluidCellCount = fluidCellPositions.size();
 	aMatrix.resize(fluidCellCount);
 	preconditioner.resize(fluidCellCount);
+	reserveWorkspace();
+	iterationsSavedByWarmStart = 0;
 
-	std::vector<double> pressure(fluidCellCount, 0.0);
-	std::vector<double> z(fluidCellCount, 0.0);
-	std::vector<double> q_scratchpad(fluidCellCount, 0.0);
-	std::vector<double> r = calculateRHS(parallel);
-
-	double total = 0;
-	for (auto& d : r)
-		total += d * d;
-	if (total < 1e-7)
+	if (calculateRHS(parallel) < 1e-7) {
+		previousPressure.clear();
 		return 0;
+	}
 
 	calculateAMatrix(parallel, dt);
-	calculatePreconditioner();
-	applyPreconditioner(r, q_scratchpad, z);
-	std::vector<double> s = z;
+	const double initialResidual = warmStartEnabled && !previousPressure.empty() ? applyWarmStart(parallel, dt) : -1.0;
+	const bool warmStart = initialResidual >= 0.0;
 
-	double sigma = dotProduct(parallel, z, r);
 	int it = 0;
-	for (; it < incompressibilityMaxIterationCount; it++) {
-		applyAMatrix(parallel, s, z);
-		
-		double alpha = sigma / dotProduct(parallel, s, z);
-		if(alpha != alpha)
-			break;
-		multAdd(parallel, pressure, s, alpha);
-		multAdd(parallel, r, z, -alpha);
-
-		double max = 0.0;
-		for(auto& d : r)
-			if (std::abs(d) > max)
-				max = std::abs(d);
-		if (max < residualTolerance)
-			break;
-
-		applyPreconditioner(r, q_scratchpad, z);
-		double sigmaNew = dotProduct(parallel, z, r);
-		if(sigma != sigma)
-			break;
-		double beta = sigmaNew / sigma;
-		multSelfAndAdd(parallel, s, z, beta);
-		sigma = sigmaNew;
+	int updateCount = 0;
+	double residual = initialResidual;
+	if (!warmStart || initialResidual >= residualTolerance) {
+		calculatePreconditioner(parallel);
+		double sigma = applyPreconditioner(parallel);
+		double beta = 0.0;
+
+		for (; it < incompressibilityMaxIterationCount; it++) {
+			double alpha = sigma / updateSearchAndApplyAMatrix(parallel, beta);
+			if(alpha != alpha)
+				break;
+			residual = updatePressureAndResidual(parallel, alpha);
+			updateCount++;
+			if (residual < residualTolerance)
+				break;
+
+			double sigmaNew = applyPreconditioner(parallel);
+			if(sigmaNew != sigmaNew)
+				break;
+			beta = sigmaNew / sigma;
+			sigma = sigmaNew;
+		}
 	}
-	applyPressureToVelocities(parallel, dt, pressure);
+	if (warmStart && updateCount > 0 && residual > 0.0 && residual < initialResidual)
+		convergenceRate = std::log(initialResidual / residual) / updateCount;
+
+	applyPressureToVelocities(parallel, dt);
+	if (warmStartEnabled)
+		storePressure(parallel, dt);
+	else
+		previousPressure.clear();
 	return it;
 }
 
-void BridsonSolverGrid::applyPressureToVelocities(bool parallel, double dt, const std::vector<double>& pressures) {
+void BridsonSolverGrid::applyPressureToVelocities(bool parallel, double dt) {
 	const double scale = dt / (fluidDensity * cellD.x);
 	parallelFor(parallel, 0, fluidCellCount, [&](int index) {
-		const glm::ivec3 pos = fluidCellPositions[index];
-		auto& currentCell = cell(pos);
-		
-		if (const auto& cellx = cell<0, 1>(pos); cellx.type != MacGridCell::CellType::SOLID) {
-			if (cellx.type == MacGridCell::CellType::AIR)
-				currentCell.faces[0].v2 += scale * pressures[index];
-			else
-				currentCell.faces[0].v2 += scale * (pressures[index] - pressures[cellx.id]);
-		}
-		if (const auto& celly = cell<1, 1>(pos); celly.type != MacGridCell::CellType::SOLID) {
-			if (celly.type == MacGridCell::CellType::AIR)
-				currentCell.faces[1].v2 += scale * pressures[index];
-			else
-				currentCell.faces[1].v2 += scale * (pressures[index] - pressures[celly.id]);
+		const auto& neighbours = fluidCellNeighbours[index];
+		const int gridIndex = cellIndex(fluidCellPositions[index]);
+
+		for (int axis = 0; axis < 3; axis++) {
+			if (const int next = neighbours.next(axis); next >= 0)
+				faceV2[axis][gridIndex] += scale * (pressure[index] - pressure[next]);
+			else if (cellTypes[gridIndex + cellStride[axis]] == MacGridCell::CellType::AIR)
+				faceV2[axis][gridIndex] += scale * pressure[index];
 		}
-		if (const auto& cellz = cell<2, 1>(pos); cellz.type != MacGridCell::CellType::SOLID) {
-			if (cellz.type == MacGridCell::CellType::AIR)
-				currentCell.faces[2].v2 += scale * pressures[index];
-			else
-				currentCell.faces[2].v2 += scale * (pressures[index] - pressures[cellz.id]);
+		for (int axis = 0; axis < 3; axis++) {
+			if (const int prevIndex = gridIndex - cellStride[axis]; neighbours.prev(axis) < 0 && cellTypes[prevIndex] == MacGridCell::CellType::AIR)
+				faceV2[axis][prevIndex] -= scale * pressure[index];
 		}
-
-		if (auto& cellx = cell<0,-1>(pos); cellx.type == MacGridCell::CellType::AIR)
-			cellx.faces[0].v2 -= scale * pressures[index];
-		if (auto& celly = cell<1,-1>(pos); celly.type == MacGridCell::CellType::AIR)
-			celly.faces[1].v2 -= scale * pressures[index];
-		if (auto& cellz = cell<2,-1>(pos); cellz.type == MacGridCell::CellType::AIR)
-			cellz.faces[2].v2 -= scale * pressures[index];
 	});
 }
 
@@ -15,29 +15,93 @@ public:
 	
 	int solveIncompressibility(bool parallel, double dt) override;
 
+	/**
+	 * The order in which the MIC(0) preconditioner processes the fluid cells.
+	 * LEXICOGRAPHIC is the original serial order, WAVEFRONT processes the x+y+z=const planes one after another
+	 * (each plane in parallel, the result is identical to the serial one), RED_BLACK processes the two
+	 * colors in parallel (a different, weaker preconditioner, but with only two sequential steps). RED_BLACK needs about
+	 * five times the iterations of the others and often stops unconverged at the default 80 iterations, so it is not
+	 * offered in the GUI, set incompressibilityMaxIterationCount to a few hundred when it is used.
+	 * LEXICOGRAPHIC stays the default: WAVEFRONT opens a parallel region for every plane, which can cost more than the
+	 * serial sweep on small fluid volumes, and it has not been timed on several threads yet.
+	 */
+	enum class PreconditionerOrdering {
+		LEXICOGRAPHIC, WAVEFRONT, RED_BLACK
+	};
+	PreconditionerOrdering preconditionerOrdering = PreconditionerOrdering::LEXICOGRAPHIC;
+
+	/**
+	 * If true, the solver starts from the pressure of the previous step (mapped through the cell coordinates)
+	 * instead of zero, which saves iterations when the fluid is close to steady.
+	 */
+	bool warmStartEnabled = false;
+
+	/**
+	 * Returns the pressure of the last solve for each fluid cell (in the order of the fluid cells).
+	 */
+	inline std::vector<util::Real> getPressure() const {
+		return std::vector<util::Real>(pressure.begin(), pressure.begin() + fluidCellCount);
+	}
+
 private:
 	struct AMatrixRow {
-		double nonSolidNeighbours;
-		double xWater;
-		double yWater;
-		double zWater;
+		util::Real nonSolidNeighbours;
+		util::Real xWater;
+		util::Real yWater;
+		util::Real zWater;
+
+		inline util::Real water(int axis) const {
+			return axis == 0 ? xWater : (axis == 1 ? yWater : zWater);
+		}
 	};
 
 	constexpr static double tau = 0.97;
 	constexpr static double sigma = 0.25;
 
 	std::vector<AMatrixRow> aMatrix;
-	std::vector<double> preconditioner;
+	std::vector<util::Real> preconditioner;
 	int fluidCellCount = 0;
 
+	//solver workspace, kept between the solves and only grown when the fluid volume grows
+	std::vector<util::Real> pressure;
+	std::vector<util::Real> r;
+	std::vector<util::Real> z;
+	std::vector<util::Real> s;
+	std::vector<util::Real> q_scratchpad;
+
+	//the pressure of the previous step for each grid cell (zero in the non-fluid cells)
+	std::vector<util::Real> previousPressure;
+	std::vector<int> previousPressureCells;	//the cells of previousPressure that are not zero
+	double previousDt = 1.0;
+	double convergenceRate = 0.0;   //the average log residual reduction per iteration of the last warm-started solve
+
+	std::vector<int> orderedCells;
+	std::vector<int> orderedCellGroups;
+
+	void buildCellOrdering();
+	template<typename F>
+	void forEachOrderedCell(bool parallel, bool reverse, F&& func);
+	template<typename F>
+	double sumOrderedCells(bool parallel, bool reverse, F&& func);
+	template<typename F>
+	void forEachWaterNeighbour(int index, F&& func) const;
+
+	void reserveWorkspace();
 	void calculateAMatrix(bool parallel, double dt);
-	std::vector<double> calculateRHS(bool parallel);
-	void calculatePreconditioner();
+	double calculateRHS(bool parallel);
+	double calculatePreconditionerAt(int index) const;
+	double calculateRedBlackPreconditionerAt(int index, bool black) const;
+	void calculatePreconditioner(bool parallel);
 	
-	void applyPreconditioner(const std::vector<double>& r, std::vector<double>& q_scratchpad, std::vector<double>& result);
-	void applyAMatrix(bool parallel, const std::vector<double>& vec, std::vector<double>& result);
+	double applyPreconditioner(bool parallel);
+	double applyAMatrixAt(int index, const std::vector<util::Real>& vec) const;
+	double updateSearchAndApplyAMatrix(bool parallel, double beta);
+	double updatePressureAndResidual(bool parallel, double alpha);
+
+	double applyWarmStart(bool parallel, double dt);
+	void storePressure(bool parallel, double dt);
 
-	void applyPressureToVelocities(bool parallel, double dt, const std::vector<double>& pressure);
+	void applyPressureToVelocities(bool parallel, double dt);
 };
 
 }
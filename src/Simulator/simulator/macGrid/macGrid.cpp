@@ -1,6 +1,7 @@
 #include "macGrid.h"
 #include <iostream>
 #include "../util/compTimeForLoop.h"
+#include "../util/vectorOps.h"
 
 using namespace genericfsim::macgrid;
 using namespace genericfsim::obstacle;
@@ -10,7 +11,7 @@ MacGrid::MacGrid(glm::dvec3 targetDimensions, double resolution, bool twoD)
 	: cellD(1 / resolution, 1 / resolution, twoD ? targetDimensions.z / 3 : 1 / resolution), cellDInv(1.0 / cellD),
 	gridSize(targetDimensions.x / cellD.x, targetDimensions.y / cellD.y, twoD ? 3 : targetDimensions.z / cellD.z),
 	dimensions(gridSize.x * cellD.x, gridSize.y * cellD.y, twoD ? targetDimensions.z : gridSize.z * cellD.z), twoD(twoD), 
-	yzMultiplier(gridSize.y * gridSize.z), cellCount(gridSize.x * gridSize.y * gridSize.z) {
+	yzMultiplier(gridSize.y * gridSize.z), cellCount(gridSize.x * gridSize.y * gridSize.z), cellStride(yzMultiplier, gridSize.z, 1) {
 
 	initNewGrid();
 	restoreBorderingSolidCellsAndSpeeds(true);
@@ -18,58 +19,32 @@ MacGrid::MacGrid(glm::dvec3 targetDimensions, double resolution, bool twoD)
 
 
 void MacGrid::initNewGrid() {
-	rawCells.clear();
-	for (int x = 0; x < gridSize.x; x++) {
-		for (int y = 0; y < gridSize.y; y++) {
-			for (int z = 0; z < gridSize.z; z++) {
-				MacGridCell cell{ glm::dvec3((x + 1) * cellD.x, (y + 0.5) * cellD.y, (z + 0.5) * cellD.z),
-									glm::dvec3((x + 0.5) * cellD.x, (y + 1) * cellD.y, (z + 0.5) * cellD.z),
-									glm::dvec3((x + 0.5) * cellD.x, (y + 0.5) * cellD.y, (z + 1) * cellD.z),
-									glm::dvec3(x + 0.5, y + 0.5, z + 0.5) * cellD };
-				rawCells.push_back(cell);
-			}
-		}
+	for (int axis = 0; axis < 3; axis++) {
+		faceV[axis].assign(cellCount, 0.0);
+		faceV2[axis].assign(cellCount, 0.0);
+		faceWeightSum[axis].assign(cellCount, 0.0);
 	}
+	cellTypes.assign(cellCount, MacGridCell::CellType::AIR);
+	cellAvgPNum.assign(cellCount, 0.0);
+	fluidCellIds.assign(cellCount, 0);
+
+	activeTileCount = (gridSize + glm::ivec3(ACTIVE_TILE_SIZE - 1)) / ACTIVE_TILE_SIZE;
+	const int tileNum = activeTileCount.x * activeTileCount.y * activeTileCount.z;
+	tileOccupied.assign(tileNum, 0);
+	tileActive.assign(tileNum, 0);
+	tileTouched.assign(tileNum, 0);
+	activeTiles.clear();
+	touchedTiles.clear();
+	allTilesTouched = true;
 }
 
 
 void MacGrid::forEachCell(bool parallel, bool includeBorders, std::function<void(glm::ivec3 pos, MacGridCell&)>&& lambda) {
-	int b = !includeBorders;
-	if (parallel) {
-#pragma omp parallel for
-		for (int x = b; x < gridSize.x - b; x++) {
-			for (int y = b; y < gridSize.y - b; y++) {
-				for (int z = b; z < gridSize.z - b; z++) {
-					lambda(glm::ivec3(x, y, z), cell(x, y, z));
-				}
-			}
-		}
-	}
-	else {
-		for (int x = b; x < gridSize.x - b; x++) {
-			for (int y = b; y < gridSize.y - b; y++) {
-				for (int z = b; z < gridSize.z - b; z++) {
-					lambda(glm::ivec3(x, y, z), cell(x, y, z));
-				}
-			}
-		}
-	}
+	forEachCell<std::function<void(glm::ivec3 pos, MacGridCell&)>>(parallel, includeBorders, std::move(lambda));
 }
 
 void MacGrid::forEachFluidCell(bool parallel, std::function<void(glm::ivec3 pos, MacGridCell&)>&& lambda) {
-	if (parallel) {
-#pragma omp parallel for
-		for (int p = 0; p < fluidCellPositions.size(); p++) {
-			const auto& pos = fluidCellPositions[p];
-			lambda(pos, cell(pos));
-		}
-	}
-	else {
-		for (int p = 0; p < fluidCellPositions.size(); p++) {
-			const auto& pos = fluidCellPositions[p];
-			lambda(pos, cell(pos));
-		}
-	}
+	forEachFluidCell<std::function<void(glm::ivec3 pos, MacGridCell&)>>(parallel, std::move(lambda));
 }
 
 void MacGrid::restoreBorderingSolidCellsAndSpeeds(bool parallel) {
@@ -139,74 +114,67 @@ void MacGrid::restoreBorderingSolidCellsAndSpeeds(bool parallel) {
 	}
 }
 
-std::array<std::array<MacGridCell::FaceRef, 8>, 3> MacGrid::getFacesAround(const glm::dvec3& pos) {
-	constexpr glm::dvec3 axisOffset[3] = { glm::dvec3(0.0, 0.5, 0.5), glm::dvec3(0.5, 0.0, 0.5), glm::dvec3(0.5, 0.5, 0.0) };
-	glm::dvec3 gridPos[3] = { pos * cellDInv - axisOffset[0], pos * cellDInv - axisOffset[1], pos * cellDInv - axisOffset[2] };
-	glm::ivec3 coord[3] = { glm::ivec3(gridPos[0].x, gridPos[0].y, gridPos[0].z), glm::ivec3(gridPos[1].x, gridPos[1].y, gridPos[1].z), glm::ivec3(gridPos[2].x, gridPos[2].y, gridPos[2].z) };
-	coord[0].x -= 1;
-	coord[1].y -= 1;
-	coord[2].z -= 1;
-
-	return { std::array<MacGridCell::FaceRef, 8>{
-				MacGridCell::FaceRef { cell(coord[0].x + 1, coord[0].y + 1, coord[0].z + 1).faces[0]},
-				MacGridCell::FaceRef { cell(coord[0].x, coord[0].y + 1, coord[0].z + 1).faces[0] },
-				MacGridCell::FaceRef { cell(coord[0].x + 1, coord[0].y, coord[0].z + 1).faces[0] },
-				MacGridCell::FaceRef { cell(coord[0].x + 1, coord[0].y + 1, coord[0].z).faces[0] },
-				MacGridCell::FaceRef { cell(coord[0].x + 1, coord[0].y, coord[0].z).faces[0] },
-				MacGridCell::FaceRef { cell(coord[0].x, coord[0].y, coord[0].z + 1).faces[0] },
-				MacGridCell::FaceRef { cell(coord[0].x, coord[0].y + 1, coord[0].z).faces[0] },
-				MacGridCell::FaceRef { cell(coord[0].x, coord[0].y, coord[0].z).faces[0] }
-			},
-			std::array<MacGridCell::FaceRef, 8>{
-				MacGridCell::FaceRef { cell(coord[1].x + 1, coord[1].y + 1, coord[1].z + 1).faces[1]},
-				MacGridCell::FaceRef { cell(coord[1].x, coord[1].y + 1, coord[1].z + 1).faces[1] },
-				MacGridCell::FaceRef { cell(coord[1].x + 1, coord[1].y, coord[1].z + 1).faces[1] },
-				MacGridCell::FaceRef { cell(coord[1].x + 1, coord[1].y + 1, coord[1].z).faces[1] },
-				MacGridCell::FaceRef { cell(coord[1].x + 1, coord[1].y, coord[1].z).faces[1] },
-				MacGridCell::FaceRef { cell(coord[1].x, coord[1].y, coord[1].z + 1).faces[1] },
-				MacGridCell::FaceRef { cell(coord[1].x, coord[1].y + 1, coord[1].z).faces[1] },
-				MacGridCell::FaceRef { cell(coord[1].x, coord[1].y, coord[1].z).faces[1] }
-			},
-			std::array<MacGridCell::FaceRef, 8>{
-				MacGridCell::FaceRef { cell(coord[2].x + 1, coord[2].y + 1, coord[2].z + 1).faces[2]},
-				MacGridCell::FaceRef { cell(coord[2].x, coord[2].y + 1, coord[2].z + 1).faces[2] },
-				MacGridCell::FaceRef { cell(coord[2].x + 1, coord[2].y, coord[2].z + 1).faces[2] },
-				MacGridCell::FaceRef { cell(coord[2].x + 1, coord[2].y + 1, coord[2].z).faces[2] },
-				MacGridCell::FaceRef { cell(coord[2].x + 1, coord[2].y, coord[2].z).faces[2] },
-				MacGridCell::FaceRef { cell(coord[2].x, coord[2].y, coord[2].z + 1).faces[2] },
-				MacGridCell::FaceRef { cell(coord[2].x, coord[2].y + 1, coord[2].z).faces[2] },
-				MacGridCell::FaceRef { cell(coord[2].x, coord[2].y, coord[2].z).faces[2] }
-			} };
-
-}
-
-MacGridCell& genericfsim::macgrid::MacGrid::getCellAt(const glm::dvec3& pos)
+MacGridCell genericfsim::macgrid::MacGrid::getCellAt(const glm::dvec3& pos)
 {
 	return cell(pos * cellDInv);
 }
 
-std::array<MacGridCellRef, 8> MacGrid::getCellsAround(const glm::dvec3& pos) {
+std::array<MacGridCell, 8> MacGrid::getCellsAround(const glm::dvec3& pos) {
 	glm::dvec3 gridPos = pos * cellDInv - glm::dvec3(0.5, 0.5, 0.5);
 	glm::ivec3 coord = glm::ivec3(gridPos.x, gridPos.y, gridPos.z);
 
 	return {
-		MacGridCellRef { cell(coord.x + 1, coord.y + 1, coord.z + 1) },
-		MacGridCellRef { cell(coord.x, coord.y + 1, coord.z + 1) },
-		MacGridCellRef { cell(coord.x + 1, coord.y, coord.z + 1) },
-		MacGridCellRef { cell(coord.x + 1, coord.y + 1, coord.z) },
-		MacGridCellRef { cell(coord.x + 1, coord.y, coord.z) },
-		MacGridCellRef { cell(coord.x, coord.y, coord.z + 1) },
-		MacGridCellRef { cell(coord.x, coord.y + 1, coord.z) },
-		MacGridCellRef { cell(coord.x, coord.y, coord.z) }
+		cell(coord.x + 1, coord.y + 1, coord.z + 1),
+		cell(coord.x, coord.y + 1, coord.z + 1),
+		cell(coord.x + 1, coord.y, coord.z + 1),
+		cell(coord.x + 1, coord.y + 1, coord.z),
+		cell(coord.x + 1, coord.y, coord.z),
+		cell(coord.x, coord.y, coord.z + 1),
+		cell(coord.x, coord.y + 1, coord.z),
+		cell(coord.x, coord.y, coord.z)
 	};
 }
 
 void MacGrid::postP2GUpdate(bool parallel, double gravityIncrement) {
+	if (sparseTilesEnabled) {
+		//the faces outside of the active tiles keep v2 = 0, only the extrapolation can reach them
+		forEachActiveCell(parallel, [&](glm::ivec3 pos, MacGridCell& c) {
+			c.faces[0].v2 = c.faces[0].v;
+			c.faces[1].v2 = c.faces[1].v;
+			c.faces[2].v2 = c.faces[2].v;
+			if (pos.y + 1 < gridSize.y && c.type != MacGridCell::CellType::SOLID && cellTypes[cellIndex<1, 1>(pos)] != MacGridCell::CellType::SOLID)
+				c.faces[1].v2 += gravityIncrement;
+		});
+		fluidCellPositions.clear();
+		forEachActiveCellInOrder([&](const glm::ivec3& pos) {
+			const int index = cellIndex(pos);
+			if (cellTypes[index] == MacGridCell::CellType::WATER) {
+				fluidCellPositions.push_back(pos);
+				fluidCellIds[index] = fluidCellPositions.size() - 1;
+			}
+		});
+		buildFluidCellNeighbours(parallel);
+		return;
+	}
+
+	const auto update = [&](int index) {
+		faceV2[0][index] = faceV[0][index];
+		faceV2[1][index] = faceV[1][index];
+		faceV2[2][index] = faceV[2][index];
+	};
+	if (parallel) {
+#pragma omp parallel for
+		for (int index = 0; index < cellCount; index++) {
+			update(index);
+		}
+	}
+	else {
+		for (int index = 0; index < cellCount; index++) {
+			update(index);
+		}
+	}
 	forEachCell(parallel, true, [&](glm::ivec3 pos, MacGridCell& c) {
-		c.faces[0].v2 = c.faces[0].v;
-		c.faces[1].v2 = c.faces[1].v;
-		c.faces[2].v2 = c.faces[2].v;
-		if(c.type != MacGridCell::CellType::SOLID && cell<1, 1>(pos).type != MacGridCell::CellType::SOLID)
+		if (pos.y + 1 < gridSize.y && c.type != MacGridCell::CellType::SOLID && cellTypes[cellIndex<1, 1>(pos)] != MacGridCell::CellType::SOLID)
 			c.faces[1].v2 += gravityIncrement;
 	});
 	fluidCellPositions.clear();
@@ -216,121 +184,556 @@ void MacGrid::postP2GUpdate(bool parallel, double gravityIncrement) {
 			c.id = fluidCellPositions.size() - 1;
 		}
 	});
+	buildFluidCellNeighbours(parallel);
+}
+
+void MacGrid::buildFluidCellNeighbours(bool parallel) {
+	const int fluidCellCount = fluidCellPositions.size();
+	fluidCellNeighbours.resize(fluidCellCount);
+	const auto build = [&](int p) {
+		const int index = cellIndex(fluidCellPositions[p]);
+		auto& row = fluidCellNeighbours[p];
+		row.nonSolidCount = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			for (int side = 0; side < 2; side++) {
+				const int neighbourIndex = index + (side ? cellStride[axis] : -cellStride[axis]);
+				const auto type = cellTypes[neighbourIndex];
+				row.neighbours[2 * axis + side] = type == MacGridCell::CellType::WATER ? fluidCellIds[neighbourIndex] : -1;
+				if (type != MacGridCell::CellType::SOLID)
+					row.nonSolidCount++;
+			}
+		}
+	};
+	if (parallel) {
+#pragma omp parallel for
+		for (int p = 0; p < fluidCellCount; p++) {
+			build(p);
+		}
+	}
+	else {
+		for (int p = 0; p < fluidCellCount; p++) {
+			build(p);
+		}
+	}
 }
 
 void MacGrid::resetGridValues(bool parallel) {
-	forEachCell(parallel, true, [this](glm::ivec3, MacGridCell& cell) {
-		cell.faces[0].v = cell.faces[1].v = cell.faces[2].v = 0.0;
-		cell.faces[0].v2 = cell.faces[1].v2 = cell.faces[2].v2 = 0.0;
-		cell.faces[0].particleWeightSum = cell.faces[1].particleWeightSum = cell.faces[2].particleWeightSum = 0.0;
-		cell.avgPNum = 0.0;
-		cell.type = MacGridCell::CellType::AIR;
+	const auto reset = [&](int index) {
+		faceV[0][index] = faceV[1][index] = faceV[2][index] = 0.0;
+		faceV2[0][index] = faceV2[1][index] = faceV2[2][index] = 0.0;
+		faceWeightSum[0][index] = faceWeightSum[1][index] = faceWeightSum[2][index] = 0.0;
+		cellAvgPNum[index] = 0.0;
+		cellTypes[index] = MacGridCell::CellType::AIR;
+	};
+	if (sparseTilesEnabled && !allTilesTouched) {
+		//the tiles written since the last reset and the newly activated ones (their border cells may still be solid
+		//from an earlier container setting) are reset
+		for (int tile : activeTiles) {
+			if (!tileTouched[tile]) {
+				tileTouched[tile] = 1;
+				touchedTiles.push_back(tile);
+			}
+		}
+		forEachTileCell(parallel, touchedTiles, [&](const glm::ivec3& pos) {
+			reset(cellIndex(pos));
+		});
+	}
+	else if (parallel) {
+#pragma omp parallel for
+		for (int index = 0; index < cellCount; index++) {
+			reset(index);
+		}
+	}
+	else {
+		for (int index = 0; index < cellCount; index++) {
+			reset(index);
+		}
+	}
+
+	//until the next reset only the active tiles are written (and the ones marked by addObstacle and the extrapolation)
+	for (int tile : touchedTiles)
+		tileTouched[tile] = 0;
+	touchedTiles.clear();
+	allTilesTouched = !sparseTilesEnabled;
+	if (sparseTilesEnabled) {
+		for (int tile : activeTiles) {
+			tileTouched[tile] = 1;
+			touchedTiles.push_back(tile);
+		}
+	}
+}
+
+void MacGrid::clearActiveTiles() {
+	std::fill(tileOccupied.begin(), tileOccupied.end(), 0);
+}
+
+void MacGrid::finishTileActivation(bool parallel) {
+	if (!liquidLayers.empty()) {
+		util::parallelFor(parallel, 0, gridSize.x, [&](int x) {
+			for (int y = 0; y < gridSize.y; y++) {
+				for (int z = 0; z < gridSize.z; z++) {
+					if (liquidLayers[x * yzMultiplier + y * gridSize.z + z] > 0)
+						activateTileAt((glm::dvec3(x, y, z) + 0.5) * cellD);
+				}
+			}
+		});
+	}
+
+	//the tile count is a fraction of the cell count, so the dilation runs serially
+	for (int tile : activeTiles)
+		tileActive[tile] = 0;
+	activeTiles.clear();
+	for (int tileX = 0; tileX < activeTileCount.x; tileX++) {
+		for (int tileY = 0; tileY < activeTileCount.y; tileY++) {
+			for (int tileZ = 0; tileZ < activeTileCount.z; tileZ++) {
+				if (!tileOccupied[(tileX * activeTileCount.y + tileY) * activeTileCount.z + tileZ])
+					continue;
+				for (int x = std::max(tileX - 1, 0); x <= std::min(tileX + 1, activeTileCount.x - 1); x++) {
+					for (int y = std::max(tileY - 1, 0); y <= std::min(tileY + 1, activeTileCount.y - 1); y++) {
+						for (int z = std::max(tileZ - 1, 0); z <= std::min(tileZ + 1, activeTileCount.z - 1); z++) {
+							const int tile = (x * activeTileCount.y + y) * activeTileCount.z + z;
+							if (!tileActive[tile]) {
+								tileActive[tile] = 1;
+								activeTiles.push_back(tile);
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+	std::sort(activeTiles.begin(), activeTiles.end());
+}
+
+void MacGrid::touchTileOf(int index) {
+	const int tile = (index / yzMultiplier / ACTIVE_TILE_SIZE * activeTileCount.y + index / gridSize.z % gridSize.y / ACTIVE_TILE_SIZE)
+		* activeTileCount.z + index % gridSize.z / ACTIVE_TILE_SIZE;
+	if (!tileTouched[tile]) {
+		tileTouched[tile] = 1;
+		touchedTiles.push_back(tile);
+	}
+}
+
+double MacGrid::getMaxFaceVelocity(bool parallel) const {
+	if (!sparseTilesEnabled) {
+		double maxVelocity = 0.0;
+		for (int axis = 0; axis < 3; axis++) {
+			const std::vector<util::Real>& faceV2 = this->faceV2[axis];
+			maxVelocity = std::max(maxVelocity, util::parallelMax(parallel, 0, cellCount, [&](int i) {
+				return std::abs(double(faceV2[i]));
+			}));
+		}
+		return maxVelocity;
+	}
+	return util::parallelMax(parallel, 0, activeTiles.size(), [&](int i) {
+		const glm::ivec3 start = getTileStart(activeTiles[i]);
+		const glm::ivec3 end = glm::min(start + glm::ivec3(ACTIVE_TILE_SIZE), gridSize);
+		double maxVelocity = 0.0;
+		for (int x = start.x; x < end.x; x++) {
+			for (int y = start.y; y < end.y; y++) {
+				for (int z = start.z; z < end.z; z++) {
+					const int index = x * yzMultiplier + y * gridSize.z + z;
+					maxVelocity = std::max({ maxVelocity, std::abs(double(faceV2[0][index])), std::abs(double(faceV2[1][index])),
+						std::abs(double(faceV2[2][index])) });
+				}
+			}
+		}
+		return maxVelocity;
 	});
 }
 
 void MacGrid::addObstacle(bool parallel, const Obstacle* obstacle) {
-	const glm::dvec3 center = obstacle->pos * cellDInv;
+	if (obstacle->isParticleSink())
+		return;
 	const glm::dvec3 speed = obstacle->speed;
+	obstacleCells.clear();
+	obstacle->getSolidCells(parallel, cellD, gridSize, obstacleCells);
+	for (const glm::ivec3& pos : obstacleCells) {
+		if (sparseTilesEnabled)
+			touchTileOf(cellIndex(pos));
+		cell(pos).type = MacGridCell::CellType::SOLID;
+		if (cell<0, 1>(pos).type == MacGridCell::CellType::WATER)
+			cell(pos).faces[0].v = speed.x;
+		if (cell<0, -1>(pos).type == MacGridCell::CellType::WATER)
+			cell<0, -1>(pos).faces[0].v = speed.x;
+		if (cell<1, 1>(pos).type == MacGridCell::CellType::WATER)
+			cell(pos).faces[1].v = speed.y;
+		if (cell<1, -1>(pos).type == MacGridCell::CellType::WATER)
+			cell<1, -1>(pos).faces[1].v = speed.y;
+		if (cell<2, 1>(pos).type == MacGridCell::CellType::WATER)
+			cell(pos).faces[2].v = speed.z;
+		if (cell<2, -1>(pos).type == MacGridCell::CellType::WATER)
+			cell<2, -1>(pos).faces[2].v = speed.z;
+	}
+}
 
-	if (const SphericalObstacle* tmp = dynamic_cast<const SphericalObstacle*>(obstacle); tmp != nullptr && dynamic_cast<const SphericalParticleSink*>(tmp) == nullptr) {
-		const SphericalObstacle& sphere = *tmp;
-		const double r = cellDInv.x * sphere.r;
-		const double r2 = r * r;
-		const glm::ivec3 min(std::max(center.x - r, 1.0), std::max(center.y - r, 1.0), std::max(center.z - r, 1.0));
-		const glm::ivec3 max(std::min(center.x + r, gridSize.x - 2.0), std::min(center.y + r, gridSize.y - 2.0), std::min(center.z + r, gridSize.z - 2.0));
-		for (int x = min.x; x <= max.x; x++) {
-			for (int y = min.y; y <= max.y; y++) {
-				for (int z = min.z; z <= max.z; z++) {
-					glm::dvec3 c2o = glm::dvec3(x + 0.5, y + 0.5, z + 0.5) - center;
-					if (glm::dot(c2o, c2o) < r2) {
-						glm::ivec3 pos(x, y, z);
-						cell(pos).type = MacGridCell::CellType::SOLID;
-						if(cell<0,1>(pos).type == MacGridCell::CellType::WATER)
-							cell(pos).faces[0].v = speed.x;
-						if(cell<0,-1>(pos).type == MacGridCell::CellType::WATER)
-							cell<0,-1>(pos).faces[0].v = speed.x;
-						if(cell<1,1>(pos).type == MacGridCell::CellType::WATER)
-							cell(pos).faces[1].v = speed.y;
-						if(cell<1,-1>(pos).type == MacGridCell::CellType::WATER)
-							cell<1,-1>(pos).faces[1].v = speed.y;
-						if(cell<2,1>(pos).type == MacGridCell::CellType::WATER)
-							cell(pos).faces[2].v = speed.z;
-						if(cell<2,-1>(pos).type == MacGridCell::CellType::WATER)
-							cell<2,-1>(pos).faces[2].v = speed.z;
-					}
+void MacGrid::bakeObstacleSdf(bool parallel, const ObstacleSet& obstacles, double margin) {
+	//the band is wide enough that the interpolation at margin distance from an obstacle only uses calculated samples
+	const double bandWidth = margin + 2.0 * glm::length(cellD);
+	//the field is only filled once, later bakes only reset the tiles that the previous one wrote
+	if (obstacleSdf.size() != cellCount || bandWidth != obstacleSdfFill) {
+		obstacleSdf.assign(cellCount, bandWidth);
+		obstacleSdfOwner.assign(cellCount, -1);
+		obstacleSdfFill = bandWidth;
+		bakedObstacleTiles.clear();
+	}
+
+	//broad phase: the bounds of the shapes grown by the band are rasterized into tiles of cells
+	const int sphereCount = obstacles.spheres.pos.size();
+	const int boxCount = obstacles.boxes.pos.size();
+	const int shapeCount = sphereCount + boxCount + obstacles.others.size();
+	std::vector<std::pair<glm::ivec3, glm::ivec3>> shapeTiles(shapeCount);
+	for (int s = 0; s < shapeCount; s++) {
+		std::pair<glm::dvec3, glm::dvec3> bounds;
+		if (s < sphereCount)
+			bounds = { obstacles.spheres.pos[s] - obstacles.spheres.r[s], obstacles.spheres.pos[s] + obstacles.spheres.r[s] };
+		else if (s < sphereCount + boxCount)
+			bounds = { obstacles.boxes.pos[s - sphereCount] - obstacles.boxes.halfSize[s - sphereCount], obstacles.boxes.pos[s - sphereCount] + obstacles.boxes.halfSize[s - sphereCount] };
+		else
+			bounds = obstacles.others[s - sphereCount - boxCount]->getBounds();
+		const glm::dvec3 low = glm::floor((bounds.first - bandWidth) * cellDInv);
+		const glm::dvec3 high = glm::floor((bounds.second + bandWidth) * cellDInv);
+		COMP_FOR_LOOP(axis, 3,
+			shapeTiles[s].first[axis] = int(std::clamp(low[axis], 0.0, gridSize[axis] - 1.0)) / OBSTACLE_TILE_SIZE;
+			shapeTiles[s].second[axis] = int(std::clamp(high[axis], 0.0, gridSize[axis] - 1.0)) / OBSTACLE_TILE_SIZE;
+		)
+	}
+
+	obstacleTileCount = (gridSize + (OBSTACLE_TILE_SIZE - 1)) / OBSTACLE_TILE_SIZE;
+	const int tileCount = obstacleTileCount.x * obstacleTileCount.y * obstacleTileCount.z;
+	auto forEachTileOfShape = [&](int s, auto&& f) {
+		for (int x = shapeTiles[s].first.x; x <= shapeTiles[s].second.x; x++)
+			for (int y = shapeTiles[s].first.y; y <= shapeTiles[s].second.y; y++)
+				for (int z = shapeTiles[s].first.z; z <= shapeTiles[s].second.z; z++)
+					f((x * obstacleTileCount.y + y) * obstacleTileCount.z + z);
+	};
+	obstacleTileStarts.assign(tileCount + 1, 0);
+	std::vector<int> reachedTiles;
+	for (int s = 0; s < shapeCount; s++) {
+		forEachTileOfShape(s, [&](int tile) {
+			if (obstacleTileStarts[tile + 1]++ == 0)
+				reachedTiles.push_back(tile);
+		});
+	}
+	util::prefixSum(false, obstacleTileStarts);
+	obstacleTileShapes.resize(obstacleTileStarts[tileCount]);
+	std::vector<int> tileFill(obstacleTileStarts.begin(), obstacleTileStarts.end() - 1);
+	for (int s = 0; s < shapeCount; s++)
+		forEachTileOfShape(s, [&](int tile) { obstacleTileShapes[tileFill[tile]++] = s; });
+
+	const auto getTileBounds = [&](int tile) {
+		const glm::ivec3 min = glm::ivec3(tile / (obstacleTileCount.y * obstacleTileCount.z), tile / obstacleTileCount.z % obstacleTileCount.y, tile % obstacleTileCount.z) * OBSTACLE_TILE_SIZE;
+		return std::make_pair(min, glm::min(min + OBSTACLE_TILE_SIZE, gridSize));
+	};
+	//the tiles that the previous bake wrote but no shape reaches now are reset (the reached ones are overwritten below)
+	util::parallelFor(parallel, 0, bakedObstacleTiles.size(), [&](int i) {
+		const int tile = bakedObstacleTiles[i];
+		if (obstacleTileStarts[tile] != obstacleTileStarts[tile + 1])
+			return;
+		const auto [min, max] = getTileBounds(tile);
+		for (int x = min.x; x < max.x; x++) {
+			for (int y = min.y; y < max.y; y++) {
+				for (int z = min.z; z < max.z; z++) {
+					const int index = x * yzMultiplier + y * gridSize.z + z;
+					obstacleSdf[index] = bandWidth;
+					obstacleSdfOwner[index] = -1;
 				}
 			}
 		}
-	}
+	});
+	bakedObstacleTiles = std::move(reachedTiles);
 
-	if (const RectengularObstacle* tmp = dynamic_cast<const RectengularObstacle*>(obstacle); tmp != nullptr) {
-		const RectengularObstacle& rect = *tmp;
-		const glm::dvec3 d = rect.size * cellDInv * 0.5;
-		const glm::ivec3 min(std::max(std::round(center.x - d.x), 1.0), std::max(std::round(center.y - d.y), 1.0), std::max(std::round(center.z - d.z), 1.0));
-		const glm::ivec3 max(std::min(std::round(center.x + d.x), gridSize.x - 1.0), std::min(std::round(center.y + d.y), gridSize.y - 1.0), std::min(std::round(center.z + d.z), gridSize.z - 1.0));
+	//narrow phase: each cell of a reached tile takes the minimum over the shapes of its tile
+	util::parallelFor(parallel, 0, bakedObstacleTiles.size(), [&](int i) {
+		const int tile = bakedObstacleTiles[i];
+		const int start = obstacleTileStarts[tile];
+		const int end = obstacleTileStarts[tile + 1];
+		const auto [min, max] = getTileBounds(tile);
 		for (int x = min.x; x < max.x; x++) {
 			for (int y = min.y; y < max.y; y++) {
 				for (int z = min.z; z < max.z; z++) {
-					glm::ivec3 pos(x, y, z);
-					cell(pos).type = MacGridCell::CellType::SOLID;
-					if (cell<0, 1>(pos).type == MacGridCell::CellType::WATER)
-						cell(pos).faces[0].v = speed.x;
-					if (cell<0, -1>(pos).type == MacGridCell::CellType::WATER)
-						cell<0, -1>(pos).faces[0].v = speed.x;
-					if (cell<1, 1>(pos).type == MacGridCell::CellType::WATER)
-						cell(pos).faces[1].v = speed.y;
-					if (cell<1, -1>(pos).type == MacGridCell::CellType::WATER)
-						cell<1, -1>(pos).faces[1].v = speed.y;
-					if (cell<2, 1>(pos).type == MacGridCell::CellType::WATER)
-						cell(pos).faces[2].v = speed.z;
-					if (cell<2, -1>(pos).type == MacGridCell::CellType::WATER)
-						cell<2, -1>(pos).faces[2].v = speed.z;
+					const glm::dvec3 p = glm::dvec3(x + 0.5, y + 0.5, z + 0.5) * cellD;
+					double closest = bandWidth;
+					int owner = -1;
+					for (int i = start; i < end; i++) {
+						const int s = obstacleTileShapes[i];
+						double distance;
+						int obstacleIndex;
+						if (s < sphereCount) {
+							distance = sphereSignedDistance(p, obstacles.spheres.pos[s], obstacles.spheres.r[s]);
+							obstacleIndex = obstacles.spheres.obstacleIndex[s];
+						}
+						else if (s < sphereCount + boxCount) {
+							distance = boxSignedDistance(p, obstacles.boxes.pos[s - sphereCount], obstacles.boxes.halfSize[s - sphereCount]);
+							obstacleIndex = obstacles.boxes.obstacleIndex[s - sphereCount];
+						}
+						else {
+							distance = obstacles.others[s - sphereCount - boxCount]->signedDistance(p);
+							obstacleIndex = obstacles.otherIndices[s - sphereCount - boxCount];
+						}
+						if (distance < closest) {
+							closest = distance;
+							owner = obstacleIndex;
+						}
+					}
+					const int index = x * yzMultiplier + y * gridSize.z + z;
+					obstacleSdf[index] = closest;
+					obstacleSdfOwner[index] = owner;
 				}
 			}
 		}
-	}
+	});
 }
 
 void MacGrid::extrapolateVelocities(bool parallel) {
-	constexpr int iterationNum = 2;
-	std::vector<unsigned char> valid(cellCount, 100);
-	const auto isValid = [&](const glm::ivec3& pos, int currentVal) {
-		return pos.x >= 0 && pos.x < gridSize.x && pos.y >= 0 && pos.y < gridSize.y && pos.z >= 0 && pos.z < gridSize.z && valid[pos.x * yzMultiplier + pos.y * gridSize.z + pos.z] <= currentVal;
-	};
-	const auto setValid = [&](const glm::ivec3& pos, int currentVal) {
-		valid[pos.x * yzMultiplier + pos.y * gridSize.z + pos.z] = currentVal;
-	};
-	forEachFluidCell(true, [&](glm::ivec3 pos, MacGridCell& cell) {
-		setValid(pos, 0);
-	});
+	constexpr unsigned char unreached = std::numeric_limits<unsigned char>::max();
+	const int layerCount = std::clamp(velocityExtrapolationLayerCount, 0, unreached - 1);
+	if (extrapolationLayers.empty())
+		extrapolationLayers.assign(cellCount, unreached);
+	//only the cells reached by the previous call have to be reset
+	for (int index : extrapolatedCells)
+		extrapolationLayers[index] = unreached;
+	extrapolatedCells.clear();
+	for (const glm::ivec3& pos : fluidCellPositions) {
+		const int index = cellIndex(pos);
+		extrapolationLayers[index] = 0;
+		extrapolatedCells.push_back(index);
+	}
 
-	for (int it = 0; it < iterationNum; it++) {
-		forEachCell(parallel, true, [&](glm::ivec3 pos, MacGridCell& c) {
-			if (isValid(pos, it))
-				return;
+	int layerStart = 0;
+	for (int layer = 1; layer <= layerCount; layer++) {
+		//the next layer is collected serially in the order of the previous one, so it does not depend on the thread count
+		const int layerEnd = extrapolatedCells.size();
+		for (int i = layerStart; i < layerEnd; i++) {
+			const int index = extrapolatedCells[i];
+			const glm::ivec3 pos(index / yzMultiplier, index / gridSize.z % gridSize.y, index % gridSize.z);
+			COMP_FOR_LOOP(axis, 3, {
+				COMP_FOR_LOOP(offset, 2, {
+					if (offset == 0 ? pos[axis] > 0 : pos[axis] + 1 < gridSize[axis]) {
+						const int neighbourIndex = index + (offset * 2 - 1) * cellStride[axis];
+						if (extrapolationLayers[neighbourIndex] == unreached) {
+							extrapolationLayers[neighbourIndex] = layer;
+							extrapolatedCells.push_back(neighbourIndex);
+							if (sparseTilesEnabled)
+								touchTileOf(neighbourIndex);
+						}
+					}
+				});
+			});
+		}
+		if (extrapolatedCells.size() == layerEnd)
+			break;
+
+		//a cell of the layer averages its neighbours from the earlier layers, which are not written by this pass
+		util::parallelFor(parallel, layerEnd, extrapolatedCells.size(), [&](int i) {
+			const int index = extrapolatedCells[i];
+			const glm::ivec3 pos(index / yzMultiplier, index / gridSize.z % gridSize.y, index % gridSize.z);
 			int validNeighbourCount = 0;
 			glm::dvec3 vSum(0.0, 0.0, 0.0);
 			COMP_FOR_LOOP(axis, 3, {
 				COMP_FOR_LOOP(offset, 2, {
-					glm::ivec3 newPos = pos;
-					newPos[axis] += offset * 2 - 1;
-					if (isValid(newPos, it)) {
-						vSum[0] += (cell(newPos).faces[0].v2);
-						vSum[1] += (cell(newPos).faces[1].v2);
-						vSum[2] += (cell(newPos).faces[2].v2);
-						validNeighbourCount++;
+					if (offset == 0 ? pos[axis] > 0 : pos[axis] + 1 < gridSize[axis]) {
+						const int neighbourIndex = index + (offset * 2 - 1) * cellStride[axis];
+						if (extrapolationLayers[neighbourIndex] < layer) {
+							vSum[0] += faceV2[0][neighbourIndex];
+							vSum[1] += faceV2[1][neighbourIndex];
+							vSum[2] += faceV2[2][neighbourIndex];
+							validNeighbourCount++;
+						}
 					}
 				});
 			});
-			if (validNeighbourCount > 0) {
-				if(isPosValid(pos + glm::ivec3(1, 0, 0)) && cell<0, 1>(pos).type != MacGridCell::CellType::WATER)
-					c.faces[0].v2 = vSum[0] / validNeighbourCount;
-				if (isPosValid(pos + glm::ivec3(0, 1, 0)) && cell<1, 1>(pos).type != MacGridCell::CellType::WATER)
-					c.faces[1].v2 = vSum[1] / validNeighbourCount;
-				if (isPosValid(pos + glm::ivec3(0, 0, 1)) && cell<2, 1>(pos).type != MacGridCell::CellType::WATER)
-					c.faces[2].v2 = vSum[2] / validNeighbourCount;
-				setValid(pos, it + 1);
+			COMP_FOR_LOOP(axis, 3, {
+				if (pos[axis] + 1 < gridSize[axis] && cellTypes[index + cellStride[axis]] != MacGridCell::CellType::WATER)
+					faceV2[axis][index] = vSum[axis] / validNeighbourCount;
+			});
+		});
+		layerStart = layerEnd;
+	}
+}
+
+void MacGrid::updateLiquidLevelSet(bool parallel, double dt, const std::vector<int>& particleCounts, int bandLayerCount) {
+	narrowBandLayerCount = std::clamp(bandLayerCount, 1, 250);
+	const int deepLayer = narrowBandLayerCount + 2;
+	const double h = cellD.x;
+	if (liquidSdf.empty())
+		liquidSdf.assign(cellCount, 0.5 * h);
+	liquidLayers.resize(cellCount);
+	const glm::dvec3 low = cellD;
+	const glm::dvec3 high = dimensions - cellD;
+	const auto backtrace = [&](const glm::dvec3& pos) {
+		return glm::clamp(pos - dt * sampleVelocity(glm::clamp(pos, low, high)), low, high);
+	};
+
+	//near the surface the particles define the liquid, below the band the advected level set does (the bulk is at least
+	//a band away from the air, so only the cells that were inside the liquid have to be traced back)
+	const double bulkLevel = -(narrowBandLayerCount - 0.5) * h;
+	util::parallelFor(parallel, 0, gridSize.x, [&](int x) {
+		for (int y = 0; y < gridSize.y; y++) {
+			for (int z = 0; z < gridSize.z; z++) {
+				const int index = x * yzMultiplier + y * gridSize.z + z;
+				bool liquid = false;
+				if (cellTypes[index] != MacGridCell::CellType::SOLID)
+					liquid = particleCounts[index] > 0 || (liquidSdf[index] < 0.0 && sampleLiquidSdf(backtrace(glm::dvec3(x + 0.5, y + 0.5, z + 0.5) * cellD)) < bulkLevel);
+				liquidLayers[index] = liquid ? deepLayer : 0;
 			}
+		}
+	});
+
+	//the liquid cells and the first layer are counted for each x slab in parallel, then written in index order (so the
+	//order of the layers does not depend on the thread count)
+	const auto isSurfaceNeighbour = [&](int index) {
+		return liquidLayers[index] == 0 && cellTypes[index] != MacGridCell::CellType::SOLID;
+	};
+	const auto forEachSlabLiquidCell = [&](int x, auto&& func) {
+		for (int index = x * yzMultiplier; index < (x + 1) * yzMultiplier; index++) {
+			if (liquidLayers[index] == 0)
+				continue;
+			const glm::ivec3 pos(x, index / gridSize.z % gridSize.y, index % gridSize.z);
+			bool surface = false;
+			COMP_FOR_LOOP(axis, 3, {
+				surface |= pos[axis] > 0 && isSurfaceNeighbour(index - cellStride[axis]);
+				surface |= pos[axis] + 1 < gridSize[axis] && isSurfaceNeighbour(index + cellStride[axis]);
+			});
+			func(index, surface);
+		}
+	};
+	std::vector<int> liquidSlabStarts(gridSize.x + 1, 0);
+	std::vector<int> surfaceSlabStarts(gridSize.x + 1, 0);
+	util::parallelFor(parallel, 0, gridSize.x, [&](int x) {
+		forEachSlabLiquidCell(x, [&](int, bool surface) {
+			liquidSlabStarts[x + 1]++;
+			surfaceSlabStarts[x + 1] += surface;
 		});
+	});
+	util::prefixSum(parallel, liquidSlabStarts);
+	util::prefixSum(parallel, surfaceSlabStarts);
+	liquidCells.resize(liquidSlabStarts.back());
+	liquidBandCells.resize(surfaceSlabStarts.back());
+	util::parallelFor(parallel, 0, gridSize.x, [&](int x) {
+		int liquidPos = liquidSlabStarts[x];
+		int surfacePos = surfaceSlabStarts[x];
+		forEachSlabLiquidCell(x, [&](int index, bool surface) {
+			liquidCells[liquidPos++] = index;
+			if (surface)
+				liquidBandCells[surfacePos++] = index;
+		});
+	});
+	util::parallelFor(parallel, 0, liquidBandCells.size(), [&](int i) {
+		liquidLayers[liquidBandCells[i]] = 1;
+	});
+	int layerStart = 0;
+	for (int layer = 2; layer < deepLayer; layer++) {
+		const int layerEnd = liquidBandCells.size();
+		for (int i = layerStart; i < layerEnd; i++) {
+			const int index = liquidBandCells[i];
+			const glm::ivec3 pos(index / yzMultiplier, index / gridSize.z % gridSize.y, index % gridSize.z);
+			COMP_FOR_LOOP(axis, 3, {
+				COMP_FOR_LOOP(offset, 2, {
+					if (offset == 0 ? pos[axis] > 0 : pos[axis] + 1 < gridSize[axis]) {
+						const int neighbourIndex = index + (offset * 2 - 1) * cellStride[axis];
+						if (liquidLayers[neighbourIndex] == deepLayer) {
+							liquidLayers[neighbourIndex] = layer;
+							liquidBandCells.push_back(neighbourIndex);
+						}
+					}
+				});
+			});
+		}
+		layerStart = layerEnd;
 	}
+
+	//the level set is rebuilt from the layers (the solid cells copy their neighbours, so that the bulk is not eroded by
+	//the walls when it is advected), and the velocity next to the bulk cells is advected from the previous step
+	const auto layerDistance = [h](int layer) {
+		return layer > 0 ? -(layer - 0.5) * h : 0.5 * h;
+	};
+	for (int axis = 0; axis < 3; axis++)
+		bulkFaceV[axis].resize(cellCount);
+	util::parallelFor(parallel, 0, gridSize.x, [&](int x) {
+		for (int y = 0; y < gridSize.y; y++) {
+			for (int z = 0; z < gridSize.z; z++) {
+				const int index = x * yzMultiplier + y * gridSize.z + z;
+				const int layer = liquidLayers[index];
+				const glm::ivec3 pos(x, y, z);
+				if (cellTypes[index] == MacGridCell::CellType::SOLID) {
+					double distance = 0.5 * h;
+					COMP_FOR_LOOP(axis, 3, {
+						COMP_FOR_LOOP(offset, 2, {
+							if (offset == 0 ? pos[axis] > 0 : pos[axis] + 1 < gridSize[axis]) {
+								const int neighbourIndex = index + (offset * 2 - 1) * cellStride[axis];
+								if (cellTypes[neighbourIndex] != MacGridCell::CellType::SOLID)
+									distance = std::min(distance, layerDistance(liquidLayers[neighbourIndex]));
+							}
+						});
+					});
+					liquidSdf[index] = distance;
+				}
+				else {
+					liquidSdf[index] = layerDistance(layer);
+				}
+				COMP_FOR_LOOP(axis, 3, {
+					if (layer > narrowBandLayerCount || (pos[axis] + 1 < gridSize[axis] && liquidLayers[index + cellStride[axis]] > narrowBandLayerCount)) {
+						glm::dvec3 facePos = glm::dvec3(x + 0.5, y + 0.5, z + 0.5);
+						facePos[axis] += 0.5;
+						facePos = glm::clamp(facePos * cellD, low, high);
+						//the own component of the face is not interpolated, and only that component is needed at the departure point
+						glm::dvec3 v;
+						COMP_FOR_LOOP(component, 3, {
+							v[component] = component == axis ? double(faceV2[axis][index]) : sampleVelocity(facePos, component);
+						});
+						bulkFaceV[axis][index] = sampleVelocity(glm::clamp(facePos - dt * v, low, high), axis);
+					}
+				});
+			}
+		}
+	});
+}
+
+void MacGrid::applyBulkLiquid(bool parallel) {
+	if (liquidLayers.empty())
+		return;
+	//only the liquid cells are visited, each face is written by the bulk cell it belongs to, or by the bulk cell on its
+	//other side if its own cell is not in the bulk
+	util::parallelFor(parallel, 0, liquidCells.size(), [&](int i) {
+		const int index = liquidCells[i];
+		if (liquidLayers[index] <= narrowBandLayerCount)
+			return;
+		cellTypes[index] = MacGridCell::CellType::WATER;
+		cellAvgPNum[index] = std::max<double>(cellAvgPNum[index], averagePressure);
+		const glm::ivec3 pos(index / yzMultiplier, index / gridSize.z % gridSize.y, index % gridSize.z);
+		COMP_FOR_LOOP(axis, 3, {
+			if (faceWeightSum[axis][index] <= 1e-6)
+				faceV[axis][index] = bulkFaceV[axis][index];
+			const int neighbourIndex = index - cellStride[axis];
+			if (pos[axis] > 0 && liquidLayers[neighbourIndex] <= narrowBandLayerCount && faceWeightSum[axis][neighbourIndex] <= 1e-6)
+				faceV[axis][neighbourIndex] = bulkFaceV[axis][neighbourIndex];
+		});
+	});
+}
+
+void MacGrid::clearLiquidLevelSet() {
+	liquidSdf.clear();
+	liquidLayers.clear();
+	liquidBandCells.clear();
+	liquidCells.clear();
+	for (int axis = 0; axis < 3; axis++)
+		bulkFaceV[axis].clear();
+}
+
+double MacGrid::sampleLiquidSdf(const glm::dvec3& pos) const {
+	const glm::dvec3 gridPos = pos * cellDInv - 0.5;
+	const glm::ivec3 base(
+		std::clamp(int(std::floor(gridPos.x)), 0, gridSize.x - 2),
+		std::clamp(int(std::floor(gridPos.y)), 0, gridSize.y - 2),
+		std::clamp(int(std::floor(gridPos.z)), 0, gridSize.z - 2));
+	const glm::dvec3 w = glm::clamp(gridPos - glm::dvec3(base.x, base.y, base.z), glm::dvec3(0, 0, 0), glm::dvec3(1, 1, 1));
+	const util::Real* d = liquidSdf.data() + base.x * yzMultiplier + base.y * gridSize.z + base.z;
+	const double d00 = d[0] + (d[1] - d[0]) * w.z;
+	const double d01 = d[gridSize.z] + (d[gridSize.z + 1] - d[gridSize.z]) * w.z;
+	const double d10 = d[yzMultiplier] + (d[yzMultiplier + 1] - d[yzMultiplier]) * w.z;
+	const double d11 = d[yzMultiplier + gridSize.z] + (d[yzMultiplier + gridSize.z + 1] - d[yzMultiplier + gridSize.z]) * w.z;
+	const double d0 = d00 + (d01 - d00) * w.y;
+	const double d1 = d10 + (d11 - d10) * w.y;
+	return d0 + (d1 - d0) * w.x;
 }
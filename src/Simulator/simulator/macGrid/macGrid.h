@@ -6,8 +6,12 @@
 #include <functional>
 #include <utility>
 #include <atomic>
+#include <algorithm>
+#include <limits>
+#include <memory>
 #include "macGridCell.h"
 #include "obstacles.hpp"
+#include "obstacleSet.h"
 #include "../util/glmExtraOps.h"
 
 
@@ -16,7 +20,7 @@ namespace genericfsim::macgrid {
 /**
  * A class that implements a MAC grid.
  */
-class MacGrid {									//TODO: make the grid cells a 1D array
+class MacGrid {
 public:
 	/**
 	 * Contructs the MAC grid class.
@@ -37,7 +41,55 @@ public:
 	 * \param axis - the axis of the returned faces
 	 * \return - an array for the given axis, which consists of 8 faces
 	 */
-	std::array<std::array<MacGridCell::FaceRef, 8>, 3> getFacesAround(const glm::dvec3& pos);
+	std::array<std::array<MacGridCell::Face, 8>, 3> getFacesAround(const glm::dvec3& pos);
+
+	/**
+	 * The 8 faces closest to a point along one axis, given by their indexes in the grid data arrays and the 1D
+	 * trilinear weights. Face p is the lower (0) or upper (1) face along x, y, z by the bits (p >> 2) & 1, (p >> 1) & 1, p & 1.
+	 */
+	struct FaceStencil {
+		std::array<int, 8> indices;
+		glm::dvec3 weights;				//the 1D weights of the upper faces along x, y, z, the lower faces have 1 - weights
+	};
+
+	/**
+	 * Returns the stencil of the 8 faces closest to a point along an axis (the same faces as getFacesAround).
+	 * 
+	 * \param pos - a point in space
+	 * \param axis - the axis of the faces
+	 * \return - the face stencil
+	 */
+	inline FaceStencil getFaceStencil(const glm::dvec3& pos, int axis) const;
+
+	/**
+	 * Samples the velocity field after the incompressibility step (v2) at a point with trilinear interpolation.
+	 * 
+	 * \param pos - a point in space (at least one cell away from the border)
+	 * \return - the velocity at the point (the z component is 0 in 2D)
+	 */
+	inline glm::dvec3 sampleVelocity(const glm::dvec3& pos) const;
+
+	/**
+	 * Samples one component of the velocity field after the incompressibility step (v2) at a point.
+	 * 
+	 * \param pos - a point in space (at least one cell away from the border)
+	 * \param axis - the component
+	 * \return - the component of the velocity at the point (0 for z in 2D)
+	 */
+	inline double sampleVelocity(const glm::dvec3& pos, int axis) const;
+
+	/**
+	 * Returns the face velocities of an axis before (v) and after (v2) the forces and the incompressibility are applied.
+	 * 
+	 * \param axis - the axis of the faces
+	 * \return - the face velocities indexed the same way as the cells
+	 */
+	inline const std::vector<util::Real>& getFaceV(int axis) const {
+		return faceV[axis];
+	}
+	inline const std::vector<util::Real>& getFaceV2(int axis) const {
+		return faceV2[axis];
+	}
 
 	/**
 	 * \brief Returns the cell closest to the given pos.
@@ -45,7 +97,7 @@ public:
 	 * \param pos - a point in space
 	 * \return - the cell
 	 */
-	MacGridCell& getCellAt(const glm::dvec3& pos);
+	MacGridCell getCellAt(const glm::dvec3& pos);
 
 	/**
 	 * Returns all 8 cells closest to a point in space.
@@ -53,7 +105,7 @@ public:
 	 * \param pos - a point in space
 	 * \return - an array of the 8 cells
 	 */
-	std::array<MacGridCellRef, 8> getCellsAround(const glm::dvec3& pos);
+	std::array<MacGridCell, 8> getCellsAround(const glm::dvec3& pos);
 
 	/**
 	 * Returns the cell given by the pos, the axis and offset.
@@ -64,16 +116,23 @@ public:
 	 * \return - the cell
 	 */
 	template<int axis = 0, int offset = 0>
-	inline MacGridCell& cell(const glm::ivec3& pos) {
-		if constexpr (axis == 0) {
-			return rawCells[(pos.x + offset) * yzMultiplier + pos.y * gridSize.z + pos.z];
-		}
-		else if constexpr (axis == 1) {
-			return rawCells[pos.x * yzMultiplier + (pos.y + offset) * gridSize.z + pos.z];
-		}
-		else {
-			return rawCells[pos.x * yzMultiplier + pos.y * gridSize.z + pos.z + offset];
-		}
+	inline MacGridCell cell(const glm::ivec3& pos) {
+		glm::ivec3 coord = pos;
+		coord[axis] += offset;
+		return cell(coord.x, coord.y, coord.z);
+	}
+
+	/**
+	 * Returns the index of the cell given by the pos, the axis and offset in the grid data arrays.
+	 *
+	 * \param axis - the axis (0 - x, 1 - y, 2 - z)
+	 * \param offset - the offset of the axis
+	 * \param pos - the position of the cell
+	 * \return - the index of the cell
+	 */
+	template<int axis = 0, int offset = 0>
+	inline int cellIndex(const glm::ivec3& pos) const {
+		return pos.x * yzMultiplier + pos.y * gridSize.z + pos.z + offset * cellStride[axis];
 	}
 
 	inline bool isPosValid(const glm::ivec3& pos) {
@@ -88,8 +147,13 @@ public:
 	 * \param z
 	 * \return the cell
 	 */
-	inline MacGridCell& cell(int x, int y, int z) {
-		return rawCells[x * yzMultiplier + y * gridSize.z + z];
+	inline MacGridCell cell(int x, int y, int z) {
+		const int index = x * yzMultiplier + y * gridSize.z + z;
+		return MacGridCell{ {
+				{ faceV[0][index], faceV2[0][index], faceWeightSum[0][index], glm::dvec3((x + 1) * cellD.x, (y + 0.5) * cellD.y, (z + 0.5) * cellD.z) },
+				{ faceV[1][index], faceV2[1][index], faceWeightSum[1][index], glm::dvec3((x + 0.5) * cellD.x, (y + 1) * cellD.y, (z + 0.5) * cellD.z) },
+				{ faceV[2][index], faceV2[2][index], faceWeightSum[2][index], glm::dvec3((x + 0.5) * cellD.x, (y + 0.5) * cellD.y, (z + 1) * cellD.z) } },
+			glm::dvec3(x + 0.5, y + 0.5, z + 0.5) * cellD, cellTypes[index], cellAvgPNum[index], fluidCellIds[index] };
 	}
 
 	/**
@@ -99,6 +163,8 @@ public:
 	 * \param includeBorders - includes also border cells if true
 	 * \param lambda - the lambda to run for each gridcell
 	 */
+	template<typename F>
+	void forEachCell(bool parallel, bool includeBorders, F&& lambda);
 	void forEachCell(bool parallel, bool includeBorders, std::function<void(glm::ivec3 pos, MacGridCell&)>&& lambda);
 
 	/**
@@ -107,8 +173,20 @@ public:
 	 * \param parallel - if true the function runs in parallel for each x value
 	 * \param lambda - the lambda to run for each gridcell
 	 */
+	template<typename F>
+	void forEachFluidCell(bool parallel, F&& lambda);
 	void forEachFluidCell(bool parallel, std::function<void(glm::ivec3 pos, MacGridCell&)>&& lambda);
 
+	/**
+	 * Run a certain lambda for each cell of the active tiles in sparse mode, for each gridcell (including the borders)
+	 * otherwise. The cells outside of the active tiles hold no particles and no fluid.
+	 *
+	 * \param parallel - if true the function runs in parallel for each tile
+	 * \param lambda - the lambda to run for each gridcell
+	 */
+	template<typename F>
+	void forEachActiveCell(bool parallel, F&& lambda);
+
 	/**
 	 * Restores all cells to the solid state that should be solid and updates all the velocities they 
 	 */
@@ -123,12 +201,79 @@ public:
 	void postP2GUpdate(bool parallel, double gravityIncrement);
 
 	/**
-	 * Extrapolates the velocities of the grid to walls and air cells (needed for correct advection).
+	 * Extrapolates the velocities of the grid to walls and air cells (needed for correct advection). The cells are
+	 * visited in layers of a breadth first search from the fluid cells, so only the velocityExtrapolationLayerCount
+	 * layers around the fluid are touched, and each layer only reads the earlier ones (the result does not depend on
+	 * the thread count).
  	 * 
- 	 * \param parallel - if true the function runs in parallel for each x value
+ 	 * \param parallel - if true the cells of each layer are processed in parallel
  	 */
 	void extrapolateVelocities(bool parallel);
 
+	/**
+	 * Updates the liquid level set of the narrow band mode (call it before the grid is reset for the P2G transfer, while
+	 * v2 still holds the velocities of the previous step). The bulk of the previous level set (below the particle band)
+	 * is advected by the grid velocity and merged with the cells that contain particles, then the liquid cells are
+	 * numbered by their distance from the surface in the layers of a breadth first search. The velocity of the bulk is
+	 * advected the same way for applyBulkLiquid. The mode saves particle work, not grid work: the level set is rebuilt in
+	 * parallel over the whole grid, because the bulk cells hold no particles and are not part of the active tiles.
+	 * 
+	 * \param parallel - if true the cells are processed in parallel
+	 * \param dt - the time step size in s
+	 * \param particleCounts - the number of particles in each cell
+	 * \param bandLayerCount - the number of cell layers below the surface that are represented by particles
+	 */
+	void updateLiquidLevelSet(bool parallel, double dt, const std::vector<int>& particleCounts, int bandLayerCount);
+
+	/**
+	 * Marks the bulk cells (below the particle band) as fluid with at least the average particle density, and sets the
+	 * faces next to them that got no particle weight to the advected bulk velocity. Call it after the P2G transfer and
+	 * the particle density calculation, it does nothing if the level set was not updated. Only the liquid cells of the
+	 * level set are visited.
+	 * 
+	 * \param parallel - if true the cells are processed in parallel
+	 */
+	void applyBulkLiquid(bool parallel);
+
+	/**
+	 * Drops the liquid level set (the narrow band mode is turned off).
+	 */
+	void clearLiquidLevelSet();
+
+	inline bool hasLiquidLevelSet() const {
+		return !liquidLayers.empty();
+	}
+
+	/**
+	 * Returns the liquid layer of a cell: 0 outside the liquid, 1 at the surface, the band layer count + 2 for all the
+	 * cells deeper than the band.
+	 * 
+	 * \param index - the index of the cell
+	 * \return - the layer
+	 */
+	inline int getLiquidLayer(int index) const {
+		return liquidLayers.empty() ? 0 : liquidLayers[index];
+	}
+
+	/**
+	 * Returns the liquid layer of the cell containing a point.
+	 */
+	inline int getLiquidLayer(const glm::dvec3& pos) const;
+
+	/**
+	 * Returns the liquid cells within the particle band (and the layer below it) in layer order.
+	 */
+	inline const std::vector<int>& getLiquidBandCells() const {
+		return liquidBandCells;
+	}
+
+	/**
+	 * Returns all liquid cells of the level set (the band and the bulk) in index order.
+	 */
+	inline const std::vector<int>& getLiquidCells() const {
+		return liquidCells;
+	}
+
 	/**
 	 * Calculates the min and max pos of a rectangle with a given pos and size (so that the returned values align with the solid region on the grid).
 	 * 
@@ -145,10 +290,45 @@ public:
 	}
 
 	/**
-	 * Resets all grid values to their default (avg particle number, faces, type to AIR).
+	 * Resets all grid values to their default (avg particle number, faces, type to AIR). In sparse mode only the tiles
+	 * that were written since the last reset and the active tiles are reset, the others already hold the defaults.
 	 */
 	void resetGridValues(bool parallel);
 
+	/**
+	 * Starts collecting the active tiles of the sparse mode: call activateTileAt for every point that needs grid values
+	 * (the particles), then finishTileActivation, before resetGridValues.
+	 */
+	void clearActiveTiles();
+
+	/**
+	 * Marks the tile containing a point as occupied (it can be called in parallel).
+	 *
+	 * \param pos - a point in space
+	 */
+	inline void activateTileAt(const glm::dvec3& pos);
+
+	/**
+	 * Builds the list of active tiles: the occupied tiles, the tiles of the bulk liquid of the narrow band mode and
+	 * their neighbours (so every cell within a tile size of a fluid cell is active).
+	 *
+	 * \param parallel - if true the bulk liquid cells are checked in parallel
+	 */
+	void finishTileActivation(bool parallel);
+
+	/**
+	 * Returns the largest absolute face velocity (v2) of the grid, in sparse mode only the active tiles are checked
+	 * (the others hold no velocities that the particles could sample).
+	 *
+	 * \param parallel - if true the faces are checked in parallel
+	 * \return - the largest absolute face velocity
+	 */
+	double getMaxFaceVelocity(bool parallel) const;
+
+	inline int getActiveTileCount() const {
+		return activeTiles.size();
+	}
+
 	/**
 	 * Adds an obstacle to the grid (makes the cells solid and sets their face values).
 	 * 
@@ -156,6 +336,46 @@ public:
 	 */
 	void addObstacle(bool parallel, const genericfsim::obstacle::Obstacle* obstacle);
 
+	/**
+	 * Bakes the signed distance fields of all obstacles into one field sampled at the cell centers (the minimum of the
+	 * obstacle distances), and stores the closest obstacle of each cell. The distances are only calculated near the
+	 * obstacles: the bounds of the obstacles are rasterized into tiles of cells, and the cells of a tile only test the
+	 * obstacles that reach it. Elsewhere the field is clamped to a value that is larger than the margin, which is only
+	 * restored in the tiles that the previous bake wrote, so a bake costs time in proportion to the reached tiles.
+	 * 
+	 * \param parallel - if true the cells are processed in parallel
+	 * \param obstacles - the obstacles sorted by type (spheres and boxes are baked by inlined kernels)
+	 * \param margin - the distance up to which the field has to be exact (e.g. the particle radius)
+	 */
+	void bakeObstacleSdf(bool parallel, const genericfsim::obstacle::ObstacleSet& obstacles, double margin);
+
+	/**
+	 * Samples the baked obstacle distance field with trilinear interpolation. Points in tiles that no obstacle reaches
+	 * return right away without touching the field.
+	 * 
+	 * \param pos - a point in space
+	 * \param normal - set to the normalized gradient of the field (the direction away from the closest obstacle)
+	 * \return - the signed distance from the closest obstacle, the maximal double far from all obstacles
+	 */
+	inline double sampleObstacleSdf(const glm::dvec3& pos, glm::dvec3& normal) const;
+
+	/**
+	 * Returns the index of the closest obstacle (in the obstacle list of the set given to bakeObstacleSdf) of the cell
+	 * containing a point.
+	 * 
+	 * \param pos - a point in space
+	 * \return - the index of the obstacle, -1 if there is no obstacle near the cell
+	 */
+	inline int getClosestObstacle(const glm::dvec3& pos) const;
+
+	/**
+	 * Returns whether any obstacle can be within the baked band around a point (the broad phase of the obstacle tests).
+	 * 
+	 * \param pos - a point in space
+	 * \return - false if the tile of the point is not reached by any obstacle
+	 */
+	inline bool isNearObstacle(const glm::dvec3& pos) const;
+
 	/**
 	 * Abstract function that solves incompressibility on the grid.
 	 * 
@@ -164,6 +384,14 @@ public:
 	 */
 	virtual int solveIncompressibility(bool parallel, double dt) = 0;
 
+	/**
+	 * Returns the estimated number of iterations the last solve saved by starting from the previous pressure.
+	 * Only solvers that support warm starting set it, it is 0 for the others.
+	 */
+	inline int getIterationsSavedByWarmStart() const {
+		return iterationsSavedByWarmStart;
+	}
+
 public:
 	const glm::dvec3 cellD;
 	const glm::dvec3 cellDInv;
@@ -177,6 +405,8 @@ public:
 	bool pressureEnabled = true;
 	double fluidDensity = 1.0;
 	double residualTolerance = 1e-6;
+	int velocityExtrapolationLayerCount = 2;
+	bool sparseTilesEnabled = false;	//the per step sweeps only visit the tiles around the particles (the grid arrays stay dense)
 
 
 	const bool twoD;
@@ -184,14 +414,342 @@ public:
 protected:
 	const int yzMultiplier;
 	const int cellCount;
+	const glm::ivec3 cellStride;
+
+	std::array<std::vector<util::Real>, 3> faceV;
+	std::array<std::vector<util::Real>, 3> faceV2;
+	std::array<std::vector<util::Real>, 3> faceWeightSum;
+	std::vector<MacGridCell::CellType> cellTypes;
+	std::vector<util::Real> cellAvgPNum;
+	std::vector<int> fluidCellIds;
 
-	std::vector<MacGridCell> rawCells;
 	std::vector<glm::ivec3> fluidCellPositions;
+	int iterationsSavedByWarmStart = 0;
+
+	std::vector<util::Real> obstacleSdf;
+	std::vector<int> obstacleSdfOwner;
+	std::vector<glm::ivec3> obstacleCells;
+
+	std::vector<util::Real> liquidSdf;					//the narrow band level set at the cell centers, negative inside the liquid
+	std::vector<unsigned char> liquidLayers;
+	std::vector<int> liquidBandCells;
+	std::vector<int> liquidCells;						//the liquid cells of the level set in index order (the band and the bulk)
+	std::array<std::vector<util::Real>, 3> bulkFaceV;	//the advected velocity of the faces next to the bulk cells
+	int narrowBandLayerCount = 0;
+
+	std::vector<unsigned char> extrapolationLayers;	//the extrapolation layer of each cell, the maximal value if it was not reached
+	std::vector<int> extrapolatedCells;				//the cells reached by the last extrapolation, in layer order
+
+	static constexpr int OBSTACLE_TILE_SIZE = 4;
+	glm::ivec3 obstacleTileCount;
+	std::vector<int> obstacleTileStarts;		//the start of the shape list of each tile in obstacleTileShapes (one extra element at the end)
+	std::vector<int> obstacleTileShapes;		//the shapes that can be within the band of a tile (spheres, then boxes, then the others)
+	std::vector<int> bakedObstacleTiles;		//the tiles written by the last bake, the others hold obstacleSdfFill
+	double obstacleSdfFill = 0.0;
+
+	static constexpr int ACTIVE_TILE_SIZE = 8;
+	glm::ivec3 activeTileCount;
+	std::vector<unsigned char> tileOccupied;	//the tiles marked by activateTileAt
+	std::vector<unsigned char> tileActive;
+	std::vector<unsigned char> tileTouched;
+	std::vector<int> activeTiles;				//the occupied tiles and their neighbours in index order
+	std::vector<int> touchedTiles;				//the tiles that may hold values other than the defaults
+	bool allTilesTouched = true;				//the whole grid has to be reset (before the first sparse step)
+
+	/**
+	 * The neighbourhood of a fluid cell, built by postP2GUpdate so that the solvers only need to stream dense arrays.
+	 */
+	struct FluidCellNeighbours {
+		std::array<int, 6> neighbours;   //fluid cell ids of the -x, +x, -y, +y, -z, +z neighbours, -1 if the neighbour is not a fluid cell
+		int nonSolidCount;               //the number of non-solid neighbours (the unscaled diagonal of the pressure matrix)
+
+		inline int prev(int axis) const {
+			return neighbours[2 * axis];
+		}
+
+		inline int next(int axis) const {
+			return neighbours[2 * axis + 1];
+		}
+	};
+	std::vector<FluidCellNeighbours> fluidCellNeighbours;
 
 private:
 	void initNewGrid();
+	void touchTileOf(int index);
+	inline glm::ivec3 getTileStart(int tile) const;
+	template<typename F>
+	void forEachTileCell(bool parallel, const std::vector<int>& tiles, F&& lambda);
+	template<typename F>
+	void forEachActiveCellInOrder(F&& lambda);
+	double sampleLiquidSdf(const glm::dvec3& pos) const;
+	void buildFluidCellNeighbours(bool parallel);
 
 };
 
+template<typename F>
+inline void MacGrid::forEachCell(bool parallel, bool includeBorders, F&& lambda) {
+	int b = !includeBorders;
+	if (parallel) {
+#pragma omp parallel for
+		for (int x = b; x < gridSize.x - b; x++) {
+			for (int y = b; y < gridSize.y - b; y++) {
+				for (int z = b; z < gridSize.z - b; z++) {
+					MacGridCell c = cell(x, y, z);
+					lambda(glm::ivec3(x, y, z), c);
+				}
+			}
+		}
+	}
+	else {
+		for (int x = b; x < gridSize.x - b; x++) {
+			for (int y = b; y < gridSize.y - b; y++) {
+				for (int z = b; z < gridSize.z - b; z++) {
+					MacGridCell c = cell(x, y, z);
+					lambda(glm::ivec3(x, y, z), c);
+				}
+			}
+		}
+	}
+}
+
+template<typename F>
+inline void MacGrid::forEachFluidCell(bool parallel, F&& lambda) {
+	if (parallel) {
+#pragma omp parallel for
+		for (int p = 0; p < fluidCellPositions.size(); p++) {
+			const auto& pos = fluidCellPositions[p];
+			MacGridCell c = cell(pos);
+			lambda(pos, c);
+		}
+	}
+	else {
+		for (int p = 0; p < fluidCellPositions.size(); p++) {
+			const auto& pos = fluidCellPositions[p];
+			MacGridCell c = cell(pos);
+			lambda(pos, c);
+		}
+	}
+}
+
+template<typename F>
+inline void MacGrid::forEachActiveCell(bool parallel, F&& lambda) {
+	if (!sparseTilesEnabled) {
+		forEachCell(parallel, true, std::forward<F>(lambda));
+		return;
+	}
+	forEachTileCell(parallel, activeTiles, [&](const glm::ivec3& pos) {
+		MacGridCell c = cell(pos.x, pos.y, pos.z);
+		lambda(pos, c);
+	});
+}
+
+inline glm::ivec3 MacGrid::getTileStart(int tile) const {
+	return glm::ivec3(tile / (activeTileCount.y * activeTileCount.z), tile / activeTileCount.z % activeTileCount.y, tile % activeTileCount.z)
+		* ACTIVE_TILE_SIZE;
+}
+
+template<typename F>
+inline void MacGrid::forEachTileCell(bool parallel, const std::vector<int>& tiles, F&& lambda) {
+	const auto visitTile = [&](int tile) {
+		const glm::ivec3 start = getTileStart(tile);
+		const glm::ivec3 end = glm::min(start + glm::ivec3(ACTIVE_TILE_SIZE), gridSize);
+		for (int x = start.x; x < end.x; x++) {
+			for (int y = start.y; y < end.y; y++) {
+				for (int z = start.z; z < end.z; z++) {
+					lambda(glm::ivec3(x, y, z));
+				}
+			}
+		}
+	};
+	if (parallel) {
+#pragma omp parallel for
+		for (int i = 0; i < tiles.size(); i++) {
+			visitTile(tiles[i]);
+		}
+	}
+	else {
+		for (int i = 0; i < tiles.size(); i++) {
+			visitTile(tiles[i]);
+		}
+	}
+}
+
+template<typename F>
+inline void MacGrid::forEachActiveCellInOrder(F&& lambda) {
+	//visits the non border cells of the active tiles in the same order as forEachCell: the tiles are sorted by index, so
+	//the tiles of an x slab and the tiles of a y row within the slab are contiguous in the list
+	const int slabTileCount = activeTileCount.y * activeTileCount.z;
+	const int tileNum = activeTiles.size();
+	for (int slabStart = 0; slabStart < tileNum;) {
+		const int tileX = activeTiles[slabStart] / slabTileCount;
+		int slabEnd = slabStart;
+		while (slabEnd < tileNum && activeTiles[slabEnd] / slabTileCount == tileX)
+			slabEnd++;
+		for (int x = std::max(tileX * ACTIVE_TILE_SIZE, 1); x < std::min((tileX + 1) * ACTIVE_TILE_SIZE, gridSize.x - 1); x++) {
+			for (int rowStart = slabStart; rowStart < slabEnd;) {
+				const int tileY = activeTiles[rowStart] / activeTileCount.z % activeTileCount.y;
+				int rowEnd = rowStart;
+				while (rowEnd < slabEnd && activeTiles[rowEnd] / activeTileCount.z % activeTileCount.y == tileY)
+					rowEnd++;
+				for (int y = std::max(tileY * ACTIVE_TILE_SIZE, 1); y < std::min((tileY + 1) * ACTIVE_TILE_SIZE, gridSize.y - 1); y++) {
+					for (int i = rowStart; i < rowEnd; i++) {
+						const int tileZ = activeTiles[i] % activeTileCount.z;
+						for (int z = std::max(tileZ * ACTIVE_TILE_SIZE, 1); z < std::min((tileZ + 1) * ACTIVE_TILE_SIZE, gridSize.z - 1); z++) {
+							lambda(glm::ivec3(x, y, z));
+						}
+					}
+				}
+				rowStart = rowEnd;
+			}
+		}
+		slabStart = slabEnd;
+	}
+}
+
+inline void MacGrid::activateTileAt(const glm::dvec3& pos) {
+	const glm::ivec3 tile(
+		std::clamp(int(pos.x * cellDInv.x), 0, gridSize.x - 1) / ACTIVE_TILE_SIZE,
+		std::clamp(int(pos.y * cellDInv.y), 0, gridSize.y - 1) / ACTIVE_TILE_SIZE,
+		std::clamp(int(pos.z * cellDInv.z), 0, gridSize.z - 1) / ACTIVE_TILE_SIZE);
+	std::atomic_ref<unsigned char>(tileOccupied[(tile.x * activeTileCount.y + tile.y) * activeTileCount.z + tile.z]).store(1, std::memory_order_relaxed);
+}
+
+inline MacGrid::FaceStencil MacGrid::getFaceStencil(const glm::dvec3& pos, int axis) const {
+	glm::dvec3 axisOffset(0.5, 0.5, 0.5);
+	axisOffset[axis] = 0.0;
+	const glm::dvec3 gridPos = pos * cellDInv - axisOffset;
+	glm::ivec3 coord(gridPos.x, gridPos.y, gridPos.z);
+	const glm::dvec3 weights = gridPos - glm::dvec3(coord.x, coord.y, coord.z);
+	coord[axis] -= 1;
+	const int index = coord.x * yzMultiplier + coord.y * gridSize.z + coord.z;
+	return FaceStencil{ {
+			index, index + 1, index + gridSize.z, index + gridSize.z + 1,
+			index + yzMultiplier, index + yzMultiplier + 1, index + yzMultiplier + gridSize.z, index + yzMultiplier + gridSize.z + 1
+		}, weights };
+}
+
+inline glm::dvec3 MacGrid::sampleVelocity(const glm::dvec3& pos) const {
+	glm::dvec3 v(0.0, 0.0, 0.0);
+	for (int axis = 0; axis < (twoD ? 2 : 3); axis++)
+		v[axis] = sampleVelocity(pos, axis);
+	return v;
+}
+
+inline double MacGrid::sampleVelocity(const glm::dvec3& pos, int axis) const {
+	if (twoD && axis == 2)
+		return 0.0;
+	const FaceStencil stencil = getFaceStencil(pos, axis);
+	const util::Real* faceV2 = this->faceV2[axis].data();
+	const glm::dvec3 upper = stencil.weights;
+	const glm::dvec3 lower = 1.0 - upper;
+	const double v00 = faceV2[stencil.indices[0]] * lower.z + faceV2[stencil.indices[1]] * upper.z;
+	const double v01 = faceV2[stencil.indices[2]] * lower.z + faceV2[stencil.indices[3]] * upper.z;
+	const double v10 = faceV2[stencil.indices[4]] * lower.z + faceV2[stencil.indices[5]] * upper.z;
+	const double v11 = faceV2[stencil.indices[6]] * lower.z + faceV2[stencil.indices[7]] * upper.z;
+	return (v00 * lower.y + v01 * upper.y) * lower.x + (v10 * lower.y + v11 * upper.y) * upper.x;
+}
+
+inline double MacGrid::sampleObstacleSdf(const glm::dvec3& pos, glm::dvec3& normal) const {
+	if (obstacleSdf.empty() || !isNearObstacle(pos)) {
+		normal = glm::dvec3(0, 1, 0);
+		return std::numeric_limits<double>::max();
+	}
+	const glm::dvec3 gridPos = pos * cellDInv - 0.5;
+	const glm::ivec3 base(
+		std::clamp(int(std::floor(gridPos.x)), 0, gridSize.x - 2),
+		std::clamp(int(std::floor(gridPos.y)), 0, gridSize.y - 2),
+		std::clamp(int(std::floor(gridPos.z)), 0, gridSize.z - 2));
+	const glm::dvec3 w = glm::clamp(gridPos - glm::dvec3(base.x, base.y, base.z), glm::dvec3(0, 0, 0), glm::dvec3(1, 1, 1));
+	const util::Real* d = obstacleSdf.data() + base.x * yzMultiplier + base.y * gridSize.z + base.z;
+	const double d000 = d[0], d001 = d[1], d010 = d[gridSize.z], d011 = d[gridSize.z + 1];
+	const double d100 = d[yzMultiplier], d101 = d[yzMultiplier + 1], d110 = d[yzMultiplier + gridSize.z], d111 = d[yzMultiplier + gridSize.z + 1];
+
+	const double d00 = d000 + (d001 - d000) * w.z;
+	const double d01 = d010 + (d011 - d010) * w.z;
+	const double d10 = d100 + (d101 - d100) * w.z;
+	const double d11 = d110 + (d111 - d110) * w.z;
+	const double d0 = d00 + (d01 - d00) * w.y;
+	const double d1 = d10 + (d11 - d10) * w.y;
+
+	const glm::dvec3 gradient = glm::dvec3(
+		d1 - d0,
+		(d01 - d00) * (1 - w.x) + (d11 - d10) * w.x,
+		twoD ? 0.0 : ((d001 - d000) * (1 - w.y) + (d011 - d010) * w.y) * (1 - w.x) + ((d101 - d100) * (1 - w.y) + (d111 - d110) * w.y) * w.x) * cellDInv;
+	const double gradientLength = glm::length(gradient);
+	normal = gradientLength > 0.0 ? gradient / gradientLength : glm::dvec3(0, 1, 0);
+	return d0 + (d1 - d0) * w.x;
+}
+
+inline int MacGrid::getClosestObstacle(const glm::dvec3& pos) const {
+	if (obstacleSdfOwner.empty())
+		return -1;
+	const glm::ivec3 coord(
+		std::clamp(int(pos.x * cellDInv.x), 0, gridSize.x - 1),
+		std::clamp(int(pos.y * cellDInv.y), 0, gridSize.y - 1),
+		std::clamp(int(pos.z * cellDInv.z), 0, gridSize.z - 1));
+	return obstacleSdfOwner[coord.x * yzMultiplier + coord.y * gridSize.z + coord.z];
+}
+
+inline int MacGrid::getLiquidLayer(const glm::dvec3& pos) const {
+	if (liquidLayers.empty())
+		return 0;
+	const glm::ivec3 coord(
+		std::clamp(int(pos.x * cellDInv.x), 0, gridSize.x - 1),
+		std::clamp(int(pos.y * cellDInv.y), 0, gridSize.y - 1),
+		std::clamp(int(pos.z * cellDInv.z), 0, gridSize.z - 1));
+	return liquidLayers[coord.x * yzMultiplier + coord.y * gridSize.z + coord.z];
+}
+
+inline bool MacGrid::isNearObstacle(const glm::dvec3& pos) const {
+	if (obstacleTileStarts.empty())
+		return false;
+	const glm::ivec3 tile(
+		std::clamp(int(pos.x * cellDInv.x), 0, gridSize.x - 1) / OBSTACLE_TILE_SIZE,
+		std::clamp(int(pos.y * cellDInv.y), 0, gridSize.y - 1) / OBSTACLE_TILE_SIZE,
+		std::clamp(int(pos.z * cellDInv.z), 0, gridSize.z - 1) / OBSTACLE_TILE_SIZE);
+	const int tileIndex = (tile.x * obstacleTileCount.y + tile.y) * obstacleTileCount.z + tile.z;
+	return obstacleTileStarts[tileIndex] != obstacleTileStarts[tileIndex + 1];
+}
+
+inline std::array<std::array<MacGridCell::Face, 8>, 3> MacGrid::getFacesAround(const glm::dvec3& pos) {
+	constexpr glm::dvec3 axisOffset[3] = { glm::dvec3(0.0, 0.5, 0.5), glm::dvec3(0.5, 0.0, 0.5), glm::dvec3(0.5, 0.5, 0.0) };
+	glm::dvec3 gridPos[3] = { pos * cellDInv - axisOffset[0], pos * cellDInv - axisOffset[1], pos * cellDInv - axisOffset[2] };
+	glm::ivec3 coord[3] = { glm::ivec3(gridPos[0].x, gridPos[0].y, gridPos[0].z), glm::ivec3(gridPos[1].x, gridPos[1].y, gridPos[1].z), glm::ivec3(gridPos[2].x, gridPos[2].y, gridPos[2].z) };
+	coord[0].x -= 1;
+	coord[1].y -= 1;
+	coord[2].z -= 1;
+
+	return { std::array<MacGridCell::Face, 8>{
+				cell(coord[0].x + 1, coord[0].y + 1, coord[0].z + 1).faces[0],
+				cell(coord[0].x, coord[0].y + 1, coord[0].z + 1).faces[0],
+				cell(coord[0].x + 1, coord[0].y, coord[0].z + 1).faces[0],
+				cell(coord[0].x + 1, coord[0].y + 1, coord[0].z).faces[0],
+				cell(coord[0].x + 1, coord[0].y, coord[0].z).faces[0],
+				cell(coord[0].x, coord[0].y, coord[0].z + 1).faces[0],
+				cell(coord[0].x, coord[0].y + 1, coord[0].z).faces[0],
+				cell(coord[0].x, coord[0].y, coord[0].z).faces[0]
+			},
+			std::array<MacGridCell::Face, 8>{
+				cell(coord[1].x + 1, coord[1].y + 1, coord[1].z + 1).faces[1],
+				cell(coord[1].x, coord[1].y + 1, coord[1].z + 1).faces[1],
+				cell(coord[1].x + 1, coord[1].y, coord[1].z + 1).faces[1],
+				cell(coord[1].x + 1, coord[1].y + 1, coord[1].z).faces[1],
+				cell(coord[1].x + 1, coord[1].y, coord[1].z).faces[1],
+				cell(coord[1].x, coord[1].y, coord[1].z + 1).faces[1],
+				cell(coord[1].x, coord[1].y + 1, coord[1].z).faces[1],
+				cell(coord[1].x, coord[1].y, coord[1].z).faces[1]
+			},
+			std::array<MacGridCell::Face, 8>{
+				cell(coord[2].x + 1, coord[2].y + 1, coord[2].z + 1).faces[2],
+				cell(coord[2].x, coord[2].y + 1, coord[2].z + 1).faces[2],
+				cell(coord[2].x + 1, coord[2].y, coord[2].z + 1).faces[2],
+				cell(coord[2].x + 1, coord[2].y + 1, coord[2].z).faces[2],
+				cell(coord[2].x + 1, coord[2].y, coord[2].z).faces[2],
+				cell(coord[2].x, coord[2].y, coord[2].z + 1).faces[2],
+				cell(coord[2].x, coord[2].y + 1, coord[2].z).faces[2],
+				cell(coord[2].x, coord[2].y, coord[2].z).faces[2]
+			} };
+}
+
 
 } //namespace genericfsim
@@ -0,0 +1,449 @@
+#include "meshObstacle.h"
+#include "../util/vectorOps.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+using namespace genericfsim::obstacle;
+
+namespace {
+
+//the line of the parity tests is shifted by this much, so that it does not run exactly through edges and vertices
+constexpr double LINE_OFFSET_Y = 1.37e-7;
+constexpr double LINE_OFFSET_Z = 0.71e-7;
+
+glm::dvec3 closestPointOnTriangle(const glm::dvec3& p, const glm::dvec3& a, const glm::dvec3& b, const glm::dvec3& c) {
+	const glm::dvec3 ab = b - a;
+	const glm::dvec3 ac = c - a;
+	const glm::dvec3 ap = p - a;
+	const double d1 = glm::dot(ab, ap);
+	const double d2 = glm::dot(ac, ap);
+	if (d1 <= 0.0 && d2 <= 0.0)
+		return a;
+
+	const glm::dvec3 bp = p - b;
+	const double d3 = glm::dot(ab, bp);
+	const double d4 = glm::dot(ac, bp);
+	if (d3 >= 0.0 && d4 <= d3)
+		return b;
+
+	const double vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0 && d1 >= 0.0 && d3 <= 0.0)
+		return a + ab * (d1 / (d1 - d3));
+
+	const glm::dvec3 cp = p - c;
+	const double d5 = glm::dot(ab, cp);
+	const double d6 = glm::dot(ac, cp);
+	if (d6 >= 0.0 && d5 <= d6)
+		return c;
+
+	const double vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0 && d2 >= 0.0 && d6 <= 0.0)
+		return a + ac * (d2 / (d2 - d6));
+
+	const double va = d3 * d6 - d5 * d4;
+	if (va <= 0.0 && (d4 - d3) >= 0.0 && (d5 - d6) >= 0.0)
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+	const double denom = 1.0 / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+double distance2ToBox(const glm::dvec3& p, const glm::dvec3& min, const glm::dvec3& max) {
+	const glm::dvec3 d = glm::max(glm::max(min - p, p - max), glm::dvec3(0, 0, 0));
+	return glm::dot(d, d);
+}
+
+}
+
+TriangleMesh TriangleMesh::load(const std::string& path) {
+	std::string extension = path.substr(path.find_last_of('.') + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return std::tolower(c); });
+	if (extension == "obj")
+		return loadObj(path);
+	if (extension == "stl")
+		return loadStl(path);
+	throw std::runtime_error("Unknown mesh file format: " + path);
+}
+
+TriangleMesh TriangleMesh::loadObj(const std::string& path) {
+	std::ifstream file(path);
+	if (!file)
+		throw std::runtime_error("Could not open mesh file: " + path);
+
+	TriangleMesh mesh;
+	std::string line;
+	std::vector<int> face;
+	while (std::getline(file, line)) {
+		std::istringstream stream(line);
+		std::string type;
+		stream >> type;
+		if (type == "v") {
+			glm::dvec3 v;
+			stream >> v.x >> v.y >> v.z;
+			mesh.vertices.push_back(v);
+		}
+		else if (type == "f") {
+			face.clear();
+			std::string vertex;
+			while (stream >> vertex) {
+				//only the position index is used from the v/vt/vn triplets, negative indexes are relative to the end
+				int index = std::stoi(vertex.substr(0, vertex.find('/')));
+				face.push_back(index > 0 ? index - 1 : int(mesh.vertices.size()) + index);
+			}
+			for (int i = 2; i < face.size(); i++)
+				mesh.triangles.push_back({ face[0], face[i - 1], face[i] });
+		}
+	}
+	for (const auto& triangle : mesh.triangles) {
+		for (int index : triangle) {
+			if (index < 0 || index >= mesh.vertices.size())
+				throw std::runtime_error("Invalid vertex index in mesh file: " + path);
+		}
+	}
+	return mesh;
+}
+
+TriangleMesh TriangleMesh::loadStl(const std::string& path) {
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+		throw std::runtime_error("Could not open mesh file: " + path);
+	const std::streamsize fileSize = file.tellg();
+	file.seekg(0);
+
+	TriangleMesh mesh;
+	//a binary STL has an 80 byte header, a triangle count and 50 bytes per triangle, anything else is read as ASCII
+	uint32_t triangleCount = 0;
+	if (fileSize >= 84) {
+		file.seekg(80);
+		file.read(reinterpret_cast<char*>(&triangleCount), sizeof(triangleCount));
+	}
+	if (fileSize >= 84 && fileSize == 84 + std::streamsize(triangleCount) * 50) {
+		char record[50];
+		mesh.vertices.reserve(triangleCount * 3);
+		mesh.triangles.reserve(triangleCount);
+		for (uint32_t t = 0; t < triangleCount; t++) {
+			file.read(record, sizeof(record));
+			for (int v = 0; v < 3; v++) {
+				float coords[3];
+				std::memcpy(coords, record + 12 + v * 12, sizeof(coords));
+				mesh.vertices.push_back(glm::dvec3(coords[0], coords[1], coords[2]));
+			}
+			const int first = int(mesh.vertices.size()) - 3;
+			mesh.triangles.push_back({ first, first + 1, first + 2 });
+		}
+		if (!file)
+			throw std::runtime_error("Could not read mesh file: " + path);
+		return mesh;
+	}
+
+	file.seekg(0);
+	std::string token;
+	while (file >> token) {
+		if (token != "vertex")
+			continue;
+		glm::dvec3 v;
+		file >> v.x >> v.y >> v.z;
+		mesh.vertices.push_back(v);
+		if (mesh.vertices.size() % 3 == 0) {
+			const int first = int(mesh.vertices.size()) - 3;
+			mesh.triangles.push_back({ first, first + 1, first + 2 });
+		}
+	}
+	return mesh;
+}
+
+TriangleBvh::TriangleBvh(TriangleMesh mesh) : mesh(std::move(mesh)) {
+	const int triangleNum = this->mesh.triangles.size();
+	if (triangleNum == 0)
+		throw std::runtime_error("The mesh has no triangles");
+	std::vector<glm::dvec3> centroids(triangleNum);
+	triangleOrder.resize(triangleNum);
+	for (int t = 0; t < triangleNum; t++) {
+		const auto& triangle = this->mesh.triangles[t];
+		centroids[t] = (this->mesh.vertices[triangle[0]] + this->mesh.vertices[triangle[1]] + this->mesh.vertices[triangle[2]]) / 3.0;
+		triangleOrder[t] = t;
+	}
+	nodes.reserve(2 * (triangleNum / LEAF_SIZE + 1));
+	nodes.push_back(Node{});
+	build(0, 0, triangleNum, centroids);
+}
+
+void TriangleBvh::build(int node, int start, int end, std::vector<glm::dvec3>& centroids) {
+	constexpr double inf = std::numeric_limits<double>::max();
+	glm::dvec3 min(inf, inf, inf);
+	glm::dvec3 max(-inf, -inf, -inf);
+	glm::dvec3 centroidMin = min;
+	glm::dvec3 centroidMax = max;
+	for (int i = start; i < end; i++) {
+		const auto& triangle = mesh.triangles[triangleOrder[i]];
+		for (int v = 0; v < 3; v++) {
+			min = glm::min(min, mesh.vertices[triangle[v]]);
+			max = glm::max(max, mesh.vertices[triangle[v]]);
+		}
+		centroidMin = glm::min(centroidMin, centroids[triangleOrder[i]]);
+		centroidMax = glm::max(centroidMax, centroids[triangleOrder[i]]);
+	}
+	nodes[node].min = min;
+	nodes[node].max = max;
+	if (end - start <= LEAF_SIZE) {
+		nodes[node].start = start;
+		nodes[node].count = end - start;
+		return;
+	}
+
+	//median split along the longest side of the centroid bounds
+	const glm::dvec3 extent = centroidMax - centroidMin;
+	const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	const int mid = (start + end) / 2;
+	std::nth_element(triangleOrder.begin() + start, triangleOrder.begin() + mid, triangleOrder.begin() + end, [&](int a, int b) {
+		return centroids[a][axis] < centroids[b][axis];
+	});
+
+	const int left = nodes.size();
+	nodes[node].start = left;
+	nodes[node].count = 0;
+	nodes.push_back(Node{});
+	nodes.push_back(Node{});
+	build(left, start, mid, centroids);
+	build(left + 1, mid, end, centroids);
+}
+
+glm::dvec3 TriangleBvh::closestPoint(const glm::dvec3& p) const {
+	glm::dvec3 closest = mesh.vertices[mesh.triangles[0][0]];
+	closestPoint(p, std::numeric_limits<double>::infinity(), closest);
+	return closest;
+}
+
+bool TriangleBvh::closestPoint(const glm::dvec3& p, double maxDistance, glm::dvec3& closest) const {
+	double closestDistance2 = maxDistance * maxDistance;
+	bool found = false;
+	//the tree is balanced (median splits), so its depth is about log2 of the triangle count
+	int stack[128];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const Node& node = nodes[stack[--stackSize]];
+		if (distance2ToBox(p, node.min, node.max) >= closestDistance2)
+			continue;
+		if (node.count > 0) {
+			for (int i = node.start; i < node.start + node.count; i++) {
+				const auto& triangle = mesh.triangles[triangleOrder[i]];
+				const glm::dvec3 point = closestPointOnTriangle(p, mesh.vertices[triangle[0]], mesh.vertices[triangle[1]], mesh.vertices[triangle[2]]);
+				const double distance2 = glm::dot(p - point, p - point);
+				if (distance2 < closestDistance2) {
+					closestDistance2 = distance2;
+					closest = point;
+					found = true;
+				}
+			}
+			continue;
+		}
+		//the closer child is pushed last, so it is visited first
+		const double leftDistance2 = distance2ToBox(p, nodes[node.start].min, nodes[node.start].max);
+		const double rightDistance2 = distance2ToBox(p, nodes[node.start + 1].min, nodes[node.start + 1].max);
+		if (leftDistance2 < rightDistance2) {
+			stack[stackSize++] = node.start + 1;
+			stack[stackSize++] = node.start;
+		}
+		else {
+			stack[stackSize++] = node.start;
+			stack[stackSize++] = node.start + 1;
+		}
+	}
+	return found;
+}
+
+void TriangleBvh::intersectLineX(double y, double z, std::vector<double>& hits) const {
+	hits.clear();
+	y += LINE_OFFSET_Y;
+	z += LINE_OFFSET_Z;
+	int stack[128];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const Node& node = nodes[stack[--stackSize]];
+		if (y < node.min.y || y > node.max.y || z < node.min.z || z > node.max.z)
+			continue;
+		if (node.count == 0) {
+			stack[stackSize++] = node.start;
+			stack[stackSize++] = node.start + 1;
+			continue;
+		}
+		for (int i = node.start; i < node.start + node.count; i++) {
+			const auto& triangle = mesh.triangles[triangleOrder[i]];
+			const glm::dvec3& a = mesh.vertices[triangle[0]];
+			const glm::dvec3& b = mesh.vertices[triangle[1]];
+			const glm::dvec3& c = mesh.vertices[triangle[2]];
+			//barycentric coordinates of (y, z) in the projection of the triangle onto the yz plane
+			const double area = (b.y - a.y) * (c.z - a.z) - (c.y - a.y) * (b.z - a.z);
+			if (area == 0.0)
+				continue;
+			const double u = ((b.y - y) * (c.z - z) - (c.y - y) * (b.z - z)) / area;
+			const double v = ((c.y - y) * (a.z - z) - (a.y - y) * (c.z - z)) / area;
+			const double w = 1.0 - u - v;
+			if (u < 0.0 || v < 0.0 || w < 0.0)
+				continue;
+			hits.push_back(u * a.x + v * b.x + w * c.x);
+		}
+	}
+	std::sort(hits.begin(), hits.end());
+}
+
+MeshObstacle::MeshObstacle(TriangleMesh mesh, int sdfResolution, const glm::dvec3& pos)
+	: MeshObstacle(buildCenteredBvh(std::move(mesh)), sdfResolution, pos) { }
+
+MeshObstacle::MeshObstacle(std::shared_ptr<const TriangleBvh> bvh, int sdfResolution, const glm::dvec3& pos)
+	: MeshObstacle(bvh, sampleSdf(*bvh, sdfResolution), pos) { }
+
+MeshObstacle::MeshObstacle(std::shared_ptr<const TriangleBvh> bvh, Sdf sdf, const glm::dvec3& pos)
+	: SampledSdfObstacle(std::move(sdf.distances), sdf.resolution, sdf.size, pos), bvh(std::move(bvh)) { }
+
+std::unique_ptr<MeshObstacle> MeshObstacle::fromFile(const std::string& path, int sdfResolution, const glm::dvec3& pos) {
+	return std::make_unique<MeshObstacle>(TriangleMesh::load(path), sdfResolution, pos);
+}
+
+std::shared_ptr<const TriangleBvh> MeshObstacle::buildCenteredBvh(TriangleMesh mesh) {
+	if (mesh.vertices.empty())
+		throw std::runtime_error("The mesh has no vertices");
+	glm::dvec3 min = mesh.vertices[0];
+	glm::dvec3 max = mesh.vertices[0];
+	for (const glm::dvec3& v : mesh.vertices) {
+		min = glm::min(min, v);
+		max = glm::max(max, v);
+	}
+	const glm::dvec3 center = (min + max) * 0.5;
+	for (glm::dvec3& v : mesh.vertices)
+		v -= center;
+	return std::make_shared<const TriangleBvh>(std::move(mesh));
+}
+
+MeshObstacle::Sdf MeshObstacle::sampleSdf(const TriangleBvh& bvh, int sdfResolution) {
+	constexpr int padding = 2;
+	constexpr double exactBand = 3.0;		//the distances are exact up to this many samples from the surface
+	const glm::dvec3 extent = bvh.getMax() - bvh.getMin();
+	const double h = std::max(std::max(extent.x, std::max(extent.y, extent.z)), 1e-6) / std::max(sdfResolution - 1, 1);
+	Sdf sdf;
+	const glm::ivec3 res(
+		int(std::ceil(extent.x / h)) + 1 + 2 * padding,
+		int(std::ceil(extent.y / h)) + 1 + 2 * padding,
+		int(std::ceil(extent.z / h)) + 1 + 2 * padding);
+	sdf.resolution = res;
+	sdf.size = glm::dvec3(res.x - 1, res.y - 1, res.z - 1) * h;
+	sdf.distances.assign(size_t(res.x) * res.y * res.z, std::numeric_limits<double>::infinity());
+	std::vector<unsigned char> inside(sdf.distances.size());
+	const auto index = [&](int x, int y, int z) {
+		return (size_t(x) * res.y + y) * res.z + z;
+	};
+
+	//the mesh is centered, so the samples start at -size / 2, the sign of a whole row comes from one line intersection,
+	//the closest point queries are limited to the band (far from the surface they would visit most of the tree)
+	const glm::dvec3 low = -sdf.size * 0.5;
+	util::parallelFor(true, 0, res.y * res.z, [&](int row) {
+		const int y = row / res.z;
+		const int z = row % res.z;
+		const double py = low.y + y * h;
+		const double pz = low.z + z * h;
+		std::vector<double> hits;
+		bvh.intersectLineX(py, pz, hits);
+		int hitIndex = 0;
+		for (int x = 0; x < res.x; x++) {
+			const glm::dvec3 p(low.x + x * h, py, pz);
+			while (hitIndex < hits.size() && hits[hitIndex] < p.x)
+				hitIndex++;
+			inside[index(x, y, z)] = hitIndex % 2 == 1;
+			glm::dvec3 closest;
+			if (bvh.closestPoint(p, exactBand * h, closest))
+				sdf.distances[index(x, y, z)] = glm::length(p - closest);
+		}
+	});
+
+	//outside the band the unsigned distance is extended by fast sweeping (the eikonal equation in the 8 sweep directions)
+	for (int sweep = 0; sweep < 8; sweep++) {
+		const glm::ivec3 dir((sweep & 4) ? -1 : 1, (sweep & 2) ? -1 : 1, (sweep & 1) ? -1 : 1);
+		for (int i = 0; i < res.x; i++) {
+			const int x = dir.x > 0 ? i : res.x - 1 - i;
+			for (int j = 0; j < res.y; j++) {
+				const int y = dir.y > 0 ? j : res.y - 1 - j;
+				for (int k = 0; k < res.z; k++) {
+					const int z = dir.z > 0 ? k : res.z - 1 - k;
+					double& d = sdf.distances[index(x, y, z)];
+					if (d <= exactBand * h)
+						continue;
+					std::array<double, 3> n = {
+						std::min(x > 0 ? sdf.distances[index(x - 1, y, z)] : d, x < res.x - 1 ? sdf.distances[index(x + 1, y, z)] : d),
+						std::min(y > 0 ? sdf.distances[index(x, y - 1, z)] : d, y < res.y - 1 ? sdf.distances[index(x, y + 1, z)] : d),
+						std::min(z > 0 ? sdf.distances[index(x, y, z - 1)] : d, z < res.z - 1 ? sdf.distances[index(x, y, z + 1)] : d) };
+					std::sort(n.begin(), n.end());
+					if (n[0] == std::numeric_limits<double>::infinity())
+						continue;
+					double u = n[0] + h;
+					if (u > n[1]) {
+						u = (n[0] + n[1] + std::sqrt(2.0 * h * h - (n[0] - n[1]) * (n[0] - n[1]))) * 0.5;
+						if (u > n[2]) {
+							const double sum = n[0] + n[1] + n[2];
+							u = (sum + std::sqrt(std::max(sum * sum - 3.0 * (n[0] * n[0] + n[1] * n[1] + n[2] * n[2] - h * h), 0.0))) / 3.0;
+						}
+					}
+					d = std::min(d, u);
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < sdf.distances.size(); i++) {
+		if (inside[i])
+			sdf.distances[i] = -sdf.distances[i];
+	}
+	return sdf;
+}
+
+glm::dvec3 MeshObstacle::closestSurfacePoint(const glm::dvec3& p) const {
+	return bvh->closestPoint(p - pos) + pos;
+}
+
+void MeshObstacle::getSolidCells(bool parallel, const glm::dvec3& cellD, const glm::ivec3& gridSize, std::vector<glm::ivec3>& cells) const {
+	std::scoped_lock lock(voxelCache->mutex);
+	if (voxelCache->pos != pos || voxelCache->cellD != cellD || voxelCache->gridSize != gridSize) {
+		voxelCache->pos = pos;
+		voxelCache->cellD = cellD;
+		voxelCache->gridSize = gridSize;
+		voxelCache->cells.clear();
+
+		const glm::dvec3 low = bvh->getMin() + pos;
+		const glm::dvec3 high = bvh->getMax() + pos;
+		const glm::ivec3 min(std::max(std::floor(low.x / cellD.x), 1.0), std::max(std::floor(low.y / cellD.y), 1.0), std::max(std::floor(low.z / cellD.z), 1.0));
+		const glm::ivec3 max(std::min(std::floor(high.x / cellD.x), gridSize.x - 2.0), std::min(std::floor(high.y / cellD.y), gridSize.y - 2.0), std::min(std::floor(high.z / cellD.z), gridSize.z - 2.0));
+		if (min.x <= max.x && min.y <= max.y && min.z <= max.z) {
+			//scanline parity fill, every row along x is filled independently from the crossings of the line through the cell centers
+			const glm::ivec3 size = max - min + 1;
+			std::vector<unsigned char> solid(size_t(size.x) * size.y * size.z, 0);
+			util::parallelFor(parallel, 0, size.y * size.z, [&](int row) {
+				const int y = row / size.z;
+				const int z = row % size.z;
+				std::vector<double> hits;
+				bvh->intersectLineX((min.y + y + 0.5) * cellD.y - pos.y, (min.z + z + 0.5) * cellD.z - pos.z, hits);
+				for (int i = 0; i + 1 < hits.size(); i += 2) {
+					const int xStart = std::max(int(std::ceil((hits[i] + pos.x) / cellD.x - 0.5)), min.x);
+					const int xEnd = std::min(int(std::floor((hits[i + 1] + pos.x) / cellD.x - 0.5)), max.x);
+					for (int x = xStart; x <= xEnd; x++)
+						solid[(size_t(x - min.x) * size.y + y) * size.z + z] = 1;
+				}
+			});
+			for (int x = 0; x < size.x; x++) {
+				for (int y = 0; y < size.y; y++) {
+					for (int z = 0; z < size.z; z++) {
+						if (solid[(size_t(x) * size.y + y) * size.z + z])
+							voxelCache->cells.push_back(min + glm::ivec3(x, y, z));
+					}
+				}
+			}
+		}
+	}
+	cells.insert(cells.end(), voxelCache->cells.begin(), voxelCache->cells.end());
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "obstacles.hpp"
+
+namespace genericfsim::obstacle {
+
+/**
+ * A triangle mesh (the triangles are given by the indexes of their vertices).
+ */
+struct TriangleMesh {
+	std::vector<glm::dvec3> vertices;
+	std::vector<std::array<int, 3>> triangles;
+
+	/**
+	 * Loads a mesh from an OBJ or an STL (ASCII or binary) file, chosen by the extension of the path.
+	 * Throws std::runtime_error if the file can not be read.
+	 *
+	 * \param path - the path of the file
+	 * \return - the mesh
+	 */
+	static TriangleMesh load(const std::string& path);
+	static TriangleMesh loadObj(const std::string& path);
+	static TriangleMesh loadStl(const std::string& path);
+};
+
+/**
+ * A bounding volume hierarchy over the triangles of a mesh, for closest point and line intersection queries.
+ */
+class TriangleBvh {
+public:
+	/**
+	 * Builds the hierarchy (the mesh is copied).
+	 *
+	 * \param mesh - the triangle mesh
+	 */
+	explicit TriangleBvh(TriangleMesh mesh);
+
+	/**
+	 * Returns the closest point of the mesh surface to a point.
+	 *
+	 * \param p - a point
+	 * \return - the closest point on the surface
+	 */
+	glm::dvec3 closestPoint(const glm::dvec3& p) const;
+
+	/**
+	 * Finds the closest point of the mesh surface to a point, if it is closer than maxDistance.
+	 *
+	 * \param p - a point
+	 * \param maxDistance - the maximal distance of the searched point
+	 * \param closest - set to the closest point if there is one within maxDistance
+	 * \return - true if there is a surface point within maxDistance
+	 */
+	bool closestPoint(const glm::dvec3& p, double maxDistance, glm::dvec3& closest) const;
+
+	/**
+	 * Collects the x coordinates where the line parallel to the x axis through (y, z) crosses the mesh, sorted.
+	 *
+	 * \param y - the y coordinate of the line
+	 * \param z - the z coordinate of the line
+	 * \param hits - cleared and filled with the crossings
+	 */
+	void intersectLineX(double y, double z, std::vector<double>& hits) const;
+
+	inline const TriangleMesh& getMesh() const {
+		return mesh;
+	}
+
+	inline const glm::dvec3& getMin() const {
+		return nodes[0].min;
+	}
+
+	inline const glm::dvec3& getMax() const {
+		return nodes[0].max;
+	}
+
+private:
+	struct Node {
+		glm::dvec3 min;
+		glm::dvec3 max;
+		int start;		//the first triangle (in triangleOrder) of a leaf or the index of the first child (the second one follows it)
+		int count;		//the triangle count of a leaf, 0 for inner nodes
+	};
+
+	static constexpr int LEAF_SIZE = 4;
+
+	TriangleMesh mesh;
+	std::vector<Node> nodes;
+	std::vector<int> triangleOrder;
+
+	void build(int node, int start, int end, std::vector<glm::dvec3>& centroids);
+};
+
+/**
+ * An obstacle given by a triangle mesh (it should be closed). When constructed its signed distance field is sampled
+ * around the mesh (the distances come from the BVH, the signs from parity along the x axis), so the distance queries
+ * during the simulation cost the same as for a SampledSdfObstacle. The grid voxelization is exact (scanline parity) and
+ * cached while the obstacle does not move. The mesh, the samples and the cache are shared by the clones.
+ */
+struct MeshObstacle : public SampledSdfObstacle {
+	const std::shared_ptr<const TriangleBvh> bvh;		//the vertices are relative to pos
+
+	/**
+	 * Constructs a mesh obstacle, the mesh is moved so that the center of its bounding box is at pos.
+	 *
+	 * \param mesh - the triangle mesh
+	 * \param sdfResolution - the number of distance samples along the longest side of the mesh
+	 * \param pos - the position of the center of the mesh
+	 */
+	MeshObstacle(TriangleMesh mesh, int sdfResolution = 64, const glm::dvec3& pos = glm::dvec3(0, 0, 0));
+
+	/**
+	 * Loads a mesh obstacle from an OBJ or STL file (see TriangleMesh::load).
+	 */
+	static std::unique_ptr<MeshObstacle> fromFile(const std::string& path, int sdfResolution = 64, const glm::dvec3& pos = glm::dvec3(0, 0, 0));
+
+	Obstacle* clone() override {
+		return new MeshObstacle(*this);
+	}
+
+	/**
+	 * Returns the exact closest point of the mesh surface to a point.
+	 */
+	glm::dvec3 closestSurfacePoint(const glm::dvec3& p) const;
+
+	void getSolidCells(bool parallel, const glm::dvec3& cellD, const glm::ivec3& gridSize, std::vector<glm::ivec3>& cells) const override;
+
+private:
+	struct Sdf {
+		std::vector<double> distances;
+		glm::ivec3 resolution;
+		glm::dvec3 size;
+	};
+
+	struct VoxelCache {
+		std::mutex mutex;
+		glm::dvec3 pos;
+		glm::dvec3 cellD;
+		glm::ivec3 gridSize = glm::ivec3(-1, -1, -1);
+		std::vector<glm::ivec3> cells;
+	};
+
+	std::shared_ptr<VoxelCache> voxelCache = std::make_shared<VoxelCache>();
+
+	MeshObstacle(std::shared_ptr<const TriangleBvh> bvh, int sdfResolution, const glm::dvec3& pos);
+	MeshObstacle(std::shared_ptr<const TriangleBvh> bvh, Sdf sdf, const glm::dvec3& pos);
+	static std::shared_ptr<const TriangleBvh> buildCenteredBvh(TriangleMesh mesh);
+	static Sdf sampleSdf(const TriangleBvh& bvh, int sdfResolution);
+};
+
+}
@@ -0,0 +1,341 @@
+#include "multigridSolverGrid.h"
+#include <algorithm>
+#include <cmath>
+#include "../util/vectorOps.h"
+
+using namespace genericfsim::macgrid;
+using namespace genericfsim::util;
+
+MultigridSolverGrid::MultigridSolverGrid(const glm::dvec3& dimensions, float cellD, bool twoD, double fluidDensity)
+	: MacGrid(dimensions, cellD, twoD), coarseningFactor(2, 2, twoD ? 1 : 2) {
+	this->fluidDensity = fluidDensity;
+	initLevels();
+}
+
+void MultigridSolverGrid::initLevels() {
+	levels.clear();
+	glm::ivec3 size = gridSize;
+	double scale = 1.0;
+	while (levels.size() < maxLevelCount) {
+		const int cellNum = size.x * size.y * size.z;
+		levels.push_back(Level{ size, std::vector<MacGridCell::CellType>(cellNum, MacGridCell::CellType::SOLID),
+			std::vector<Real>(cellNum, 0.0), std::vector<Real>(cellNum, 0.0), std::vector<Real>(cellNum, 0.0), scale });
+
+		const glm::ivec3 coarseSize = (size + coarseningFactor - glm::ivec3(1, 1, 1)) / coarseningFactor;
+		if (coarseSize.x < minLevelSize || coarseSize.y < minLevelSize || (!twoD && coarseSize.z < minLevelSize))
+			break;
+		size = coarseSize;
+		scale *= 0.25;
+	}
+}
+
+void MultigridSolverGrid::updateLevelTypes(bool parallel) {
+	std::copy(cellTypes.begin(), cellTypes.end(), levels[0].types.begin());
+	for (int l = 1; l < levels.size(); l++) {
+		const Level& fine = levels[l - 1];
+		Level& coarse = levels[l];
+		parallelFor(parallel, 0, coarse.size.x, [&](int x) {
+			for (int y = 0; y < coarse.size.y; y++) {
+				for (int z = 0; z < coarse.size.z; z++) {
+					const glm::ivec3 start = glm::ivec3(x, y, z) * coarseningFactor;
+					const glm::ivec3 end = glm::min(start + coarseningFactor, fine.size);
+					bool hasAir = false;
+					bool hasWater = false;
+					for (int fx = start.x; fx < end.x; fx++) {
+						for (int fy = start.y; fy < end.y; fy++) {
+							for (int fz = start.z; fz < end.z; fz++) {
+								const auto type = fine.types[fine.index(fx, fy, fz)];
+								hasAir |= type == MacGridCell::CellType::AIR;
+								hasWater |= type == MacGridCell::CellType::WATER;
+							}
+						}
+					}
+					coarse.types[coarse.index(x, y, z)] = hasAir ? MacGridCell::CellType::AIR
+						: (hasWater ? MacGridCell::CellType::WATER : MacGridCell::CellType::SOLID);
+				}
+			}
+		});
+	}
+}
+
+/**
+ * Calculates the number of non solid neighbours and the sum of the values in the water neighbours of a cell.
+ * Cells outside of the level are treated as solid.
+ */
+inline void sumNeighbours(const std::vector<MacGridCell::CellType>& types, const std::vector<Real>& values, const glm::ivec3& size,
+	int x, int y, int z, int index, int& nonSolidNeighbours, double& waterSum) {
+	const int strides[3] = { size.y * size.z, size.z, 1 };
+	const int coords[3] = { x, y, z };
+	nonSolidNeighbours = 0;
+	waterSum = 0.0;
+	for (int axis = 0; axis < 3; axis++) {
+		if (coords[axis] > 0) {
+			const auto type = types[index - strides[axis]];
+			nonSolidNeighbours += type != MacGridCell::CellType::SOLID;
+			if (type == MacGridCell::CellType::WATER)
+				waterSum += values[index - strides[axis]];
+		}
+		if (coords[axis] < size[axis] - 1) {
+			const auto type = types[index + strides[axis]];
+			nonSolidNeighbours += type != MacGridCell::CellType::SOLID;
+			if (type == MacGridCell::CellType::WATER)
+				waterSum += values[index + strides[axis]];
+		}
+	}
+}
+
+void MultigridSolverGrid::smooth(bool parallel, Level& level, int color) {
+	const double scaleInv = 1.0 / level.scale;
+	parallelFor(parallel, 0, level.size.x, [&](int x) {
+		for (int y = 0; y < level.size.y; y++) {
+			for (int z = (x + y + color) % 2; z < level.size.z; z += 2) {
+				const int index = level.index(x, y, z);
+				if (level.types[index] != MacGridCell::CellType::WATER)
+					continue;
+				int nonSolidNeighbours;
+				double waterSum;
+				sumNeighbours(level.types, level.x, level.size, x, y, z, index, nonSolidNeighbours, waterSum);
+				level.x[index] = nonSolidNeighbours > 0 ? (level.b[index] * scaleInv + waterSum) / nonSolidNeighbours : 0.0;
+			}
+		}
+	});
+}
+
+void MultigridSolverGrid::calculateResidual(bool parallel, Level& level) {
+	parallelFor(parallel, 0, level.size.x, [&](int x) {
+		for (int y = 0; y < level.size.y; y++) {
+			for (int z = 0; z < level.size.z; z++) {
+				const int index = level.index(x, y, z);
+				if (level.types[index] != MacGridCell::CellType::WATER) {
+					level.r[index] = 0.0;
+					continue;
+				}
+				int nonSolidNeighbours;
+				double waterSum;
+				sumNeighbours(level.types, level.x, level.size, x, y, z, index, nonSolidNeighbours, waterSum);
+				level.r[index] = level.b[index] - level.scale * (nonSolidNeighbours * level.x[index] - waterSum);
+			}
+		}
+	});
+}
+
+/**
+ * Returns the fine cell offsets and weights of the cell centered trilinear restriction along an axis.
+ */
+inline int restrictionStencil(int factor, int offsets[4], double weights[4]) {
+	if (factor == 1) {
+		offsets[0] = 0;
+		weights[0] = 1.0;
+		return 1;
+	}
+	offsets[0] = -1; offsets[1] = 0; offsets[2] = 1; offsets[3] = 2;
+	weights[0] = 0.125; weights[1] = 0.375; weights[2] = 0.375; weights[3] = 0.125;
+	return 4;
+}
+
+void MultigridSolverGrid::restrictResidual(bool parallel, const Level& fine, Level& coarse) {
+	int offsets[3][4];
+	double weights[3][4];
+	int counts[3];
+	for (int axis = 0; axis < 3; axis++)
+		counts[axis] = restrictionStencil(coarseningFactor[axis], offsets[axis], weights[axis]);
+
+	parallelFor(parallel, 0, coarse.size.x, [&](int x) {
+		for (int y = 0; y < coarse.size.y; y++) {
+			for (int z = 0; z < coarse.size.z; z++) {
+				const int index = coarse.index(x, y, z);
+				coarse.x[index] = 0.0;
+				if (coarse.types[index] != MacGridCell::CellType::WATER) {
+					coarse.b[index] = 0.0;
+					continue;
+				}
+				double sum = 0.0;
+				for (int i = 0; i < counts[0]; i++) {
+					const int fx = x * coarseningFactor.x + offsets[0][i];
+					if (fx < 0 || fx >= fine.size.x)
+						continue;
+					for (int j = 0; j < counts[1]; j++) {
+						const int fy = y * coarseningFactor.y + offsets[1][j];
+						if (fy < 0 || fy >= fine.size.y)
+							continue;
+						for (int k = 0; k < counts[2]; k++) {
+							const int fz = z * coarseningFactor.z + offsets[2][k];
+							if (fz < 0 || fz >= fine.size.z)
+								continue;
+							sum += weights[0][i] * weights[1][j] * weights[2][k] * fine.r[fine.index(fx, fy, fz)];
+						}
+					}
+				}
+				coarse.b[index] = sum;
+			}
+		}
+	});
+}
+
+void MultigridSolverGrid::prolongateAndCorrect(bool parallel, const Level& coarse, Level& fine) {
+	parallelFor(parallel, 0, fine.size.x, [&](int x) {
+		for (int y = 0; y < fine.size.y; y++) {
+			for (int z = 0; z < fine.size.z; z++) {
+				const int index = fine.index(x, y, z);
+				if (fine.types[index] != MacGridCell::CellType::WATER)
+					continue;
+				const glm::ivec3 fineCoord(x, y, z);
+				int coords[3][2];
+				double weights[3][2];
+				int counts[3];
+				for (int axis = 0; axis < 3; axis++) {
+					if (coarseningFactor[axis] == 1) {
+						coords[axis][0] = fineCoord[axis];
+						weights[axis][0] = 1.0;
+						counts[axis] = 1;
+					}
+					else {
+						coords[axis][0] = fineCoord[axis] / 2;
+						coords[axis][1] = coords[axis][0] + (fineCoord[axis] % 2 ? 1 : -1);
+						weights[axis][0] = 0.75;
+						weights[axis][1] = 0.25;
+						counts[axis] = 2;
+					}
+				}
+				double correction = 0.0;
+				for (int i = 0; i < counts[0]; i++) {
+					if (coords[0][i] < 0 || coords[0][i] >= coarse.size.x)
+						continue;
+					for (int j = 0; j < counts[1]; j++) {
+						if (coords[1][j] < 0 || coords[1][j] >= coarse.size.y)
+							continue;
+						for (int k = 0; k < counts[2]; k++) {
+							if (coords[2][k] < 0 || coords[2][k] >= coarse.size.z)
+								continue;
+							const int coarseIndex = coarse.index(coords[0][i], coords[1][j], coords[2][k]);
+							if (coarse.types[coarseIndex] == MacGridCell::CellType::WATER)
+								correction += weights[0][i] * weights[1][j] * weights[2][k] * coarse.x[coarseIndex];
+						}
+					}
+				}
+				fine.x[index] += correction;
+			}
+		}
+	});
+}
+
+void MultigridSolverGrid::vCycle(bool parallel, int levelIndex) {
+	Level& level = levels[levelIndex];
+	const bool coarsest = levelIndex == levels.size() - 1;
+	const int iterations = coarsest ? bottomSmoothingIterations : smoothingIterations;
+
+	for (int i = 0; i < iterations; i++) {
+		smooth(parallel, level, 0);
+		smooth(parallel, level, 1);
+	}
+	if (!coarsest) {
+		calculateResidual(parallel, level);
+		restrictResidual(parallel, level, levels[levelIndex + 1]);
+		vCycle(parallel, levelIndex + 1);
+		prolongateAndCorrect(parallel, levels[levelIndex + 1], level);
+	}
+	for (int i = 0; i < iterations; i++) {
+		smooth(parallel, level, 1);
+		smooth(parallel, level, 0);
+	}
+}
+
+void MultigridSolverGrid::applyPreconditioner(bool parallel, const std::vector<Real>& r, std::vector<Real>& result) {
+	Level& level = levels[0];
+	parallelFor(parallel, 0, fluidCellCount, [&](int p) {
+		const int index = cellIndex(fluidCellPositions[p]);
+		level.b[index] = r[p];
+		level.x[index] = 0.0;
+	});
+	vCycle(parallel, 0);
+	parallelFor(parallel, 0, fluidCellCount, [&](int p) {
+		result[p] = level.x[cellIndex(fluidCellPositions[p])];
+	});
+}
+
+void MultigridSolverGrid::applyAMatrix(bool parallel, double scale, const std::vector<Real>& vec, std::vector<Real>& result) {
+	parallelFor(parallel, 0, fluidCellCount, [&](int p) {
+		const auto& neighbours = fluidCellNeighbours[p];
+		double value = 0.0;
+		for (int fluidCellId : neighbours.neighbours) {
+			if (fluidCellId >= 0)
+				value -= vec[fluidCellId];
+		}
+		result[p] = scale * (neighbours.nonSolidCount * vec[p] + value);
+	});
+}
+
+void MultigridSolverGrid::calculateRHS(bool parallel) {
+	const double scale = 1.0 / cellD.x;
+	parallelFor(parallel, 0, fluidCellCount, [&](int p) {
+		const int index = cellIndex(fluidCellPositions[p]);
+		const double divergence = faceV2[0][index] + faceV2[1][index] + faceV2[2][index]
+			- faceV2[0][index - cellStride.x] - faceV2[1][index - cellStride.y] - faceV2[2][index - cellStride.z];
+		r[p] = -scale * divergence + (pressureEnabled ? (cellAvgPNum[index] - averagePressure) * pressureK : 0.0);
+	});
+}
+
+int MultigridSolverGrid::solveIncompressibility(bool parallel, double dt) {
+	fluidCellCount = fluidCellPositions.size();
+
+	//the workspace keeps its capacity between the solves, so it is only reallocated when the fluid volume grows
+	pressure.assign(fluidCellCount, 0.0);
+	z.resize(fluidCellCount);
+	r.resize(fluidCellCount);
+	s.resize(fluidCellCount);
+	calculateRHS(parallel);
+
+	if (dotProduct(parallel, r, r) < 1e-7)
+		return 0;
+
+	const double scale = dt / (fluidDensity * cellD.x * cellD.x);
+	updateLevelTypes(parallel);
+	std::fill(levels[0].x.begin(), levels[0].x.end(), 0.0);
+	std::fill(levels[0].b.begin(), levels[0].b.end(), 0.0);
+
+	applyPreconditioner(parallel, r, z);
+	std::copy(z.begin(), z.end(), s.begin());
+
+	double sigma = dotProduct(parallel, z, r);
+	int it = 0;
+	for (; it < incompressibilityMaxIterationCount; it++) {
+		applyAMatrix(parallel, scale, s, z);
+
+		double alpha = sigma / dotProduct(parallel, s, z);
+		if (alpha != alpha)
+			break;
+		multAdd(parallel, pressure, s, alpha);
+		multAdd(parallel, r, z, -alpha);
+
+		const double max = parallelMax(parallel, 0, fluidCellCount, [&](int p) {
+			return std::abs(double(r[p]));
+		});
+		if (max < residualTolerance)
+			break;
+
+		applyPreconditioner(parallel, r, z);
+		double sigmaNew = dotProduct(parallel, z, r);
+		if (sigmaNew != sigmaNew)
+			break;
+		double beta = sigmaNew / sigma;
+		multSelfAndAdd(parallel, s, z, beta);
+		sigma = sigmaNew;
+	}
+	applyPressureToVelocities(parallel, dt, pressure);
+	return it;
+}
+
+void MultigridSolverGrid::applyPressureToVelocities(bool parallel, double dt, const std::vector<Real>& pressure) {
+	const double scale = dt / (fluidDensity * cellD.x);
+	parallelFor(parallel, 0, fluidCellCount, [&](int p) {
+		const int index = cellIndex(fluidCellPositions[p]);
+		for (int axis = 0; axis < 3; axis++) {
+			const int nextIndex = index + cellStride[axis];
+			if (const auto type = cellTypes[nextIndex]; type != MacGridCell::CellType::SOLID)
+				faceV2[axis][index] += scale * (pressure[p] - (type == MacGridCell::CellType::WATER ? pressure[fluidCellIds[nextIndex]] : 0.0));
+			const int prevIndex = index - cellStride[axis];
+			if (cellTypes[prevIndex] == MacGridCell::CellType::AIR)
+				faceV2[axis][prevIndex] -= scale * pressure[p];
+		}
+	});
+}
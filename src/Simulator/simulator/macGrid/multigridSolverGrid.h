@@ -0,0 +1,70 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include "macGrid.h"
+#include "macGridCell.h"
+#include <vector>
+
+
+namespace genericfsim::macgrid {
+
+/**
+ * A MAC grid that solves incompressibility with a conjugate gradient solver, which is preconditioned
+ * by a geometric multigrid V-cycle (red-black Gauss-Seidel smoothing on each level).
+ * The preconditioner is matrix-free, so the iteration count stays nearly independent of the grid resolution.
+ */
+class MultigridSolverGrid : public MacGrid {
+public:
+	MultigridSolverGrid(const glm::dvec3& dimensions, float cellD, bool twoD, double fluidDensity = 1.0);
+
+	int solveIncompressibility(bool parallel, double dt) override;
+
+private:
+	/**
+	 * A single level of the multigrid hierarchy, the cells are stored in the same order as in the MacGrid.
+	 */
+	struct Level {
+		glm::ivec3 size;
+		std::vector<MacGridCell::CellType> types;
+		std::vector<util::Real> x;
+		std::vector<util::Real> b;
+		std::vector<util::Real> r;
+		double scale;
+
+		inline int index(int x, int y, int z) const {
+			return (x * size.y + y) * size.z + z;
+		}
+	};
+
+	constexpr static int smoothingIterations = 2;
+	constexpr static int bottomSmoothingIterations = 20;
+	constexpr static int minLevelSize = 4;
+	constexpr static int maxLevelCount = 8;
+
+	const glm::ivec3 coarseningFactor;
+	std::vector<Level> levels;
+	int fluidCellCount = 0;
+
+	//solver workspace, kept between the solves
+	std::vector<util::Real> pressure;
+	std::vector<util::Real> r;
+	std::vector<util::Real> z;
+	std::vector<util::Real> s;
+
+	void initLevels();
+	void updateLevelTypes(bool parallel);
+
+	void smooth(bool parallel, Level& level, int color);
+	void calculateResidual(bool parallel, Level& level);
+	void restrictResidual(bool parallel, const Level& fine, Level& coarse);
+	void prolongateAndCorrect(bool parallel, const Level& coarse, Level& fine);
+	void vCycle(bool parallel, int levelIndex);
+
+	void calculateRHS(bool parallel);
+	void applyPreconditioner(bool parallel, const std::vector<util::Real>& r, std::vector<util::Real>& result);
+	void applyAMatrix(bool parallel, double scale, const std::vector<util::Real>& vec, std::vector<util::Real>& result);
+
+	void applyPressureToVelocities(bool parallel, double dt, const std::vector<util::Real>& pressure);
+};
+
+}
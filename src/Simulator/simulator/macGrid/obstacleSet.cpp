@@ -0,0 +1,42 @@
+#include "obstacleSet.h"
+
+using namespace genericfsim::obstacle;
+
+void ObstacleSet::rebuild(const std::vector<std::unique_ptr<Obstacle>>& obstacles) {
+	spheres.pos.clear();
+	spheres.r.clear();
+	spheres.obstacleIndex.clear();
+	boxes.pos.clear();
+	boxes.halfSize.clear();
+	boxes.obstacleIndex.clear();
+	others.clear();
+	otherIndices.clear();
+	sources.clear();
+	speed.clear();
+	restitution.clear();
+	particleSink.clear();
+
+	for (int o = 0; o < obstacles.size(); o++) {
+		Obstacle* obstacle = obstacles[o].get();
+		speed.push_back(obstacle->speed);
+		restitution.push_back(obstacle->restitution);
+		particleSink.push_back(obstacle->isParticleSink());
+
+		if (const SphericalObstacle* sphere = dynamic_cast<const SphericalObstacle*>(obstacle); sphere != nullptr) {
+			spheres.pos.push_back(sphere->pos);
+			spheres.r.push_back(sphere->r);
+			spheres.obstacleIndex.push_back(o);
+			if (SphericalParticleSource* source = dynamic_cast<SphericalParticleSource*>(obstacle); source != nullptr)
+				sources.push_back(source);
+		}
+		else if (const RectengularObstacle* box = dynamic_cast<const RectengularObstacle*>(obstacle); box != nullptr) {
+			boxes.pos.push_back(box->pos);
+			boxes.halfSize.push_back(box->size * 0.5);
+			boxes.obstacleIndex.push_back(o);
+		}
+		else {
+			others.push_back(obstacle);
+			otherIndices.push_back(o);
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <memory>
+#include <vector>
+#include "obstacles.hpp"
+
+namespace genericfsim::obstacle {
+
+/**
+ * The obstacles of a simulation step sorted by type into flat arrays, so that the hot loops do not need virtual calls
+ * or dynamic_casts. It is rebuilt once per step from the obstacle list, the per obstacle arrays are indexed the same
+ * way as the list.
+ */
+struct ObstacleSet {
+	struct Spheres {
+		std::vector<glm::dvec3> pos;
+		std::vector<double> r;
+		std::vector<int> obstacleIndex;
+	};
+
+	struct Boxes {
+		std::vector<glm::dvec3> pos;
+		std::vector<glm::dvec3> halfSize;
+		std::vector<int> obstacleIndex;
+	};
+
+	Spheres spheres;							//spheres, including the particle sources and sinks
+	Boxes boxes;
+	std::vector<const Obstacle*> others;		//the obstacles without a specialized kernel (their distance is a virtual call)
+	std::vector<int> otherIndices;
+	std::vector<SphericalParticleSource*> sources;
+
+	std::vector<glm::dvec3> speed;
+	std::vector<double> restitution;
+	std::vector<unsigned char> particleSink;
+
+	/**
+	 * Sorts the obstacles into the arrays (the sources are referenced, so the list must outlive the set's use).
+	 *
+	 * \param obstacles - the obstacles of the step
+	 */
+	void rebuild(const std::vector<std::unique_ptr<Obstacle>>& obstacles);
+
+	inline int size() const {
+		return speed.size();
+	}
+};
+
+}
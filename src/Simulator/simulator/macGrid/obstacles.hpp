@@ -1,15 +1,42 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
+#include "../util/vectorOps.h"
 
 namespace genericfsim::obstacle {
 
+/**
+ * The signed distance of a point from a sphere.
+ */
+inline double sphereSignedDistance(const glm::dvec3& p, const glm::dvec3& center, double r) {
+	return glm::length(p - center) - r;
+}
+
+/**
+ * The signed distance of a point from an axis aligned box.
+ */
+inline double boxSignedDistance(const glm::dvec3& p, const glm::dvec3& center, const glm::dvec3& halfSize) {
+	const glm::dvec3 q = glm::abs(p - center) - halfSize;
+	const double outside = glm::length(glm::max(q, glm::dvec3(0, 0, 0)));
+	return outside + std::min(std::max(q.x, std::max(q.y, q.z)), 0.0);
+}
+
+/**
+ * An obstacle described by its signed distance field (negative inside the obstacle).
+ */
 struct Obstacle {
 	glm::dvec3 pos;
 	glm::dvec3 prevPos;
 	glm::dvec3 speed = glm::dvec3(0, 0, 0);
+	double restitution;			//the part of the normal relative velocity kept when a particle bounces off the obstacle
 
-	Obstacle(const glm::dvec3& pos = glm::dvec3(0, 0, 0)) : pos(pos), prevPos(pos) { }
+	Obstacle(const glm::dvec3& pos = glm::dvec3(0, 0, 0), double restitution = 0.2) : pos(pos), prevPos(pos), restitution(restitution) { }
+	virtual ~Obstacle() = default;
 
 	void setNewPos(const glm::dvec3& pos) {
 		prevPos = this->pos;
@@ -21,26 +48,185 @@ struct Obstacle {
 	}
 
 	virtual Obstacle* clone() = 0;
+
+	/**
+	 * Returns the signed distance of a point from the surface of the obstacle (negative inside).
+	 */
+	virtual double signedDistance(const glm::dvec3& p) const = 0;
+
+	/**
+	 * Returns the outward unit normal of the distance field at a point (by default from central differences).
+	 */
+	virtual glm::dvec3 normal(const glm::dvec3& p) const {
+		constexpr double h = 1e-4;
+		const glm::dvec3 gradient(
+			signedDistance(p + glm::dvec3(h, 0, 0)) - signedDistance(p - glm::dvec3(h, 0, 0)),
+			signedDistance(p + glm::dvec3(0, h, 0)) - signedDistance(p - glm::dvec3(0, h, 0)),
+			signedDistance(p + glm::dvec3(0, 0, h)) - signedDistance(p - glm::dvec3(0, 0, h)));
+		const double length = glm::length(gradient);
+		return length > 0.0 ? gradient / length : glm::dvec3(0, 1, 0);
+	}
+
+	/**
+	 * Returns the closest point of the obstacle surface to a point.
+	 */
+	glm::dvec3 closestPoint(const glm::dvec3& p) const {
+		return p - signedDistance(p) * normal(p);
+	}
+
+	/**
+	 * Returns the minimum and maximum corner of the axis aligned bounding box of the obstacle.
+	 */
+	virtual std::pair<glm::dvec3, glm::dvec3> getBounds() const = 0;
+
+	/**
+	 * Collects the grid cells whose center is inside the obstacle (the border cells of the grid are skipped), ordered
+	 * by x, then y, then z.
+	 * 
+	 * \param parallel - if true the cells may be tested in parallel
+	 * \param cellD - the size of a grid cell
+	 * \param gridSize - the number of cells of the grid along each axis
+	 * \param cells - the coordinates of the cells inside the obstacle are appended to it
+	 */
+	virtual void getSolidCells(bool parallel, const glm::dvec3& cellD, const glm::ivec3& gridSize, std::vector<glm::ivec3>& cells) const {
+		const auto [low, high] = getBounds();
+		const glm::ivec3 min(std::max(std::floor(low.x / cellD.x), 1.0), std::max(std::floor(low.y / cellD.y), 1.0), std::max(std::floor(low.z / cellD.z), 1.0));
+		const glm::ivec3 max(std::min(std::floor(high.x / cellD.x), gridSize.x - 2.0), std::min(std::floor(high.y / cellD.y), gridSize.y - 2.0), std::min(std::floor(high.z / cellD.z), gridSize.z - 2.0));
+		if (min.x > max.x || min.y > max.y || min.z > max.z)
+			return;
+		//the cells are tested in parallel into a mask, then collected in order
+		const glm::ivec3 size = max - min + 1;
+		std::vector<unsigned char> solid(size_t(size.x) * size.y * size.z, 0);
+		util::parallelFor(parallel, 0, size.x, [&](int x) {
+			for (int y = 0; y < size.y; y++) {
+				for (int z = 0; z < size.z; z++) {
+					if (signedDistance((glm::dvec3(min + glm::ivec3(x, y, z)) + 0.5) * cellD) < 0.0)
+						solid[(size_t(x) * size.y + y) * size.z + z] = 1;
+				}
+			}
+		});
+		for (int x = 0; x < size.x; x++) {
+			for (int y = 0; y < size.y; y++) {
+				for (int z = 0; z < size.z; z++) {
+					if (solid[(size_t(x) * size.y + y) * size.z + z])
+						cells.push_back(min + glm::ivec3(x, y, z));
+				}
+			}
+		}
+	}
+
+	/**
+	 * Returns true if the particles touching the obstacle are removed (when despawning is enabled) and the obstacle
+	 * is not solid on the grid.
+	 */
+	virtual bool isParticleSink() const {
+		return false;
+	}
 };
 
 struct RectengularObstacle : public Obstacle {
 	const glm::dvec3 size;
 
-	RectengularObstacle(const glm::dvec3& size, const glm::dvec3& pos = glm::dvec3(0, 0, 0)) : Obstacle(pos), size(size) { }
+	RectengularObstacle(const glm::dvec3& size, const glm::dvec3& pos = glm::dvec3(0, 0, 0)) : Obstacle(pos, 0.2), size(size) { }
 
 	Obstacle* clone() override {
 		return new RectengularObstacle(*this);
 	}
+
+	double signedDistance(const glm::dvec3& p) const override {
+		return boxSignedDistance(p, pos, size * 0.5);
+	}
+
+	glm::dvec3 normal(const glm::dvec3& p) const override {
+		const glm::dvec3 d = p - pos;
+		const glm::dvec3 q = glm::abs(d) - size * 0.5;
+		const glm::dvec3 sign(d.x < 0 ? -1.0 : 1.0, d.y < 0 ? -1.0 : 1.0, d.z < 0 ? -1.0 : 1.0);
+		if (q.x > 0 || q.y > 0 || q.z > 0)
+			return glm::normalize(glm::max(q, glm::dvec3(0, 0, 0)) * sign);
+		//inside the normal points out through the closest side
+		const int axis = q.x > q.y ? (q.x > q.z ? 0 : 2) : (q.y > q.z ? 1 : 2);
+		glm::dvec3 n(0, 0, 0);
+		n[axis] = sign[axis];
+		return n;
+	}
+
+	std::pair<glm::dvec3, glm::dvec3> getBounds() const override {
+		return std::make_pair(pos - size * 0.5, pos + size * 0.5);
+	}
 };
 
 struct SphericalObstacle : public Obstacle {
 	const double r;
 
-	SphericalObstacle(double r, const glm::dvec3& pos = glm::dvec3(0, 0, 0)) : Obstacle(pos), r(r) { }
+	SphericalObstacle(double r, const glm::dvec3& pos = glm::dvec3(0, 0, 0)) : Obstacle(pos, 1.0), r(r) { }
 
 	Obstacle* clone() override {
 		return new SphericalObstacle(*this);
 	}
+
+	double signedDistance(const glm::dvec3& p) const override {
+		return sphereSignedDistance(p, pos, r);
+	}
+
+	glm::dvec3 normal(const glm::dvec3& p) const override {
+		const glm::dvec3 d = p - pos;
+		const double length = glm::length(d);
+		return length > 0.0 ? d / length : glm::dvec3(0, 1, 0);
+	}
+
+	std::pair<glm::dvec3, glm::dvec3> getBounds() const override {
+		return std::make_pair(pos - glm::dvec3(r, r, r), pos + glm::dvec3(r, r, r));
+	}
+};
+
+/**
+ * An obstacle of arbitrary shape given by signed distances sampled on a regular grid. The samples span a box of the
+ * given size centered at pos (the first and last samples are on the sides of the box), outside the box the distance
+ * from the box is added to the distance at the closest point of the box.
+ */
+struct SampledSdfObstacle : public Obstacle {
+	const glm::dvec3 size;
+	const glm::ivec3 resolution;
+	const std::shared_ptr<const std::vector<double>> distances;		//shared by the clones, indexed as x * res.y * res.z + y * res.z + z
+
+	/**
+	 * Constructs a sampled SDF obstacle.
+	 * 
+	 * \param distances - the signed distances, resolution.x * resolution.y * resolution.z samples (at least 2 along every axis)
+	 * \param resolution - the number of samples along each axis
+	 * \param size - the size of the box spanned by the samples
+	 * \param pos - the center of the box
+	 */
+	SampledSdfObstacle(std::vector<double> distances, const glm::ivec3& resolution, const glm::dvec3& size, const glm::dvec3& pos = glm::dvec3(0, 0, 0))
+		: Obstacle(pos, 0.2), size(size), resolution(resolution), distances(std::make_shared<const std::vector<double>>(std::move(distances))) { }
+
+	Obstacle* clone() override {
+		return new SampledSdfObstacle(*this);
+	}
+
+	double signedDistance(const glm::dvec3& p) const override {
+		const glm::dvec3 low = pos - size * 0.5;
+		const glm::dvec3 clamped = glm::clamp(p, low, pos + size * 0.5);
+		const glm::dvec3 samplePos = (clamped - low) / size * glm::dvec3(resolution.x - 1, resolution.y - 1, resolution.z - 1);
+		const glm::ivec3 base(
+			std::min(int(samplePos.x), resolution.x - 2),
+			std::min(int(samplePos.y), resolution.y - 2),
+			std::min(int(samplePos.z), resolution.z - 2));
+		const glm::dvec3 w = samplePos - glm::dvec3(base.x, base.y, base.z);
+		const std::vector<double>& d = *distances;
+		const int yzMultiplier = resolution.y * resolution.z;
+		const int index = base.x * yzMultiplier + base.y * resolution.z + base.z;
+		const double d00 = d[index] * (1 - w.z) + d[index + 1] * w.z;
+		const double d01 = d[index + resolution.z] * (1 - w.z) + d[index + resolution.z + 1] * w.z;
+		const double d10 = d[index + yzMultiplier] * (1 - w.z) + d[index + yzMultiplier + 1] * w.z;
+		const double d11 = d[index + yzMultiplier + resolution.z] * (1 - w.z) + d[index + yzMultiplier + resolution.z + 1] * w.z;
+		const double inside = (d00 * (1 - w.y) + d01 * w.y) * (1 - w.x) + (d10 * (1 - w.y) + d11 * w.y) * w.x;
+		return inside + glm::length(p - clamped);
+	}
+
+	std::pair<glm::dvec3, glm::dvec3> getBounds() const override {
+		return std::make_pair(pos - size * 0.5, pos + size * 0.5);
+	}
 };
 
 struct SphericalParticleSource : public SphericalObstacle {
@@ -62,6 +248,10 @@ struct SphericalParticleSink : public SphericalObstacle {
 	Obstacle* clone() override {
 		return new SphericalParticleSink(*this);
 	}
+
+	bool isParticleSink() const override {
+		return true;
+	}
 };
 
 }
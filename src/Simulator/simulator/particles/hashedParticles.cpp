@@ -1,6 +1,7 @@
 #include "hashedParticles.h"
 #include "../util/random.h"
 #include "../util/glmExtraOps.h"
+#include "../util/vectorOps.h"
 #include <omp.h>
 #include <algorithm>
 
@@ -10,6 +11,10 @@ inline glm::ivec3 getCellCoord(const glm::dvec3& pos, double dInv) {
 	return glm::ivec3(pos.x * dInv, pos.y * dInv, pos.z * dInv);
 }
 
+inline glm::ivec3 getCellCoord(const glm::dvec3& pos, const glm::dvec3& cellDInv) {
+	return glm::ivec3(pos.x * cellDInv.x, pos.y * cellDInv.y, pos.z * cellDInv.z);
+}
+
 inline glm::ivec3 getCellMinCoord(const glm::dvec3& pos, const glm::dvec3& cellDInv, int axis) {
 	glm::dvec3 coordOnGrid = pos * cellDInv - glm::dvec3(0.5, 0.5, 0.5);
 	if(axis != 3)
@@ -20,18 +25,15 @@ inline glm::ivec3 getCellMinCoord(const glm::dvec3& pos, const glm::dvec3& cellD
 	return idx;
 }
 
-HashedParticles::HashedParticles(int num, double r, glm::dvec3 dimensions, glm::dvec3 cellD, bool zConst, double z) 
-	: dimensions(std::move(dimensions)), cellD(std::move(cellD)), cellDInv(1.0 / cellD), r(r), z(z), zConst(zConst) {
-	particles.reserve(num);
+HashedParticles::HashedParticles(int num, double r, glm::dvec3 dimensions, glm::dvec3 cellD, bool zConst, double z, NeighbourGridType neighbourGridType) 
+	: dimensions(std::move(dimensions)), cellD(std::move(cellD)), cellDInv(1.0 / cellD), r(r), z(z), zConst(zConst), neighbourGridType(neighbourGridType) {
+	particlePos.reserve(num);
+	particleV.reserve(num);
 	for (int p = 0; p < num; p++) {
-		Particle particle;
-		particle.pos = glm::dvec3(
+		pushParticle(glm::dvec3(
 			util::getDoubleInRange(dimensions.x * 0.5 + cellD.x, dimensions.x - 1.1 * r - cellD.x),
 			util::getDoubleInRange(dimensions.y * 0.5 + cellD.y, dimensions.y - 1.1 * r - cellD.y),
-			zConst ? z : util::getDoubleInRange(dimensions.z * 0.5 + cellD.z, dimensions.z - 1.1 * r - cellD.z));
-		particle.c[0] = particle.c[1] = particle.c[2] = glm::dvec3(0, 0, 0);
-		particle.v = glm::dvec3(0, 0, 0);
-		particles.push_back(std::move(particle));
+			zConst ? z : util::getDoubleInRange(dimensions.z * 0.5 + cellD.z, dimensions.z - 1.1 * r - cellD.z)), glm::dvec3(0, 0, 0));
 	}
 	particleIds = std::vector<int>(num);
 	particleFaceIds[0] = std::vector<int>(num);
@@ -42,122 +44,104 @@ HashedParticles::HashedParticles(int num, double r, glm::dvec3 dimensions, glm::
 }
 
 void HashedParticles::forEachIntersecting(const Particle& particle, int pIndex, std::function<void(Particle&)>&& lambda) {
-	glm::ivec3 cellIndex = getCellCoord(particle.pos, dInv);
-	glm::ivec3 indexMax(std::min(cellIndex.x + 1, cellNum.x - 1), std::min(cellIndex.y + 1, cellNum.y - 1), std::min(cellIndex.z + 1, cellNum.z - 1));
-
-	for (int x = std::max(cellIndex.x - 1, 0); x <= indexMax.x; x++) {
-		for (int y = std::max(cellIndex.y - 1, 0); y <= indexMax.y; y++) {
-			for (int z = std::max(cellIndex.z - 1, 0); z <= indexMax.z; z++) {
-				int cellIndex = x * cellNum.y * cellNum.z + y * cellNum.z + z;
-				int cellStartPos = particleCells[cellIndex];
-				int maxPos = particleCells[cellIndex + 1];
-				for (int idIndex = cellStartPos; idIndex < maxPos; idIndex++) {
-					if (particleIds[idIndex] == pIndex)
-						continue;
-					lambda(particles[particleIds[idIndex]]);
-				}
-			}
-		}
-	}
+	forEachIntersecting<std::function<void(Particle&)>>(particle, pIndex, std::move(lambda));
 }
 
-void HashedParticles::pushParticlesApart(bool parallel) {
+void HashedParticles::pushParticlesApart(bool parallel, int iterationCount) {
 	const double particleD = r * 2;
 	const double particleD2 = particleD * particleD;
 	const glm::dvec3 particleLow(cellD.x + r * 1.01, cellD.y + r * 1.01, cellD.z + r * 1.01);
 	const glm::dvec3 particleHigh = dimensions - particleLow;
 	const double zConstVal = z;
 
-	forEach(parallel, [&](Particle& particle, int idx) {
-		glm::ivec3 cellIndex = getCellCoord(particle.pos, dInv);
-		glm::ivec3 indexMax(std::min(cellIndex.x + 1, cellNum.x - 1), std::min(cellIndex.y + 1, cellNum.y - 1), std::min(cellIndex.z + 1, cellNum.z - 1));
-
-		for (int x = std::max(cellIndex.x - 1, 0); x <= indexMax.x; x++) {
-			for (int y = std::max(cellIndex.y - 1, 0); y <= indexMax.y; y++) {
-				for (int z = std::max(cellIndex.z - 1, 0); z <= indexMax.z; z++) {
-					int cellIndex = x * cellNum.y * cellNum.z + y * cellNum.z + z;
-					int cellStartPos = particleCells[cellIndex];
-					int maxPos = particleCells[cellIndex + 1];
-					for (int idIndex = cellStartPos; idIndex < maxPos; idIndex++) {
-						if (particleIds[idIndex] == idx)
-							continue;
-
-						Particle& particle2 = particles[particleIds[idIndex]];
-						glm::dvec3 p1p2 = particle.pos - particle2.pos;
-						double distance2 = glm::dot(p1p2, p1p2);
-						if (distance2 > particleD2 || distance2 < 1e-8)
-							continue;
-
-						double distance = sqrt(distance2);
-						double tmp = (particleD - distance) / distance;
-						glm::dvec3 offset = p1p2 * tmp * 0.5;
-						particle.pos += offset;
-						particle2.pos -= offset;
-						particle.pos.x = std::clamp(particle.pos.x, particleLow.x, particleHigh.x);
-						particle.pos.y = std::clamp(particle.pos.y, particleLow.y, particleHigh.y);
-						particle.pos.z = zConst ? zConstVal : std::clamp(particle.pos.z, particleLow.z, particleHigh.z);
-						particle2.pos.x = std::clamp(particle2.pos.x, particleLow.x, particleHigh.x);
-						particle2.pos.y = std::clamp(particle2.pos.y, particleLow.y, particleHigh.y);
-						particle2.pos.z = zConst ? zConstVal : std::clamp(particle2.pos.z, particleLow.z, particleHigh.z);
-					}
-				}
-			}
-		}
-	});
+	pushApartDisplacements.resize(particlePos.size());
+	for (int iteration = 0; iteration < iterationCount; iteration++) {
+		if (iteration > 0)
+			updateParticleIntersectionHash(parallel, true);
+
+		//every pair is visited from both sides and each side only moves its own particle, so the result doesn't depend on the thread count
+		forEach(parallel, [&](Particle& particle, int idx) {
+			const glm::dvec3 pos = particle.pos;
+			glm::dvec3 displacement(0.0, 0.0, 0.0);
+			forEachIntersecting(particle, idx, [&](Particle& particle2) {
+				glm::dvec3 p1p2 = pos - glm::dvec3(particle2.pos);
+				double distance2 = glm::dot(p1p2, p1p2);
+				if (distance2 > particleD2 || distance2 < 1e-8)
+					return;
+
+				double distance = sqrt(distance2);
+				double tmp = (particleD - distance) / distance;
+				displacement += p1p2 * tmp * 0.5;
+			});
+			pushApartDisplacements[idx] = displacement;
+		});
+
+		forEach(parallel, [&](Particle& particle, int idx) {
+			const glm::dvec3 pos = glm::dvec3(particle.pos) + pushApartDisplacements[idx];
+			particle.pos = glm::dvec3(
+				std::clamp(pos.x, particleLow.x, particleHigh.x),
+				std::clamp(pos.y, particleLow.y, particleHigh.y),
+				zConst ? zConstVal : std::clamp(pos.z, particleLow.z, particleHigh.z));
+		});
+	}
 }
 
 void HashedParticles::forEachAround(const glm::ivec3& cellGridCoord, int axis, std::function<void(Particle&)>&& lambda) {
-	int cellIndex = cellGridCoord.x * cellNumFace.y * cellNumFace.z + cellGridCoord.y * cellNumFace.z + cellGridCoord.z;
-	int max = particleFaceCells[axis][cellIndex + 1];
-	for (int p = particleFaceCells[axis][cellIndex]; p < max; p++) {
-		lambda(particles[particleFaceIds[axis][p]]);
-	}
+	forEachAround<std::function<void(Particle&)>>(cellGridCoord, axis, std::move(lambda));
 }
 
 void HashedParticles::forEach(bool parallel, std::function<void(Particle&, int)>&& lambda) {
-	int particleNum = particles.size();
-	if (parallel) {
-#pragma omp parallel for
-		for (int p = 0; p < particleNum; p++) {
-			lambda(particles[p], p);
-		}
-	}
-	else {
-		for (int p = 0; p < particleNum; p++) {
-			lambda(particles[p], p);
-		}
-	}
+	forEach<std::function<void(Particle&, int)>>(parallel, std::move(lambda));
 }
 
 void HashedParticles::setParticleNum(int num) {
 	particleIds = std::vector<int>(num);
-	while (num < particles.size()) {
-		particles.pop_back();
+	if (num < particlePos.size()) {
+		particlePos.resize(num);
+		particleV.resize(num);
+		if (affineVelocitiesStored)
+			particleC.resize(num);
 	}
-	while (num > particles.size()) {
-		Particle particle;
-		particle.pos = glm::dvec3(
+	while (num > particlePos.size()) {
+		pushParticle(glm::dvec3(
 			util::getDoubleInRange(1.1 * r + cellD.x, dimensions.x - 1.1 * r - cellD.x),
 			util::getDoubleInRange(1.1 * r + cellD.y, dimensions.y - 1.1 * r - cellD.y),
-			zConst ? z : util::getDoubleInRange(1.1 * r + cellD.z, dimensions.z - 1.1 * r - cellD.z));
-		particle.c[0] = particle.c[1] = particle.c[2] = glm::dvec3(0, 0, 0);
-		particle.v = glm::dvec3(0, 0, 0);
-		particles.push_back(std::move(particle));
+			zConst ? z : util::getDoubleInRange(1.1 * r + cellD.z, dimensions.z - 1.1 * r - cellD.z)), glm::dvec3(0, 0, 0));
 	}
 	initParticleFaceHash();
 	initParticleIntersectionHash();
 	updateParticleIntersectionHash(false);
 	updateParticleFaceHash(true);
+	updateParticleCenterHash(true);
 }
 
-void HashedParticles::addParticles(std::vector<Particle>&& particles) {
-	this->particles.insert(this->particles.end(), particles.begin(), particles.end());
+void HashedParticles::addParticles(std::vector<ParticleState>&& particles) {
+	for (const ParticleState& particle : particles) {
+		pushParticle(particle.pos, particle.v);
+	}
 	initParticleIntersectionHash();
 }
 
+void HashedParticles::pushParticle(const glm::dvec3& pos, const glm::dvec3& v) {
+	particlePos.push_back(pos);
+	particleV.push_back(v);
+	if (affineVelocitiesStored)
+		particleC.push_back({ util::RealVec3(0, 0, 0), util::RealVec3(0, 0, 0), util::RealVec3(0, 0, 0) });
+}
+
+void HashedParticles::setAffineVelocitiesStored(bool stored) {
+	if (stored == affineVelocitiesStored)
+		return;
+	affineVelocitiesStored = stored;
+	if (stored)
+		particleC.assign(particlePos.size(), { util::RealVec3(0, 0, 0), util::RealVec3(0, 0, 0), util::RealVec3(0, 0, 0) });
+	else
+		std::vector<std::array<util::RealVec3, 3>>().swap(particleC);
+}
+
 void HashedParticles::removeParticles(std::vector<int>&& particleIds) {
 	std::sort(particleIds.begin(), particleIds.end());
-	const int particleNum = particles.size();
+	const int particleNum = particlePos.size();
 	const int particleIdNum = particleIds.size();
 	int particleIdIndex = 0;
 	for (int p = 0; p < particleNum; p++) {
@@ -165,9 +149,15 @@ void HashedParticles::removeParticles(std::vector<int>&& particleIds) {
 			particleIdIndex++;
 			continue;
 		}
-		this->particles[p - particleIdIndex] = std::move(this->particles[p]);
+		particlePos[p - particleIdIndex] = particlePos[p];
+		particleV[p - particleIdIndex] = particleV[p];
+		if (affineVelocitiesStored)
+			particleC[p - particleIdIndex] = particleC[p];
 	}
-	particles.erase(particles.end() - particleIdNum, particles.end());
+	particlePos.resize(particleNum - particleIdNum);
+	particleV.resize(particleNum - particleIdNum);
+	if (affineVelocitiesStored)
+		particleC.resize(particleNum - particleIdNum);
 	initParticleIntersectionHash();
 }
 
@@ -175,12 +165,12 @@ double HashedParticles::getParticleR() const {
 	return r;
 }
 
-Particle& HashedParticles::getParticleAt(int idx) {
-	return particles[idx];
+Particle HashedParticles::getParticleAt(int idx) {
+	return particleAt(idx);
 }
 
 int HashedParticles::getParticleNum() const {
-	return particles.size();
+	return particlePos.size();
 }
 
 void HashedParticles::setParticleR(double r) {
@@ -192,143 +182,289 @@ void HashedParticles::setParticleR(double r) {
 	updateParticleIntersectionHash(false);
 }
 
-void HashedParticles::updateParticleIntersectionHash(bool parallel) {
-	int particleCellNum = particleCells.size();
-	int particleNum = particles.size();
+void HashedParticles::updateParticleIntersectionHash(bool parallel, bool incremental) {
+	if (neighbourGridType == NeighbourGridType::COMPACT_HASH) {
+		updateParticleCompactHash(parallel);
+		return;
+	}
+	if (incremental && updateParticleIntersectionHashIncrementally(parallel))
+		return;
+	sortParticlesIntoCells(parallel, cellNum, glm::dvec3(dInv, dInv, dInv), particleCells, particleIds, particleCellIndices);
+}
+
+void HashedParticles::updateParticleBlockHash(bool parallel, const glm::dvec3& blockSize) {
+	const glm::dvec3 blockSizeInv = 1.0 / blockSize;
+	blockNum = glm::ivec3(std::ceil(dimensions.x * blockSizeInv.x), std::ceil(dimensions.y * blockSizeInv.y), std::ceil(dimensions.z * blockSizeInv.z));
+	const int blockNumTotal = blockNum.x * blockNum.y * blockNum.z + 1;
+	if (particleBlocks.size() != blockNumTotal)
+		particleBlocks = std::vector<AtomicIntWrapper>(blockNumTotal, 0);
+	particleBlockIds.resize(particlePos.size());
+	sortParticlesIntoCells(parallel, blockNum, blockSizeInv, particleBlocks, particleBlockIds, particleBlockIndices);
+}
+
+void HashedParticles::forEachColored(bool parallel, std::function<void(Particle&, int)>&& lambda) {
+	forEachColored<std::function<void(Particle&, int)>>(parallel, std::move(lambda));
+}
+
+void HashedParticles::sortParticlesIntoCells(bool parallel, const glm::ivec3& cellNum, const glm::dvec3& cellDInv, std::vector<AtomicIntWrapper>& cells, std::vector<int>& ids, std::vector<int>& cellIndices) {
+	int particleCellNum = cells.size();
+	int particleNum = particlePos.size();
+	cellIndices.resize(particleNum);
 	if (parallel) {
 #pragma omp parallel for
 		for (int i = 0; i < particleCellNum; i++) {
-			particleCells[i] = 0;
+			cells[i] = 0;
 		}
 	}
 	else {
 		for (int i = 0; i < particleCellNum; i++) {
-			particleCells[i] = 0;
+			cells[i] = 0;
 		}
 	}
 	if (parallel) {
 #pragma omp parallel for
 		for (int p = 0; p < particleNum; p++) {
-			glm::ivec3 coord = getCellCoord(particles[p].pos, dInv);
-			particleCells[coord.x * cellNum.y * cellNum.z + coord.y * cellNum.z + coord.z].value++;
+			glm::ivec3 coord = getCellCoord(particlePos[p], cellDInv);
+			cellIndices[p] = coord.x * cellNum.y * cellNum.z + coord.y * cellNum.z + coord.z;
+			cells[cellIndices[p]].value++;
 		}
 	}
 	else {
 		for (int p = 0; p < particleNum; p++) {
-			glm::ivec3 coord = getCellCoord(particles[p].pos, dInv);
-			particleCells[coord.x * cellNum.y * cellNum.z + coord.y * cellNum.z + coord.z].value++;
+			glm::ivec3 coord = getCellCoord(particlePos[p], cellDInv);
+			cellIndices[p] = coord.x * cellNum.y * cellNum.z + coord.y * cellNum.z + coord.z;
+			cells[cellIndices[p]].value++;
 		}
 	}
-	int lastIndex = 0;
-	for (int i = 0; i < particleCellNum; i++) {
-		lastIndex += particleCells[i];
-		particleCells[i] = lastIndex;
-	}
+	util::prefixSum(parallel, cells);
+	//the ids of a cell are always in increasing order, so the iteration order (and the results) don't depend on the thread count
 	if (parallel) {
 #pragma omp parallel for
 		for (int p = 0; p < particleNum; p++) {
-			Particle& particle = particles[p];
-			glm::ivec3 coord = getCellCoord(particle.pos, dInv);
-			int index = --particleCells[coord.x * cellNum.y * cellNum.z + coord.y * cellNum.z + coord.z].value;
-			particleIds[index] = p;
+			int index = --cells[cellIndices[p]].value;
+			ids[index] = p;
+		}
+#pragma omp parallel for
+		for (int i = 0; i < particleCellNum - 1; i++) {
+			std::sort(ids.begin() + cells[i], ids.begin() + cells[i + 1]);
 		}
 	}
 	else {
-		for (int p = 0; p < particleNum; p++) {
-			Particle& particle = particles[p];
-			glm::ivec3 coord = getCellCoord(particle.pos, dInv);
-			int index = --particleCells[coord.x * cellNum.y * cellNum.z + coord.y * cellNum.z + coord.z].value;
-			particleIds[index] = p;
+		for (int p = particleNum - 1; p >= 0; p--) {
+			int index = --cells[cellIndices[p]].value;
+			ids[index] = p;
 		}
 	}
 }
 
-void HashedParticles::updateParticleFaceHash(bool parallel) {
-	/*if (parallel) {
-#pragma omp parallel for
-		for (int axis = 0; axis < 3; axis++) {
-			faceAndCenterHashUpdate(axis);
-		}
+void HashedParticles::updateParticleCompactHash(bool parallel) {
+	const int particleNum = particlePos.size();
+	compactOrder.resize(particleNum);
+	particleIds.resize(particleNum);
+	util::parallelFor(parallel, 0, particleNum, [&](int p) {
+		compactOrder[p] = std::make_pair(util::getMortonKey(getCellCoord(particlePos[p], dInv)), p);
+	});
+	//the pairs are sorted by the particle index within a cell too, so the particles of a cell are in the same order as in the dense hash
+	std::sort(compactOrder.begin(), compactOrder.end());
+
+	compactCellStarts.clear();
+	for (int i = 0; i < particleNum; i++) {
+		particleIds[i] = compactOrder[i].second;
+		if (i == 0 || compactOrder[i].first != compactOrder[i - 1].first)
+			compactCellStarts.push_back(i);
 	}
-	else {
-		for (int axis = 0; axis < 3; axis++) {
-			faceAndCenterHashUpdate(axis);
+	const int occupiedCellNum = compactCellStarts.size();
+	compactCellStarts.push_back(particleNum);
+
+	//the table is at most half full, its size is a power of two so that the top bits of the multiplicative hash can be used as the slot
+	int sizeLog2 = 4;
+	while ((size_t(1) << sizeLog2) < 2 * size_t(occupiedCellNum))
+		sizeLog2++;
+	compactHashShift = 64 - sizeLog2;
+	const size_t mask = (size_t(1) << sizeLog2) - 1;
+	compactHashTable.assign(mask + 1, CompactHashEntry{ COMPACT_HASH_EMPTY_KEY, -1 });
+	for (int cell = 0; cell < occupiedCellNum; cell++) {
+		const uint64_t key = compactOrder[compactCellStarts[cell]].first;
+		size_t slot = (key * 0x9E3779B97F4A7C15ull) >> compactHashShift;
+		while (compactHashTable[slot].key != COMPACT_HASH_EMPTY_KEY)
+			slot = (slot + 1) & mask;
+		compactHashTable[slot] = CompactHashEntry{ key, cell };
+	}
+}
+
+bool HashedParticles::updateParticleIntersectionHashIncrementally(bool parallel) {
+	const int particleNum = particlePos.size();
+	const int particleCellNum = particleCells.size();
+	if (particleCellIndices.size() != particleNum)
+		return false;
+
+	newParticleCellIndices.resize(particleNum);
+	util::parallelFor(parallel, 0, particleNum, [&](int p) {
+		glm::ivec3 coord = getCellCoord(particlePos[p], dInv);
+		newParticleCellIndices[p] = coord.x * cellNum.y * cellNum.z + coord.y * cellNum.z + coord.z;
+	});
+	movedParticles.clear();
+	for (int p = 0; p < particleNum; p++) {
+		if (newParticleCellIndices[p] != particleCellIndices[p])
+			movedParticles.push_back(p);
+	}
+	if (movedParticles.size() > particleNum / 8)
+		return false;
+
+	//the new cell sizes are the old ones corrected by the moved particles, shifted by one so that the prefix sum gives the cell starts
+	if (particleCellsBuffer.size() != particleCellNum)
+		particleCellsBuffer = std::vector<AtomicIntWrapper>(particleCellNum, 0);
+	particleCellsBuffer[0] = 0;
+	util::parallelFor(parallel, 0, particleCellNum - 1, [&](int i) {
+		particleCellsBuffer[i + 1] = particleCells[i + 1] - particleCells[i];
+	});
+	for (int p : movedParticles) {
+		particleCellsBuffer[particleCellIndices[p] + 1].value--;
+		particleCellsBuffer[newParticleCellIndices[p] + 1].value++;
+	}
+	util::prefixSum(parallel, particleCellsBuffer);
+
+	//each cell merges the particles that stayed in it and the ones that moved into it, both are in increasing order
+	std::sort(movedParticles.begin(), movedParticles.end(), [&](int p1, int p2) {
+		return newParticleCellIndices[p1] < newParticleCellIndices[p2] || (newParticleCellIndices[p1] == newParticleCellIndices[p2] && p1 < p2);
+	});
+	particleIdsBuffer.resize(particleNum);
+	util::parallelFor(parallel, 0, particleCellNum - 1, [&](int cell) {
+		int out = particleCellsBuffer[cell];
+		if (out == particleCellsBuffer[cell + 1])
+			return;
+		int idIndex = particleCells[cell];
+		const int idEnd = particleCells[cell + 1];
+		auto mover = std::lower_bound(movedParticles.begin(), movedParticles.end(), cell, [&](int p, int cell) {
+			return newParticleCellIndices[p] < cell;
+		});
+		while (true) {
+			while (idIndex < idEnd && newParticleCellIndices[particleIds[idIndex]] != cell)
+				idIndex++;
+			const bool stayer = idIndex < idEnd;
+			const bool incoming = mover != movedParticles.end() && newParticleCellIndices[*mover] == cell;
+			if (!stayer && !incoming)
+				break;
+			if (stayer && (!incoming || particleIds[idIndex] < *mover))
+				particleIdsBuffer[out++] = particleIds[idIndex++];
+			else
+				particleIdsBuffer[out++] = *mover++;
 		}
-	}*/
+	});
+
+	particleCells.swap(particleCellsBuffer);
+	particleIds.swap(particleIdsBuffer);
+	particleCellIndices.swap(newParticleCellIndices);
+	return true;
 }
 
-void HashedParticles::updateParticleCenterHash() {
-	faceAndCenterHashUpdate(3);
+void HashedParticles::sortParticlesByMortonOrder(bool parallel) {
+	const int particleNum = particlePos.size();
+	mortonOrder.resize(particleNum);
+	util::parallelFor(parallel, 0, particleNum, [&](int p) {
+		mortonOrder[p] = std::make_pair(util::getMortonKey(getCellCoord(particlePos[p], cellDInv)), p);
+	});
+
+	long long moveBudget = 4ll * particleNum;
+	bool moved = false;
+	for (int i = 1; i < particleNum && moveBudget >= 0; i++) {
+		const auto current = mortonOrder[i];
+		int j = i;
+		for (; j > 0 && mortonOrder[j - 1].first > current.first; j--) {
+			mortonOrder[j] = mortonOrder[j - 1];
+		}
+		mortonOrder[j] = current;
+		moveBudget -= i - j;
+		moved |= i != j;
+	}
+	if (moveBudget < 0)
+		std::sort(mortonOrder.begin(), mortonOrder.end());
+	if (!moved)
+		return;
+
+	particleCellIndices.clear();
+	reorder(parallel, particlePos, sortBuffer);
+	reorder(parallel, particleV, sortBuffer);
+	if (affineVelocitiesStored)
+		reorder(parallel, particleC, sortBufferC);
+}
+
+template<typename T>
+void HashedParticles::reorder(bool parallel, std::vector<T>& values, std::vector<T>& buffer) const {
+	const int particleNum = values.size();
+	buffer.resize(particleNum);
+	util::parallelFor(parallel, 0, particleNum, [&](int p) {
+		buffer[p] = values[mortonOrder[p].second];
+	});
+	values.swap(buffer);
+}
+
+void HashedParticles::updateParticleFaceHash(bool parallel) {
+	for (int axis = 0; axis < 3; axis++) {
+		sortParticlesIntoFaceCells(parallel, axis);
+	}
+}
+
+void HashedParticles::updateParticleCenterHash(bool parallel) {
+	sortParticlesIntoFaceCells(parallel, 3);
 }
 
 void HashedParticles::initParticleFaceHash() {
-	/*cellNumFace.x = std::ceil(dimensions.x / cellD.x) + 1;
+	cellNumFace.x = std::ceil(dimensions.x / cellD.x) + 1;
 	cellNumFace.y = std::ceil(dimensions.y / cellD.y) + 1;
 	cellNumFace.z = std::ceil(dimensions.z / cellD.z) + 1;
 	int cellNumTotal = cellNumFace.x * cellNumFace.y * cellNumFace.z + 1;
 	for (int axis = 0; axis < 4; axis++) {
-		while (particles.size() * 8 < particleFaceIds[axis].size()) {
-			particleFaceIds[axis].pop_back();
-		}
-		while (particles.size() * 8 > particleFaceIds[axis].size()) {
-			particleFaceIds[axis].push_back(0);
-		}
-		while (particleFaceCells[axis].size() < cellNumTotal) {
-			particleFaceCells[axis].push_back(0);
-		}
-		while (particleFaceCells[axis].size() > cellNumTotal) {
-			particleFaceCells[axis].pop_back();
-		}
+		if (particleFaceCells[axis].size() != cellNumTotal)
+			particleFaceCells[axis] = std::vector<AtomicIntWrapper>(cellNumTotal, 0);
+		particleFaceIds[axis].resize(particlePos.size() * 8);
 	}
+}
 
-	faceAndCenterHashUpdate = [this](int axis) {
-		auto& particleCells = particleFaceCells[axis];
-		auto& particleIds = particleFaceIds[axis];
-		for (int& i : particleCells) {
-			i = 0;
-		}
-		for (auto& particle : particles) {
-			glm::ivec3 coord = getCellMinCoord(particle.pos, cellDInv, axis);
-			particleCells[coord.x * cellNumFace.y * cellNumFace.z + coord.y * cellNumFace.z + coord.z]++;
-			particleCells[coord.x * cellNumFace.y * cellNumFace.z + coord.y * cellNumFace.z + coord.z + 1]++;
-			particleCells[coord.x * cellNumFace.y * cellNumFace.z + (coord.y + 1) * cellNumFace.z + coord.z]++;
-			particleCells[coord.x * cellNumFace.y * cellNumFace.z + (coord.y + 1) * cellNumFace.z + coord.z + 1]++;
-			particleCells[(coord.x + 1) * cellNumFace.y * cellNumFace.z + coord.y * cellNumFace.z + coord.z]++;
-			particleCells[(coord.x + 1) * cellNumFace.y * cellNumFace.z + coord.y * cellNumFace.z + coord.z + 1]++;
-			particleCells[(coord.x + 1) * cellNumFace.y * cellNumFace.z + (coord.y + 1) * cellNumFace.z + coord.z]++;
-			particleCells[(coord.x + 1) * cellNumFace.y * cellNumFace.z + (coord.y + 1) * cellNumFace.z + coord.z + 1]++;
-		}
-		int lastIndex = 0;
-		for (int& i : particleCells) {
-			lastIndex += i;
-			i = lastIndex;
-		}
-		for (int p = 0; p < particles.size(); p++) {
-			Particle& particle = particles[p];
-			glm::ivec3 coord = getCellMinCoord(particle.pos, cellDInv, axis);
-			particleIds[--particleCells[coord.x * cellNumFace.y * cellNumFace.z + coord.y * cellNumFace.z + coord.z]] = p;
-			particleIds[--particleCells[coord.x * cellNumFace.y * cellNumFace.z + coord.y * cellNumFace.z + coord.z + 1]] = p;
-			particleIds[--particleCells[coord.x * cellNumFace.y * cellNumFace.z + (coord.y + 1) * cellNumFace.z + coord.z]] = p;
-			particleIds[--particleCells[coord.x * cellNumFace.y * cellNumFace.z + (coord.y + 1) * cellNumFace.z + coord.z + 1]] = p;
-			particleIds[--particleCells[(coord.x + 1) * cellNumFace.y * cellNumFace.z + coord.y * cellNumFace.z + coord.z]] = p;
-			particleIds[--particleCells[(coord.x + 1) * cellNumFace.y * cellNumFace.z + coord.y * cellNumFace.z + coord.z + 1]] = p;
-			particleIds[--particleCells[(coord.x + 1) * cellNumFace.y * cellNumFace.z + (coord.y + 1) * cellNumFace.z + coord.z]] = p;
-			particleIds[--particleCells[(coord.x + 1) * cellNumFace.y * cellNumFace.z + (coord.y + 1) * cellNumFace.z + coord.z + 1]] = p;
-		}
-	};*/
+void HashedParticles::sortParticlesIntoFaceCells(bool parallel, int axis) {
+	auto& cells = particleFaceCells[axis];
+	auto& ids = particleFaceIds[axis];
+	const int particleNum = particlePos.size();
+	const int yz = cellNumFace.y * cellNumFace.z;
+	const int stencil[8] = { 0, 1, cellNumFace.z, cellNumFace.z + 1, yz, yz + 1, yz + cellNumFace.z, yz + cellNumFace.z + 1 };
+	const auto minCellIndex = [&](int p) {
+		glm::ivec3 coord = getCellMinCoord(particlePos[p], cellDInv, axis);
+		return coord.x * yz + coord.y * cellNumFace.z + coord.z;
+	};
+	ids.resize(particleNum * 8);
+
+	util::parallelFor(parallel, 0, cells.size(), [&](int i) {
+		cells[i] = 0;
+	});
+	util::parallelFor(parallel, 0, particleNum, [&](int p) {
+		const int index = minCellIndex(p);
+		for (int s = 0; s < 8; s++)
+			cells[index + stencil[s]].value++;
+	});
+	int lastIndex = 0;
+	for (auto& i : cells) {
+		lastIndex += i;
+		i = lastIndex;
+	}
+	util::parallelFor(parallel, 0, particleNum, [&](int p) {
+		const int index = minCellIndex(p);
+		for (int s = 0; s < 8; s++)
+			ids[--cells[index + stencil[s]].value] = p;
+	});
 }
 
 void HashedParticles::initParticleIntersectionHash() {
-	while (particles.size() < particleIds.size()) {
+	particleCellIndices.clear();
+	while (particlePos.size() < particleIds.size()) {
 		particleIds.pop_back();
 	}
-	while (particles.size() > particleIds.size()) {
+	while (particlePos.size() > particleIds.size()) {
 		particleIds.push_back(0);
 	}
 	cellNum.x = std::ceil(dimensions.x * dInv);
 	cellNum.y = std::ceil(dimensions.y * dInv);
 	cellNum.z = std::ceil(dimensions.z * dInv);
-	int cellNumTotal = cellNum.x * cellNum.y * cellNum.z + 1;
+	int cellNumTotal = neighbourGridType == NeighbourGridType::DENSE ? cellNum.x * cellNum.y * cellNum.z + 1 : 0;
 	while (particleCells.size() < cellNumTotal) {
 		particleCells.push_back(0);
 	}
@@ -341,13 +477,15 @@ void HashedParticles::updateGridParams(const glm::dvec3& cellD, const glm::dvec3
 	this->cellD = cellD;
 	this->dimensions = dimensions;
 	cellDInv = 1.0 / cellD;
-	for (Particle& particle : particles) {
-		particle.pos = glm::dvec3(
-			std::clamp(particle.pos.x, 1.1 * r + cellD.x, dimensions.x - 1.1 * r - cellD.x),
-			std::clamp(particle.pos.y, 1.1 * r + cellD.y, dimensions.y - 1.1 * r - cellD.y),
-			zConst ? z : std::clamp(particle.pos.z, 1.1 * r + cellD.z, dimensions.z - 1.1 * r - cellD.z));
+	particleCellIndices.clear();
+	for (util::RealVec3& pos : particlePos) {
+		pos = glm::dvec3(
+			std::clamp<double>(pos.x, 1.1 * r + cellD.x, dimensions.x - 1.1 * r - cellD.x),
+			std::clamp<double>(pos.y, 1.1 * r + cellD.y, dimensions.y - 1.1 * r - cellD.y),
+			zConst ? z : std::clamp<double>(pos.z, 1.1 * r + cellD.z, dimensions.z - 1.1 * r - cellD.z));
 	}
 	updateParticleIntersectionHash(false);
 	initParticleFaceHash();
 	updateParticleFaceHash(true);
+	updateParticleCenterHash(true);
 }
@@ -2,10 +2,14 @@
 
 #include <glm/glm.hpp>
 #include "particle.h"
+#include "../util/morton.h"
 #include <functional>
 #include <vector>
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <cstdint>
+#include <utility>
 
 
 namespace genericfsim::particles {
@@ -16,6 +20,16 @@ namespace genericfsim::particles {
  */
 class HashedParticles {
 public:
+	/**
+	 * The data structure used by the particle intersection hash. DENSE stores the particle range of every cell of the
+	 * volume, COMPACT_HASH only stores the occupied cells in an open addressing hash table keyed by their Z-order key,
+	 * so its memory scales with the number of occupied cells instead of the volume (useful for small particles in a
+	 * mostly empty volume).
+	 */
+	enum class NeighbourGridType { DENSE, COMPACT_HASH };
+
+	// The iteration functions are templates, so that the lambdas of the hot loops can be inlined. The std::function
+	// overloads are kept for code outside the simulator library.
 
 	/**
 	 * Constructs the HashedParticle class.
@@ -26,8 +40,9 @@ public:
 	 * \param cellD - the size of a cell
 	 * \param zConst - if true than the z coordinate of all particles is the same number (useful for 2D simulations)
 	 * \param z - the z coordinate of all particles if zConst is true
+	 * \param neighbourGridType - the data structure of the particle intersection hash
 	 */
-	HashedParticles(int num, double r, glm::dvec3 dimensions, glm::dvec3 cellD, bool zConst, double z);
+	HashedParticles(int num, double r, glm::dvec3 dimensions, glm::dvec3 cellD, bool zConst, double z, NeighbourGridType neighbourGridType = NeighbourGridType::DENSE);
 
 	/**
 	 * Calls the lambda function for each particle that has a chance for touching the given particle
@@ -36,22 +51,30 @@ public:
 	 * \param pIndex - the index of the particle (for optimization purposes)
 	 * \param lambda - the called function
 	 */
+	template<typename F>
+	void forEachIntersecting(const Particle& particle, int pIndex, F&& lambda);
 	void forEachIntersecting(const Particle& particle, int pIndex, std::function<void(Particle&)>&& lambda);
 
 	/**
 	 * Pushes particles apart, before calling it particle intersection hash must be updates.
+	 * Each iteration first calculates the displacement of every particle from its neighbours, then moves all particles at
+	 * once (Jacobi style), so the result is the same in serial and in parallel.
 	 * 
 	 * \param parallel - whearher to run the loop in parallel
+	 * \param iterationCount - the number of push apart iterations (the hash is updated between them)
 	 */
-	void pushParticlesApart(bool parallel);
+	void pushParticlesApart(bool parallel, int iterationCount = 1);
 
 	/**
-	 * Calls the lambda function for each particle that is closer to the given face center than cellD.
+	 * Calls the lambda function for each particle that is closer to the given face center than cellD (along every axis).
+	 * Before calling it the particle face hash (or for axis 3 the particle center hash) must be updated.
 	 * 
 	 * \param cellIndex - the index of the face's corresponding cell
 	 * \param axis - the axis of the cell (this defines the face), 3 represents the center of the cell
 	 * \param lambda - the called function
 	 */
+	template<typename F>
+	void forEachAround(const glm::ivec3& cellIndex, int axis, F&& lambda);
 	void forEachAround(const glm::ivec3& cellIndex, int axis, std::function<void(Particle&)>&& lambda);
 
 	/**
@@ -60,6 +83,8 @@ public:
 	 * \param parallel - if true the loop runs in parallel
 	 * \param lambda - the called function
 	 */
+	template<typename F>
+	void forEach(bool parallel, F&& lambda);
 	void forEach(bool parallel, std::function<void(Particle&, int)>&& lambda);
 
 	/**
@@ -73,9 +98,17 @@ public:
 	 * Returns the particle with a certain index.
 	 * 
 	 * \param idx - the index of the particle
-	 * \return - a reference to the particle
+	 * \return - the particle (it references the stored attributes)
 	 */
-	Particle& getParticleAt(int idx);
+	Particle getParticleAt(int idx);
+
+	/**
+	 * Sets whether the affine velocity matrix of the particles (only used by APIC) is stored. The matrices are
+	 * allocated (zero initialized) when it is turned on and freed when it is turned off.
+	 * 
+	 * \param stored - true if the affine velocities need to be stored
+	 */
+	void setAffineVelocitiesStored(bool stored);
 
 	/**
 	 * Returns the number of the particles.
@@ -100,19 +133,57 @@ public:
 
 	/**
 	 * Updates the hash function for the particle intersection according to their new position.
+	 * 
+	 * \param parallel - if true the hash is built in parallel
+	 * \param incremental - if true and only a few particles left their hash cell since the last update, only those
+	 * particles are relocated, otherwise the hash is rebuilt (the compact hash is always rebuilt)
 	 */
-	void updateParticleIntersectionHash(bool parallel);
+	void updateParticleIntersectionHash(bool parallel, bool incremental = false);
 
 	/**
-	 * Updates the particle - grid face hash function.
+	 * Bins the particles into blocks of the given size (used by forEachColored).
+	 * 
+	 * \param parallel - if true the binning runs in parallel
+	 * \param blockSize - the size of a block in space
+	 */
+	void updateParticleBlockHash(bool parallel, const glm::dvec3& blockSize);
+
+	/**
+	 * Calls a lambda function for each particle, block by block, in 8 colors (by the parity of the block coordinates).
+	 * The blocks of the same color run in parallel and are at least one block apart, so the lambda may write
+	 * anything within one block distance of the particle without synchronization. Before calling it the
+	 * particle block hash must be updated.
+	 * 
+	 * \param parallel - if true the blocks of the same color are processed in parallel
+	 * \param lambda - the called function
+	 */
+	template<typename F>
+	void forEachColored(bool parallel, F&& lambda);
+	void forEachColored(bool parallel, std::function<void(Particle&, int)>&& lambda);
+
+	/**
+	 * Reorders the particles in memory by the Z-order (Morton) key of their cell, so that particles close to each other
+	 * in space are also close in memory. Particles usually move little between two calls, so an insertion sort is tried
+	 * first, a full sort only runs if that would move too many particles. Particle indexes change, so every hash must be
+	 * updated after calling it.
+	 * 
+	 * \param parallel - if true the keys are calculated and the particles are moved in parallel
+	 */
+	void sortParticlesByMortonOrder(bool parallel);
+
+	/**
+	 * Updates the particle - grid face hash function (used by forEachAround), every particle is stored for the 8 faces around it.
+	 * 
+	 * \param parallel - if true the hash is built in parallel
 	 */
 	void updateParticleFaceHash(bool parallel);
 
 	/**
-	 * Updates the particle - grid cell center hash function.
+	 * Updates the particle - grid cell center hash function (used by forEachAround with axis 3).
 	 * 
+	 * \param parallel - if true the hash is built in parallel
 	 */
-	void updateParticleCenterHash();
+	void updateParticleCenterHash(bool parallel);
 
 	/**
 	 * Updates the cellD and grid dimensions, makes sure that no particle is outside the solid wall boundaries.
@@ -127,7 +198,7 @@ public:
 	 * 
 	 * \param particles - the particles to be added
 	 */
-	void addParticles(std::vector<Particle>&& particles);
+	void addParticles(std::vector<ParticleState>&& particles);
 
 	/**
 	 * Removes the paricles defined by the indexes from the collection.
@@ -150,13 +221,57 @@ private:
 		int operator=(int value) { this->value.store(value); return value; }
 	};
 
-	std::vector<Particle> particles;
+	void sortParticlesIntoCells(bool parallel, const glm::ivec3& cellNum, const glm::dvec3& cellDInv, std::vector<AtomicIntWrapper>& cells, std::vector<int>& ids, std::vector<int>& cellIndices);
+	bool updateParticleIntersectionHashIncrementally(bool parallel);
+	void updateParticleCompactHash(bool parallel);
+	void sortParticlesIntoFaceCells(bool parallel, int axis);
+	void pushParticle(const glm::dvec3& pos, const glm::dvec3& v);
+	template<typename T>
+	void reorder(bool parallel, std::vector<T>& values, std::vector<T>& buffer) const;
+
+	inline Particle particleAt(int idx) {
+		return Particle{ particlePos[idx], particleV[idx], affineVelocitiesStored ? particleC[idx].data() : nullptr };
+	}
+
+	inline std::pair<int, int> getIntersectionCellRange(const glm::ivec3& coord) const;
+
+	struct CompactHashEntry {
+		uint64_t key;
+		int cell;		//the index of the occupied cell in compactCellStarts
+	};
+	static constexpr uint64_t COMPACT_HASH_EMPTY_KEY = ~uint64_t(0);
+
+	std::vector<util::RealVec3> particlePos;
+	std::vector<util::RealVec3> particleV;
+	std::vector<std::array<util::RealVec3, 3>> particleC;		//only allocated if the affine velocities are stored
+	bool affineVelocitiesStored = false;
 	std::vector<AtomicIntWrapper> particleCells;
 	std::vector<int> particleIds;
+	std::vector<int> particleCellIndices;			//the hash cell of each particle at the last update, empty if the hash has to be rebuilt
+	std::vector<int> newParticleCellIndices;
+	std::vector<int> movedParticles;
+	std::vector<AtomicIntWrapper> particleCellsBuffer;
+	std::vector<int> particleIdsBuffer;
+
+	std::vector<std::pair<uint64_t, int>> compactOrder;	//the Z-order key of the cell and the index of each particle, sorted
+	std::vector<int> compactCellStarts;				//the first index in particleIds of each occupied cell (and the particle count at the end)
+	std::vector<CompactHashEntry> compactHashTable;
+	int compactHashShift = 0;
+
+	std::vector<AtomicIntWrapper> particleBlocks;
+	std::vector<int> particleBlockIds;
+	std::vector<int> particleBlockIndices;
+	glm::ivec3 blockNum = glm::ivec3(0, 0, 0);
+
+	std::vector<std::pair<uint64_t, int>> mortonOrder;
+	std::vector<util::RealVec3> sortBuffer;
+	std::vector<std::array<util::RealVec3, 3>> sortBufferC;
+
+	std::vector<glm::dvec3> pushApartDisplacements;
 
 	glm::dvec3 dimensions;
 
-	std::array<std::vector<int>, 4> particleFaceCells;
+	std::array<std::vector<AtomicIntWrapper>, 4> particleFaceCells;
 	std::array<std::vector<int>, 4> particleFaceIds;
 
 	glm::ivec3 cellNum = glm::ivec3(0, 0, 0);
@@ -165,8 +280,6 @@ private:
 	glm::dvec3 cellD;
 	glm::dvec3 cellDInv;
 
-	std::function<void(int)> faceAndCenterHashUpdate;
-
 	double r;
 	double rInv;
 	double d;
@@ -175,9 +288,104 @@ private:
 public:
 	const double z;
 	const bool zConst;
+	const NeighbourGridType neighbourGridType;
 
 };
 
+inline std::pair<int, int> HashedParticles::getIntersectionCellRange(const glm::ivec3& coord) const {
+	if (neighbourGridType == NeighbourGridType::DENSE) {
+		int cellIndex = coord.x * cellNum.y * cellNum.z + coord.y * cellNum.z + coord.z;
+		return std::pair<int, int>(particleCells[cellIndex], particleCells[cellIndex + 1]);
+	}
+	const uint64_t key = util::getMortonKey(coord);
+	const size_t mask = compactHashTable.size() - 1;
+	for (size_t slot = (key * 0x9E3779B97F4A7C15ull) >> compactHashShift; ; slot = (slot + 1) & mask) {
+		const CompactHashEntry& entry = compactHashTable[slot];
+		if (entry.key == key)
+			return std::make_pair(compactCellStarts[entry.cell], compactCellStarts[entry.cell + 1]);
+		if (entry.key == COMPACT_HASH_EMPTY_KEY)
+			return std::make_pair(0, 0);
+	}
+}
+
+template<typename F>
+inline void HashedParticles::forEachIntersecting(const Particle& particle, int pIndex, F&& lambda) {
+	glm::ivec3 cellIndex(particle.pos.x * dInv, particle.pos.y * dInv, particle.pos.z * dInv);
+	glm::ivec3 indexMax(std::min(cellIndex.x + 1, cellNum.x - 1), std::min(cellIndex.y + 1, cellNum.y - 1), std::min(cellIndex.z + 1, cellNum.z - 1));
+
+	for (int x = std::max(cellIndex.x - 1, 0); x <= indexMax.x; x++) {
+		for (int y = std::max(cellIndex.y - 1, 0); y <= indexMax.y; y++) {
+			for (int z = std::max(cellIndex.z - 1, 0); z <= indexMax.z; z++) {
+				auto [cellStartPos, maxPos] = getIntersectionCellRange(glm::ivec3(x, y, z));
+				for (int idIndex = cellStartPos; idIndex < maxPos; idIndex++) {
+					if (particleIds[idIndex] == pIndex)
+						continue;
+					Particle neighbour = particleAt(particleIds[idIndex]);
+					lambda(neighbour);
+				}
+			}
+		}
+	}
+}
+
+template<typename F>
+inline void HashedParticles::forEachAround(const glm::ivec3& cellGridCoord, int axis, F&& lambda) {
+	int cellIndex = cellGridCoord.x * cellNumFace.y * cellNumFace.z + cellGridCoord.y * cellNumFace.z + cellGridCoord.z;
+	int max = particleFaceCells[axis][cellIndex + 1];
+	for (int p = particleFaceCells[axis][cellIndex]; p < max; p++) {
+		Particle particle = particleAt(particleFaceIds[axis][p]);
+		lambda(particle);
+	}
+}
 
+template<typename F>
+inline void HashedParticles::forEach(bool parallel, F&& lambda) {
+	int particleNum = particlePos.size();
+	if (parallel) {
+#pragma omp parallel for
+		for (int p = 0; p < particleNum; p++) {
+			Particle particle = particleAt(p);
+			lambda(particle, p);
+		}
+	}
+	else {
+		for (int p = 0; p < particleNum; p++) {
+			Particle particle = particleAt(p);
+			lambda(particle, p);
+		}
+	}
 }
 
+template<typename F>
+inline void HashedParticles::forEachColored(bool parallel, F&& lambda) {
+	const auto processBlock = [&](const glm::ivec3& block) {
+		const int blockIndex = block.x * blockNum.y * blockNum.z + block.y * blockNum.z + block.z;
+		const int maxPos = particleBlocks[blockIndex + 1];
+		for (int idIndex = particleBlocks[blockIndex]; idIndex < maxPos; idIndex++) {
+			const int p = particleBlockIds[idIndex];
+			Particle particle = particleAt(p);
+			lambda(particle, p);
+		}
+	};
+	for (int color = 0; color < 8; color++) {
+		const glm::ivec3 first(color & 1, (color >> 1) & 1, (color >> 2) & 1);
+		const glm::ivec3 colorBlockNum((blockNum.x - first.x + 1) / 2, (blockNum.y - first.y + 1) / 2, (blockNum.z - first.z + 1) / 2);
+		const int colorBlockNumTotal = colorBlockNum.x * colorBlockNum.y * colorBlockNum.z;
+		const auto blockAt = [&](int i) {
+			return glm::ivec3(first.x + 2 * (i / (colorBlockNum.y * colorBlockNum.z)), first.y + 2 * (i / colorBlockNum.z % colorBlockNum.y), first.z + 2 * (i % colorBlockNum.z));
+		};
+		if (parallel) {
+#pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < colorBlockNumTotal; i++) {
+				processBlock(blockAt(i));
+			}
+		}
+		else {
+			for (int i = 0; i < colorBlockNumTotal; i++) {
+				processBlock(blockAt(i));
+			}
+		}
+	}
+}
+
+}
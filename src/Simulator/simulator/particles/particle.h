@@ -1,14 +1,27 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include "../util/precision.h"
 
 
 namespace genericfsim::particles {
 
+/**
+ * The state of a particle, used to add new particles and to copy a particle out of HashedParticles.
+ */
+struct ParticleState {
+	util::RealVec3 pos;
+	util::RealVec3 v;
+};
+
+/**
+ * A particle stored in HashedParticles. The attributes are stored in separate arrays, this struct only references them.
+ * c (the affine velocity matrix used by APIC) is nullptr if the affine velocities are not stored.
+ */
 struct Particle {
-	glm::dvec3 pos;
-	glm::dvec3 v;
-	glm::dvec3 c[3];
+	util::RealVec3& pos;
+	util::RealVec3& v;
+	util::RealVec3* c;
 };
 
-}
\ No newline at end of file
+}
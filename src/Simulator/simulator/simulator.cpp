@@ -8,7 +8,10 @@
 #include "util/compTimeForLoop.h"
 #include "util/random.h"
 #include "util/interpolation.h"
+#include "util/vectorOps.h"
 #include <mutex>
+#include <atomic>
+#include <limits>
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -22,17 +25,21 @@ using namespace genericfsim::obstacle;
 constexpr bool PARALLEL_SIM_PART		= RUN_IN_PARALLEL;
 constexpr bool PARALLEL_PUSH_APART		= RUN_IN_PARALLEL;
 constexpr bool PARALLEL_PUSH_OUT		= RUN_IN_PARALLEL;
+constexpr bool PARALLEL_SORT			= RUN_IN_PARALLEL;
 constexpr bool PARALLEL_P2G				= RUN_IN_PARALLEL;
 constexpr bool PARALLEL_INCOMPR			= RUN_IN_PARALLEL;
 constexpr bool PARALLEL_INCOMPR_PREP	= RUN_IN_PARALLEL;
 constexpr bool PARALLEL_G2P				= RUN_IN_PARALLEL;
 
+constexpr int P2G_BLOCK_SIZE			= 4;	//in cells, the colored P2G writes at most 2 cells away from a block, so it has to be at least 4
+
 
 Simulator::Simulator(SimulatorConfig config, std::shared_ptr<HashedParticles> hashedParticles, std::shared_ptr<MacGrid> macGrid)
 	: config(std::move(config)), hashedParticles(hashedParticles), macGrid(macGrid) {
 	stepDuration["SimulateParticles"] = 0;
 	stepDuration["PushParticlesApart"] = 0;
 	stepDuration["PushParticlesOutOfObstacles"] = 0;
+	stepDuration["ParticleSort"] = 0;
 	stepDuration["P2GTransfer"] = 0;
 	stepDuration["IncompressibilityPrep"] = 0;
 	stepDuration["Incompressibility"] = 0;
@@ -49,18 +56,66 @@ void genericfsim::simulator::Simulator::setNewHashedParticles(std::shared_ptr<ge
 }
 
 void Simulator::simulate(double dt) {
-	constexpr double slidingAvgFactor = 0.9;
+	hashedParticles->setAffineVelocitiesStored(config.transferType == P2G2PType::APIC);
+	//the obstacles only move between two calls, so they are sorted by type and their distance field is baked once
+	obstacleSet.rebuild(obstacles);
+	macGrid->bakeObstacleSdf(PARALLEL_PUSH_OUT, obstacleSet, hashedParticles->getParticleR());
+
+	if (!config.adaptiveTimeStepping) {
+		simulateStep(dt, 1);
+		stepDuration["Step count"] = 1;
+		stepDuration["Max advection substep count"] = 1;
+		return;
+	}
+
+	const glm::dvec3 cellD = macGrid->cellD;
+	const double minCellD = macGrid->twoD ? std::min(cellD.x, cellD.y) : std::min(std::min(cellD.x, cellD.y), cellD.z);
+	const int maxStepCount = std::max(config.maxStepCount, 1);
+	const int maxAdvectionSubstepCount = std::max(config.maxAdvectionSubstepCount, 1);
+	double remainingDt = dt;
+	int stepCount = 0;
+	int maxAdvectionSubstepsUsed = 1;	//the most substeps any grid step of the frame needed
+	while (stepCount < maxStepCount && remainingDt > 0.0) {
+		const double maxVelocity = getMaxVelocity(PARALLEL_SIM_PART);
+		const double cflDt = maxVelocity > 0.0 ? config.cflNumber * minCellD / maxVelocity : remainingDt;
+		//the remaining time is split evenly into the fewest steps that satisfy the CFL condition with the allowed substeps
+		const int stepsNeeded = std::clamp<double>(std::ceil(remainingDt / (cflDt * maxAdvectionSubstepCount)), 1.0, maxStepCount - stepCount);
+		const double stepDt = remainingDt / stepsNeeded;
+		const int advectionSubstepCount = std::clamp<double>(std::ceil(stepDt / cflDt), 1.0, maxAdvectionSubstepCount);
+		maxAdvectionSubstepsUsed = std::max(maxAdvectionSubstepsUsed, advectionSubstepCount);
+		simulateStep(stepDt, advectionSubstepCount);
+		remainingDt -= stepDt;
+		stepCount++;
+	}
+	stepDuration["Step count"] = stepCount;
+	stepDuration["Max advection substep count"] = maxAdvectionSubstepsUsed;
+}
+
+double Simulator::getMaxVelocity(bool parallel) {
+	double maxVelocity = util::parallelMax(parallel, 0, hashedParticles->getParticleNum(), [&](int p) {
+		return glm::length(glm::dvec3(hashedParticles->getParticleAt(p).v));
+	});
+	return std::max(maxVelocity, macGrid->getMaxFaceVelocity(parallel));
+}
+
+void Simulator::simulateStep(double dt, int advectionSubstepCount) {
+	constexpr double slidingAvgFactor = stepDurationSmoothing;
 
 	auto start = std::chrono::high_resolution_clock::now();
 	if(config.particleSpawningEnabled)
 		spawnParticles(dt);
-	advectParticles(PARALLEL_SIM_PART, dt);
+	for (int substep = 0; substep < advectionSubstepCount; substep++) {
+		advectParticles(PARALLEL_SIM_PART, dt / advectionSubstepCount);
+		//the push out of the last substep runs after pushing the particles apart
+		if (substep + 1 < advectionSubstepCount)
+			pushParticlesOutOfObstacles(PARALLEL_PUSH_OUT);
+	}
 	stepDuration["SimulateParticles"] = stepDuration["SimulateParticles"] * slidingAvgFactor + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() * (1.0 - slidingAvgFactor);
 
 	start = std::chrono::high_resolution_clock::now();
 	if (config.pushApartEnabled) {
-		hashedParticles->updateParticleIntersectionHash(PARALLEL_PUSH_APART);
-		hashedParticles->pushParticlesApart(PARALLEL_PUSH_APART);
+		hashedParticles->updateParticleIntersectionHash(PARALLEL_PUSH_APART, config.incrementalParticleHash);
+		hashedParticles->pushParticlesApart(PARALLEL_PUSH_APART, config.pushApartIterationCount);
 	}
 	stepDuration["PushParticlesApart"] = stepDuration["PushParticlesApart"] * slidingAvgFactor + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() * (1.0 - slidingAvgFactor);
 
@@ -68,18 +123,43 @@ void Simulator::simulate(double dt) {
 	pushParticlesOutOfObstacles(PARALLEL_PUSH_OUT);
 	stepDuration["PushParticlesOutOfObstacles"] = stepDuration["PushParticlesOutOfObstacles"] * slidingAvgFactor + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() * (1.0 - slidingAvgFactor);
 
+	start = std::chrono::high_resolution_clock::now();
+	if (config.particleSortInterval > 0 && ++stepsSinceParticleSort >= config.particleSortInterval) {
+		stepsSinceParticleSort = 0;
+		hashedParticles->sortParticlesByMortonOrder(PARALLEL_SORT);
+	}
+	stepDuration["ParticleSort"] = stepDuration["ParticleSort"] * slidingAvgFactor + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() * (1.0 - slidingAvgFactor);
+
+	start = std::chrono::high_resolution_clock::now();
+	updateNarrowBand(PARALLEL_SIM_PART, dt);
+	stepDuration["NarrowBand"] = stepDuration["NarrowBand"] * slidingAvgFactor + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() * (1.0 - slidingAvgFactor);
+
 	if(config.stopParticles)
 		hashedParticles->forEach(PARALLEL_SIM_PART, [&](Particle& particle, int) {
 			particle.v = glm::dvec3(0.0);
 		});
 
 	start = std::chrono::high_resolution_clock::now();
+	if (macGrid->sparseTilesEnabled) {
+		macGrid->clearActiveTiles();
+		hashedParticles->forEach(PARALLEL_P2G, [&](Particle& particle, int) {
+			macGrid->activateTileAt(particle.pos);
+		});
+		macGrid->finishTileActivation(PARALLEL_P2G);
+	}
 	macGrid->resetGridValues(PARALLEL_P2G);
+	if (config.p2gScheduling == P2GScheduling::COLORED)
+		hashedParticles->updateParticleBlockHash(PARALLEL_P2G, macGrid->cellD * double(P2G_BLOCK_SIZE));
+	else if (config.p2gScheduling == P2GScheduling::GATHER)
+		hashedParticles->updateParticleFaceHash(PARALLEL_P2G);
 	p2gTransfer(PARALLEL_P2G, dt);
 	stepDuration["P2GTransfer"] = stepDuration["P2GTransfer"] * slidingAvgFactor + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() * (1.0 - slidingAvgFactor);
 
 	start = std::chrono::high_resolution_clock::now();
+	if (config.p2gScheduling == P2GScheduling::GATHER)
+		hashedParticles->updateParticleCenterHash(PARALLEL_INCOMPR_PREP);
 	markFluidCellsAndCalculateParticleDensities(PARALLEL_INCOMPR_PREP);
+	macGrid->applyBulkLiquid(PARALLEL_INCOMPR_PREP);
 	addObstaclesToGrid(PARALLEL_INCOMPR_PREP);
 	macGrid->restoreBorderingSolidCellsAndSpeeds(PARALLEL_INCOMPR_PREP);
 	macGrid->postP2GUpdate(PARALLEL_INCOMPR_PREP, config.gravityEnabled ? config.gravity * dt : 0.0);
@@ -89,6 +169,7 @@ void Simulator::simulate(double dt) {
 	int itCount = macGrid->solveIncompressibility(PARALLEL_INCOMPR, dt);
 	stepDuration["Incompressibility"] = stepDuration["Incompressibility"] * slidingAvgFactor + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start).count() * (1.0 - slidingAvgFactor);
 	stepDuration["Incompressibility it count"] = itCount;
+	stepDuration["Incompressibility it saved"] = macGrid->getIterationsSavedByWarmStart();
 
 	start = std::chrono::high_resolution_clock::now();
 	macGrid->extrapolateVelocities(PARALLEL_G2P);
@@ -104,37 +185,26 @@ std::map<std::string, long long> Simulator::getStepDuration() const {
 }
 
 void Simulator::spawnParticles(double dt) {
-	std::vector<Particle> newParticles;
-	for (auto& obstacle : obstacles) {
-		if (SphericalParticleSource* tmp = dynamic_cast<SphericalParticleSource*>(obstacle.get()); tmp != nullptr) {
-			SphericalParticleSource& obstacle = *tmp;
-			double r = obstacle.r + hashedParticles->getParticleR();
-			double particleNumD = obstacle.particleSpawnRate * dt + obstacle.lastSpawnFraction;
-			int particleNum = particleNumD;
-			obstacle.lastSpawnFraction = particleNumD - particleNum;
-			for (int i = 0; i < particleNum; i++) {
-				double theta = genericfsim::util::getDoubleInRange(0.0, 2.0 * M_PI);
-				double phi = genericfsim::util::getDoubleInRange(0.0, M_PI);
-				glm::dvec3 normal(r * sin(phi) * cos(theta), r * sin(phi) * sin(theta), r * cos(phi));
-				glm::dvec3 pos = obstacle.pos + normal;
-				newParticles.push_back(Particle(pos, obstacle.particleSpawnSpeed * glm::normalize(normal)));
-			}
+	std::vector<ParticleState> newParticles;
+	for (SphericalParticleSource* source : obstacleSet.sources) {
+		SphericalParticleSource& obstacle = *source;
+		double r = obstacle.r + hashedParticles->getParticleR();
+		double particleNumD = obstacle.particleSpawnRate * dt + obstacle.lastSpawnFraction;
+		int particleNum = particleNumD;
+		obstacle.lastSpawnFraction = particleNumD - particleNum;
+		for (int i = 0; i < particleNum; i++) {
+			double theta = genericfsim::util::getDoubleInRange(0.0, 2.0 * M_PI);
+			double phi = genericfsim::util::getDoubleInRange(0.0, M_PI);
+			glm::dvec3 normal(r * sin(phi) * cos(theta), r * sin(phi) * sin(theta), r * cos(phi));
+			glm::dvec3 pos = obstacle.pos + normal;
+			newParticles.push_back(ParticleState(pos, obstacle.particleSpawnSpeed * glm::normalize(normal)));
 		}
 	}
 	hashedParticles->addParticles(std::move(newParticles));
 }
 
-bool isParticleInRectangle(const glm::dvec3& pPos, double particleR, const glm::dvec3& rPos, const glm::dvec3& rSize) {
-	glm::dvec3 d = (pPos - rPos);
-	return (std::abs(d.x) < rSize.x * 0.5 + particleR) &&
-		(std::abs(d.y) < rSize.y * 0.5 + particleR) &&
-		(std::abs(d.z) < rSize.z * 0.5 + particleR);
-}
-
 void Simulator::advectParticles(bool parallel, double dt) {
 	constexpr double wallRestitution = 0.3;
-	constexpr double sphereRestitution = 1.0;
-	constexpr double rectangleRestitution = 0.2;
 	const glm::dvec3 cellD = macGrid->cellD;
 	const double particleR = hashedParticles->getParticleR();
 	const glm::dvec3 gridLow = cellD + glm::dvec3(particleR, particleR, macGrid->twoD ? 0.0 : particleR) * 1.01;
@@ -143,7 +213,17 @@ void Simulator::advectParticles(bool parallel, double dt) {
 	std::vector<int> particleIdsToRemove;
 	std::mutex particleIdsToRemoveMutex;
 
+	const bool higherOrder = config.advectionType != AdvectionType::EULER;
+	if (config.advectionType == AdvectionType::RK2)
+		calculateAdvectionVelocities<AdvectionType::RK2>(parallel, dt);
+	else if (config.advectionType == AdvectionType::RK3)
+		calculateAdvectionVelocities<AdvectionType::RK3>(parallel, dt);
+
 	hashedParticles->forEach(parallel, [&](Particle& particle, int idx) {
+		glm::dvec3 pos = particle.pos;
+		//the particle moves along the chord of its path, its velocity only changes if it bounces
+		glm::dvec3 v = higherOrder ? advectionVelocities[idx] : glm::dvec3(particle.v);
+		bool bounced = false;
 		double t = 0;
 		int run = 0;
 		const int maxRunCount = 200;
@@ -154,13 +234,13 @@ void Simulator::advectParticles(bool parallel, double dt) {
 			int minAxis = 0;
 
 			COMP_FOR_LOOP(axis, 3,
-				double component = particle.v[axis];
+				double component = v[axis];
 				double tmp = 1e6;
 				if (component > 1e-6) {
-					tmp = (gridHigh[axis] - particle.pos[axis]) / component;
+					tmp = (gridHigh[axis] - pos[axis]) / component;
 				}
 				else if (component < -1e-6) {
-					tmp = (particle.pos[axis] - gridLow[axis]) / -component;
+					tmp = (pos[axis] - gridLow[axis]) / -component;
 				}
 				if (tmp < minTBeforeCollision) {
 					minTBeforeCollision = tmp;
@@ -169,87 +249,76 @@ void Simulator::advectParticles(bool parallel, double dt) {
 			)
 
 			if (minTBeforeCollision <= (dt - t)) {
-				particle.pos += particle.v * minTBeforeCollision * 0.999;
-				particle.v[minAxis] *= -wallRestitution;
+				pos += v * minTBeforeCollision * 0.999;
+				v[minAxis] *= -wallRestitution;
+				bounced = true;
 				t += 0.999 * minTBeforeCollision;
 				continue;
 			}
+			pos += v * (dt - t);
+			break;
+		}
 
-			bool collision = false;
-			particle.pos += particle.v * (dt - t);
-			for (auto& obstacle : obstacles) {
-				if (const SphericalObstacle* tmp = dynamic_cast<const SphericalObstacle*>(obstacle.get()); tmp != nullptr) {
-					bool isSink = dynamic_cast<const SphericalParticleSink*>(obstacle.get()) != nullptr;
-					const SphericalObstacle& obstacle = *tmp;
-					double r = obstacle.r + particleR;
-					double d = glm::length(obstacle.pos - particle.pos) - r;
-					if (d < 0) {
-						if (isSink && config.particleDespawningEnabled) {
-							std::scoped_lock lock(particleIdsToRemoveMutex);
-							particleIdsToRemove.push_back(idx);
-							collision = false;
-							break;
-						}
-						double backTime = 0;
-						while (glm::length(particle.pos - particle.v * backTime - (obstacle.pos - obstacle.speed * backTime)) < r && backTime < t + 0.001f)
-							backTime += 0.0002;
-						if (backTime > dt - t)
-							continue;
-						backTime += 0.0002;
-						particle.pos -= backTime * particle.v;
-						glm::dvec3 posTmp = obstacle.pos - obstacle.speed * backTime;
-						glm::dvec3 normal = glm::normalize(particle.pos - posTmp);
-						glm::dvec3 relativeV = particle.v - obstacle.speed;
-						double speedSemiNormalizer = -glm::dot(normal, relativeV);
-						if (speedSemiNormalizer <= 0.0f)
-							continue;
-						glm::dvec3 speedMirror = -relativeV / speedSemiNormalizer;
-						particle.v = (normal - speedMirror) * 2.0 + speedMirror;
-						particle.v *= speedSemiNormalizer * sphereRestitution;
-						particle.v += obstacle.speed;
-						t += (dt - t) - backTime;
-						collision = true;
-						break;
-					}
+		//a single lookup in the baked obstacle field, the particle is moved to the surface and its velocity relative to the obstacle is reflected
+		glm::dvec3 normal;
+		const double distance = macGrid->sampleObstacleSdf(pos, normal);
+		if (distance < particleR) {
+			const int obstacleIndex = macGrid->getClosestObstacle(pos);
+			if (obstacleIndex >= 0) {
+				if (obstacleSet.particleSink[obstacleIndex] && config.particleDespawningEnabled) {
+					std::scoped_lock lock(particleIdsToRemoveMutex);
+					particleIdsToRemove.push_back(idx);
 				}
-				if (const RectengularObstacle* tmp = dynamic_cast<const RectengularObstacle*>(obstacle.get()); tmp != nullptr) {
-					const RectengularObstacle& obstacle = *tmp;
-					if (isParticleInRectangle(particle.pos, particleR, obstacle.pos, obstacle.size)) {
-						double backTime = 0;
-						while (isParticleInRectangle(particle.pos - particle.v * backTime, particleR, obstacle.pos - obstacle.speed * backTime, obstacle.size) && backTime < dt - t)
-							backTime += 0.0002;
-						if (backTime > dt - t)
-							continue;
-						backTime += 0.0002;
-						particle.pos -= backTime * particle.v;
-						glm::dvec3 posTmp = obstacle.pos - obstacle.speed * backTime;
-						for (int axis = 0; axis < 3; axis++) {
-							if (particle.pos[axis] >= posTmp[axis] + obstacle.size[axis] * 0.5 + particleR) {
-								particle.v[axis] = -particle.v[axis] * rectangleRestitution + obstacle.speed[axis];
-								break;
-							}
-							else if (particle.pos[axis] <= posTmp[axis] - obstacle.size[axis] * 0.5 - particleR) {
-								particle.v[axis] = -particle.v[axis] * rectangleRestitution - obstacle.speed[axis];
-								break;
-							}
-						}
-						t += (dt - t) - backTime;
-						collision = true;
-						break;
+				else {
+					pos += normal * (particleR - distance);
+					const glm::dvec3 obstacleSpeed = obstacleSet.speed[obstacleIndex];
+					const glm::dvec3 relativeV = v - obstacleSpeed;
+					const double normalSpeed = glm::dot(relativeV, normal);
+					if (normalSpeed < 0.0) {
+						v = relativeV - normal * ((1.0 + obstacleSet.restitution[obstacleIndex]) * normalSpeed) + obstacleSpeed;
+						bounced = true;
 					}
 				}
 			}
-			if (!collision)
-				run = maxRunCount;
 		}
 		COMP_FOR_LOOP(axis, 3,
-			particle.pos[axis] = std::clamp(particle.pos[axis], gridLow[axis], gridHigh[axis]);
+			pos[axis] = std::clamp(pos[axis], gridLow[axis], gridHigh[axis]);
 		)
+		particle.pos = pos;
+		if (!higherOrder || bounced)
+			particle.v = v;
 	});
 
 	hashedParticles->removeParticles(std::move(particleIdsToRemove));
 }
 
+template<Simulator::AdvectionType advectionType>
+void Simulator::calculateAdvectionVelocities(bool parallel, double dt) {
+	const double particleR = hashedParticles->getParticleR();
+	const glm::dvec3 gridLow = macGrid->cellD + glm::dvec3(particleR, particleR, macGrid->twoD ? 0.0 : particleR) * 1.01;
+	const glm::dvec3 gridHigh = macGrid->dimensions - gridLow;
+	//the intermediate positions are kept inside the particle bounds, so that the sampled faces exist
+	auto sample = [&](const glm::dvec3& pos) {
+		return macGrid->sampleVelocity(glm::clamp(pos, gridLow, gridHigh));
+	};
+
+	advectionVelocities.resize(hashedParticles->getParticleNum());
+	hashedParticles->forEach(parallel, [&](Particle& particle, int idx) {
+		const glm::dvec3 pos = particle.pos;
+		const glm::dvec3 k1 = sample(pos);
+		glm::dvec3 pathV;
+		if constexpr (advectionType == AdvectionType::RK2) {
+			pathV = sample(pos + 0.5 * dt * k1);
+		}
+		else {
+			const glm::dvec3 k2 = sample(pos + 0.5 * dt * k1);
+			const glm::dvec3 k3 = sample(pos + 0.75 * dt * k2);
+			pathV = (2.0 * k1 + 3.0 * k2 + 4.0 * k3) / 9.0;
+		}
+		advectionVelocities[idx] = pathV + glm::dvec3(particle.v) - k1;
+	});
+}
+
 void Simulator::pushParticlesOutOfObstacles(bool parallel) {
 	const double particleR = hashedParticles->getParticleR();
 	const glm::dvec3 cellD = macGrid->cellD;
@@ -259,83 +328,160 @@ void Simulator::pushParticlesOutOfObstacles(bool parallel) {
 	const bool zConst = hashedParticles->zConst;
 	const double zConstVal = hashedParticles->z;
 
-	for (auto& obstacle : obstacles) {
-		if (const SphericalObstacle* tmp = dynamic_cast<const SphericalObstacle*>(obstacle.get()); tmp != nullptr) {
-			const SphericalObstacle& obstacle = *tmp;
-			double r = obstacle.r + particleR;
-			double r2 = r * r;
-			hashedParticles->forEach(parallel, [&](Particle& particle, int) {
-				glm::dvec3 o2p = particle.pos - obstacle.pos;
-				double distance2 = glm::dot(o2p, o2p);
-				if (distance2 >= r2)
-					return;
-				double distance = sqrt(distance2);
-				particle.pos = obstacle.pos + o2p / distance * r;
-				particle.pos.x = std::clamp(particle.pos.x, particleLow.x, particleHigh.x);
-				particle.pos.y = std::clamp(particle.pos.y, particleLow.y, particleHigh.y);
-				particle.pos.z = zConst ? zConstVal : std::clamp(particle.pos.z, particleLow.z, particleHigh.z);
-			});
+	hashedParticles->forEach(parallel, [&](Particle& particle, int) {
+		glm::dvec3 normal;
+		const double distance = macGrid->sampleObstacleSdf(particle.pos, normal);
+		if (distance >= particleR)
+			return;
+		const glm::dvec3 pos = glm::dvec3(particle.pos) + normal * (particleR - distance);
+		particle.pos = glm::dvec3(
+			std::clamp<double>(pos.x, particleLow.x, particleHigh.x),
+			std::clamp<double>(pos.y, particleLow.y, particleHigh.y),
+			zConst ? zConstVal : std::clamp<double>(pos.z, particleLow.z, particleHigh.z));
+	});
+}
+
+void Simulator::updateNarrowBand(bool parallel, double dt) {
+	const glm::ivec3 gridSize = macGrid->gridSize;
+	if (!config.narrowBandEnabled && !macGrid->hasLiquidLevelSet())
+		return;
+
+	const glm::dvec3 cellDInv = macGrid->cellDInv;
+	const auto getCellIndex = [&](const glm::dvec3& pos) {
+		const glm::ivec3 coord(
+			std::clamp(int(pos.x * cellDInv.x), 0, gridSize.x - 1),
+			std::clamp(int(pos.y * cellDInv.y), 0, gridSize.y - 1),
+			std::clamp(int(pos.z * cellDInv.z), 0, gridSize.z - 1));
+		return (coord.x * gridSize.y + coord.y) * gridSize.z + coord.z;
+	};
+	const int particlesPerCell = std::max(1, int(std::lround(macGrid->averagePressure)));
+	//the counts are zero between the calls, only the cells of the particles are cleared at the end
+	if (particleCounts.size() != gridSize.x * gridSize.y * gridSize.z)
+		particleCounts.assign(gridSize.x * gridSize.y * gridSize.z, 0);
+	hashedParticles->forEach(parallel, [&](Particle& particle, int) {
+		std::atomic_ref<int>(particleCounts[getCellIndex(particle.pos)]).fetch_add(1, std::memory_order_relaxed);
+	});
+	const auto clearParticleCounts = [&]() {
+		hashedParticles->forEach(parallel, [&](Particle& particle, int) {
+			std::atomic_ref<int>(particleCounts[getCellIndex(particle.pos)]).store(0, std::memory_order_relaxed);
+		});
+	};
+	if (!config.narrowBandEnabled) {
+		//when the mode is turned off the liquid below the surface layer is filled with particles again
+		seedParticles(macGrid->getLiquidCells(), 2, std::numeric_limits<int>::max(), particlesPerCell, particlesPerCell);
+		clearParticleCounts();
+		macGrid->clearLiquidLevelSet();
+		return;
+	}
+	macGrid->updateLiquidLevelSet(parallel, dt, particleCounts, config.narrowBandLayerCount);
+
+	//the particles below the band are removed. The layer below the band overlaps the bulk of the grid, it is kept at the
+	//average particle count: the extra particles are removed here and the missing ones are seeded below, so the particles
+	//sinking into the bulk and the liquid flowing up from it balance out (the particles are visited in order, so the
+	//same ones are removed with any thread count)
+	const int lastParticleLayer = config.narrowBandLayerCount + 1;
+	std::vector<int> particleIdsToRemove;
+	hashedParticles->forEach(false, [&](Particle& particle, int idx) {
+		const int index = getCellIndex(particle.pos);
+		const int layer = macGrid->getLiquidLayer(index);
+		if (layer > lastParticleLayer || (layer == lastParticleLayer && particleCounts[index] > particlesPerCell)) {
+			particleIdsToRemove.push_back(idx);
+			particleCounts[index]--;
 		}
-		if (const RectengularObstacle* tmp = dynamic_cast<const RectengularObstacle*>(obstacle.get()); tmp != nullptr) {
-			const RectengularObstacle& obstacle = *tmp;
-			auto [start, end] = macGrid->getMinMaxRect(obstacle.pos, obstacle.size);
-			start -= glm::dvec3(particleR, particleR, particleR);
-			end += glm::dvec3(particleR, particleR, particleR);
-			hashedParticles->forEach(parallel, [&](Particle& particle, int) {
-				if ((particle.pos.x > end.x || particle.pos.x < start.x) || (particle.pos.y > end.y || particle.pos.y < start.y)
-					|| ((particle.pos.z > end.z || particle.pos.z < start.z) && !zConst))
-					return;
-				int axis = 0;
-				double amount = 1e6;
-				int axisNum = zConst ? 2 : 3;
-				for (int p = 0; p < axisNum; p++) {
-					if (particle.pos[p] > obstacle.pos[p]) {
-						double tmp = end[p] - particle.pos[p];
-						if (tmp < std::abs(amount)) {
-							amount = tmp;
-							axis = p;
-						}
-					}
-					else {
-						double tmp = start[p] - particle.pos[p];
-						if (-tmp < std::abs(amount)) {
-							amount = tmp;
-							axis = p;
-						}
-					}
-				}
-				particle.pos[axis] += amount;
-				particle.pos[axis] = std::clamp(particle.pos[axis], particleLow[axis], particleHigh[axis]);
-			});
+	});
+	if (!particleIdsToRemove.empty())
+		hashedParticles->removeParticles(std::move(particleIdsToRemove));
+
+	//the empty cells of the band (where it moved down into the bulk) are reseeded too, except at the surface
+	seedParticles(macGrid->getLiquidBandCells(), lastParticleLayer, lastParticleLayer, particlesPerCell, particlesPerCell);
+	seedParticles(macGrid->getLiquidBandCells(), 2, config.narrowBandLayerCount, 1, particlesPerCell);
+	clearParticleCounts();
+}
+
+void Simulator::seedParticles(const std::vector<int>& cells, int minLayer, int maxLayer, int minCount, int particlesPerCell) {
+	const glm::ivec3 gridSize = macGrid->gridSize;
+	const glm::dvec3 cellD = macGrid->cellD;
+	const double particleR = hashedParticles->getParticleR();
+	const glm::dvec3 gridLow = cellD + glm::dvec3(particleR, particleR, macGrid->twoD ? 0.0 : particleR) * 1.01;
+	const glm::dvec3 gridHigh = macGrid->dimensions - gridLow;
+
+	std::vector<ParticleState> newParticles;
+	for (int index : cells) {
+		const int layer = macGrid->getLiquidLayer(index);
+		if (layer < minLayer || layer > maxLayer || particleCounts[index] >= minCount)
+			continue;
+		const glm::dvec3 cellPos(index / (gridSize.y * gridSize.z), index / gridSize.z % gridSize.y, index % gridSize.z);
+		for (int i = particleCounts[index]; i < particlesPerCell; i++) {
+			glm::dvec3 pos = (cellPos + glm::dvec3(util::getDoubleInRange(0.0, 1.0), util::getDoubleInRange(0.0, 1.0), util::getDoubleInRange(0.0, 1.0))) * cellD;
+			if (hashedParticles->zConst)
+				pos.z = hashedParticles->z;
+			pos = glm::clamp(pos, gridLow, gridHigh);
+			newParticles.push_back(ParticleState(pos, macGrid->sampleVelocity(pos)));
 		}
 	}
+	if (!newParticles.empty())
+		hashedParticles->addParticles(std::move(newParticles));
+}
+
+template<typename F>
+void Simulator::forEachParticleScattering(bool parallel, F&& lambda) {
+	if (config.p2gScheduling == P2GScheduling::COLORED)
+		hashedParticles->forEachColored(parallel, std::forward<F>(lambda));
+	else
+		hashedParticles->forEach(parallel, std::forward<F>(lambda));
 }
 
 void Simulator::p2gTransfer(bool parallel, double dt) {
 	const glm::dvec3 cellDInv = macGrid->cellDInv;
-
-	hashedParticles->forEach(parallel, [&](Particle& particle, int) {
-		auto faces = macGrid->getFacesAround(particle.pos);
-		COMP_FOR_LOOP(axis, 3,
-			COMP_FOR_LOOP(p, 8,
-				MacGridCell::Face& face = faces[axis][p].face;
-				double weight = trilinearInterpoll(face.pos, particle.pos, cellDInv);
-				if (config.transferType == P2G2PType::PIC || config.transferType == P2G2PType::FLIP) {
-					face.v += particle.v[axis] * weight;
-				}
-				else if (config.transferType == P2G2PType::APIC) {
-					glm::dvec3 p2f = face.pos - particle.pos;
-					face.v += (particle.v[axis] + glm::dot(particle.c[axis], p2f)) * weight;
-				}
-				face.particleWeightSum += weight;
+	const bool atomic = parallel && config.p2gScheduling == P2GScheduling::ATOMIC;
+	const auto add = [atomic](Real& target, double value) {
+		if (atomic)
+			std::atomic_ref<Real>(target) += value;
+		else
+			target += value;
+	};
+	const auto velocity = [&](const Particle& particle, const glm::dvec3& pos, const glm::dvec3& facePos, int axis) {
+		if (config.transferType == P2G2PType::APIC)
+			return particle.v[axis] + glm::dot(glm::dvec3(particle.c[axis]), facePos - pos);
+		return double(particle.v[axis]);
+	};
+
+	if (config.p2gScheduling == P2GScheduling::GATHER) {
+		macGrid->forEachActiveCell(parallel, [&](glm::ivec3 cellPos, MacGridCell& cell) {
+			for (int axis = 0; axis < 3; axis++) {
+				MacGridCell::Face& face = cell.faces[axis];
+				double v = 0.0;
+				double weightSum = 0.0;
+				hashedParticles->forEachAround(cellPos, axis, [&](Particle& particle) {
+					const glm::dvec3 pos = particle.pos;
+					double weight = trilinearInterpoll(face.pos, pos, cellDInv);
+					v += velocity(particle, pos, face.pos, axis) * weight;
+					weightSum += weight;
+				});
+				face.v = v;
+				face.particleWeightSum = weightSum;
+			}
+		});
+	}
+	else {
+		forEachParticleScattering(parallel, [&](Particle& particle, int) {
+			const glm::dvec3 pos = particle.pos;
+			auto faces = macGrid->getFacesAround(pos);
+			COMP_FOR_LOOP(axis, 3,
+				COMP_FOR_LOOP(p, 8,
+					const MacGridCell::Face& face = faces[axis][p];
+					double weight = trilinearInterpoll(face.pos, pos, cellDInv);
+					add(face.v, velocity(particle, pos, face.pos, axis) * weight);
+					add(face.particleWeightSum, weight);
+				)
 			)
-		)
-	});
+		});
+	}
 
-	macGrid->forEachCell(parallel, true, [&](glm::ivec3, MacGridCell& cell) {
-		double w0 = cell.faces[0].particleWeightSum.load();
-		double w1 = cell.faces[1].particleWeightSum.load();
-		double w2 = cell.faces[2].particleWeightSum.load();
+	macGrid->forEachActiveCell(parallel, [&](glm::ivec3, MacGridCell& cell) {
+		double w0 = cell.faces[0].particleWeightSum;
+		double w1 = cell.faces[1].particleWeightSum;
+		double w2 = cell.faces[2].particleWeightSum;
 		if (w0 > 1e-6)
 			cell.faces[0].v = cell.faces[0].v / w0;
 		else
@@ -353,66 +499,107 @@ void Simulator::p2gTransfer(bool parallel, double dt) {
 
 void Simulator::markFluidCellsAndCalculateParticleDensities(bool parallel) {
 	const glm::dvec3 cellDInv = macGrid->cellDInv;
+	const bool atomic = parallel && config.p2gScheduling == P2GScheduling::ATOMIC;
+
+	if (config.p2gScheduling == P2GScheduling::GATHER) {
+		macGrid->forEachActiveCell(parallel, [&](glm::ivec3 cellPos, MacGridCell& cell) {
+			double avgPNum = 0.0;
+			bool containsParticle = false;
+			hashedParticles->forEachAround(cellPos, 3, [&](Particle& particle) {
+				const glm::dvec3 pos = particle.pos;
+				avgPNum += trilinearInterpoll(cell.pos, pos, cellDInv);
+				containsParticle |= glm::ivec3(pos * cellDInv) == cellPos;
+			});
+			cell.avgPNum = avgPNum;
+			if (containsParticle)
+				cell.type = MacGridCell::CellType::WATER;
+		});
+		return;
+	}
 
-	hashedParticles->forEach(parallel, [&](Particle& particle, int) {
-		glm::dvec3 pos = particle.pos * cellDInv;
-		MacGridCell& cell = macGrid->cell(pos);
-		cell.type = MacGridCell::CellType::WATER;
+	forEachParticleScattering(parallel, [&](Particle& particle, int) {
+		const glm::dvec3 pos = particle.pos;
+		macGrid->cell(pos * cellDInv).type = MacGridCell::CellType::WATER;
 
-		auto cells = macGrid->getCellsAround(particle.pos);
+		auto cells = macGrid->getCellsAround(pos);
 		COMP_FOR_LOOP(p, 8,
-			double weight = trilinearInterpoll(cells[p].cell.pos, particle.pos, cellDInv);
-			cells[p].cell.avgPNum += weight;
+			double weight = trilinearInterpoll(cells[p].pos, pos, cellDInv);
+			if (atomic)
+				std::atomic_ref<Real>(cells[p].avgPNum) += weight;
+			else
+				cells[p].avgPNum += weight;
 		)
 	});
 }
 
 void Simulator::addObstaclesToGrid(bool parallel) {
-	for (auto& o : obstacles)
-		macGrid->addObstacle(parallel, o.get());
+	for (int o = 0; o < obstacles.size(); o++) {
+		if (!obstacleSet.particleSink[o])
+			macGrid->addObstacle(parallel, obstacles[o].get());
+	}
 }
 
 void Simulator::g2pTransfer(bool parallel) {
+	switch (config.transferType) {
+	case P2G2PType::PIC:
+		g2pTransferKernel<P2G2PType::PIC>(parallel);
+		break;
+	case P2G2PType::FLIP:
+		g2pTransferKernel<P2G2PType::FLIP>(parallel);
+		break;
+	case P2G2PType::APIC:
+		g2pTransferKernel<P2G2PType::APIC>(parallel);
+		break;
+	}
+}
+
+template<Simulator::P2G2PType transferType>
+void Simulator::g2pTransferKernel(bool parallel) {
 	const glm::dvec3 cellDInv = macGrid->cellDInv;
 	const bool twoD = macGrid->twoD;
+	const int axisNum = twoD ? 2 : 3;
+	const double flipRatio = config.flipRatio;
 
 	hashedParticles->forEach(parallel, [&](Particle& particle, int) {
-		auto faces = macGrid->getFacesAround(particle.pos);
-		for (int axis = 0; axis < 3; axis++) {
-			if (twoD && axis == 2) {
-				particle.v.z = 0;
-				break;
-			}
+		const glm::dvec3 pos = particle.pos;
+		for (int axis = 0; axis < axisNum; axis++) {
+			const MacGrid::FaceStencil stencil = macGrid->getFaceStencil(pos, axis);
+			const Real* faceV = macGrid->getFaceV(axis).data();
+			const Real* faceV2 = macGrid->getFaceV2(axis).data();
+			const glm::dvec3 upper = stencil.weights;
+			const glm::dvec3 lower = 1.0 - upper;
 
 			double picComponent = 0;
 			double flipComponent = 0;
 			glm::dvec3 cvec(0, 0, 0);
-			
-			for (int p = 0; p < 8; p++) {
-				const MacGridCell::Face& face = faces[axis][p].face;
-
-				double weight = trilinearInterpoll(face.pos, particle.pos, cellDInv);
-				picComponent += face.v2 * weight;
-				
-				if(config.transferType == P2G2PType::FLIP)
-					flipComponent += (face.v2 - face.v) * weight;
-
-				if(config.transferType == P2G2PType::APIC)
-					cvec += trilinearInterpollGradient(face.pos, particle.pos, cellDInv) * face.v2;			//TODO: faceCenter s particle.pos sorrend j?????
+
+			COMP_FOR_LOOP(p, 8,
+				constexpr bool upperX = (p >> 2) & 1;
+				constexpr bool upperY = (p >> 1) & 1;
+				constexpr bool upperZ = p & 1;
+				const double wx = upperX ? upper.x : lower.x;
+				const double wy = upperY ? upper.y : lower.y;
+				const double wz = upperZ ? upper.z : lower.z;
+				const double v2 = faceV2[stencil.indices[p]];
+				picComponent += v2 * (wx * wy * wz);
+
+				if constexpr (transferType == P2G2PType::FLIP)
+					flipComponent += (v2 - faceV[stencil.indices[p]]) * (wx * wy * wz);
+
+				if constexpr (transferType == P2G2PType::APIC)
+					cvec += glm::dvec3((upperX ? wy : -wy) * wz, (upperY ? wx : -wx) * wz, (upperZ ? wx : -wx) * wy) * cellDInv * v2;
+			)
+
+			if constexpr (transferType == P2G2PType::FLIP) {
+				particle.v[axis] = picComponent * (1 - flipRatio) + (flipComponent + particle.v[axis]) * flipRatio;
 			}
-			switch (config.transferType) {
-			case P2G2PType::PIC:
-				particle.v[axis] = picComponent;
-				break;
-			case P2G2PType::FLIP:
-				particle.v[axis] = picComponent * (1 - config.flipRatio) 
-					+ (flipComponent + particle.v[axis]) * config.flipRatio;
-				break;
-			case P2G2PType::APIC:
+			else {
 				particle.v[axis] = picComponent;
-				particle.c[axis] = cvec;
-				break;
 			}
+			if constexpr (transferType == P2G2PType::APIC)
+				particle.c[axis] = cvec;
 		}
+		if (twoD)
+			particle.v.z = 0;
 	});
 }
@@ -24,18 +24,50 @@ public:
 	};
 
 
+	/**
+	 * Enum for the way the particle values are scattered onto the grid (P2G transfer and particle densities).
+	 * ATOMIC adds to the grid with atomic operations, COLORED bins the particles into blocks and processes the blocks
+	 * in 8 colors, so that the blocks running in parallel never write the same grid value and plain adds are enough.
+	 * GATHER iterates the grid instead and each face (and cell center) sums the particles around it from the particle
+	 * face hash, so every grid value is written by exactly one thread. COLORED is the default: in the p2g_benchmark
+	 * (3D dam break, 100k to 1M particles, 1 to 4 threads) its P2G step was 1.2 to 2.2 times faster than ATOMIC.
+	 */
+	enum class P2GScheduling {
+		ATOMIC, COLORED, GATHER
+	};
+
+	/**
+	 * Enum for the particle advection. EULER moves the particles along their own velocity, RK2 (midpoint) and RK3
+	 * (Ralston) integrate the path through the velocity field of the grid, corrected by the difference of the particle
+	 * velocity and the grid velocity at the particle (so that FLIP particles keep their own motion).
+	 */
+	enum class AdvectionType {
+		EULER, RK2, RK3
+	};
+
 	/**
 	 * A struct to easily store, update and set the Simulator's config.
 	 */
 	struct SimulatorConfig {
 		P2G2PType transferType = P2G2PType::FLIP;
+		P2GScheduling p2gScheduling = P2GScheduling::COLORED;
+		AdvectionType advectionType = AdvectionType::EULER;
 		float flipRatio = 0.99;
 		float gravity = 150.0;
 		bool gravityEnabled = true, pushParticlesApartEnabled = true;
 		bool pushApartEnabled = true;
+		int pushApartIterationCount = 1;
+		bool incrementalParticleHash = true;	//only the particles that left their hash cell are relocated when the particle intersection hash is updated
 		bool particleSpawningEnabled = false;
 		bool particleDespawningEnabled = false;
 		bool stopParticles = false;
+		int particleSortInterval = 20;	//the particles are reordered by Morton order every particleSortInterval steps, 0 disables it
+		bool adaptiveTimeStepping = false;	//dt is split into substeps, so that the fastest particle moves at most cflNumber cells in a substep
+		float cflNumber = 1.0;
+		int maxAdvectionSubstepCount = 4;	//the advection and obstacle push out substeps of one grid step, if more are needed the whole step is split
+		int maxStepCount = 4;				//the maximal number of grid steps (with pressure solve) dt is split into
+		bool narrowBandEnabled = false;		//only the particles near the liquid surface are kept, the bulk below them is represented by the grid
+		int narrowBandLayerCount = 3;		//the depth of the particle band in cells
 	};
 
 	/**
@@ -62,7 +94,9 @@ public:
 	void setNewHashedParticles(std::shared_ptr<genericfsim::particles::HashedParticles> particles);
 
 	/**
-	 * Executes a simulation iteration that is dt time long.
+	 * Executes a simulation iteration that is dt time long. If adaptive time stepping is enabled, the iteration is split
+	 * according to the CFL condition: first only the advection and the obstacle push out run in substeps, if that is not
+	 * enough the whole grid step is repeated with a smaller dt.
 	 * 
 	 * \param dt - the time step size in s
 	 */
@@ -80,6 +114,11 @@ public:
 	 */
 	std::map<std::string, long long> getStepDuration() const;
 
+	/**
+	 * The weight of the previous value in the sliding averages of the step durations.
+	 */
+	static constexpr double stepDurationSmoothing = 0.9;
+
 public:
 	SimulatorConfig config;
 
@@ -88,14 +127,28 @@ private:
 	std::shared_ptr<genericfsim::macgrid::MacGrid> macGrid;
 
 	std::map <std::string, long long> stepDuration;
+	int stepsSinceParticleSort = 0;
+	std::vector<glm::dvec3> advectionVelocities;	//the velocity of the higher order path of each particle in the current advection
+	genericfsim::obstacle::ObstacleSet obstacleSet;	//the obstacles sorted by type, rebuilt at the start of each simulate call
+	std::vector<int> particleCounts;				//the number of particles in each cell (narrow band mode, all zero between the steps)
 
+	void simulateStep(double dt, int advectionSubstepCount);
+	double getMaxVelocity(bool parallel);
 	void spawnParticles(double dt);
 	void advectParticles(bool parallel, double dt);
+	template<AdvectionType advectionType>
+	void calculateAdvectionVelocities(bool parallel, double dt);
 	void pushParticlesOutOfObstacles(bool parallel);
+	void updateNarrowBand(bool parallel, double dt);
+	void seedParticles(const std::vector<int>& cells, int minLayer, int maxLayer, int minCount, int particlesPerCell);
+	template<typename F>
+	void forEachParticleScattering(bool parallel, F&& lambda);
 	void p2gTransfer(bool parallel, double dt);
 	void markFluidCellsAndCalculateParticleDensities(bool parallel);
 	void addObstaclesToGrid(bool parallel);
 	void g2pTransfer(bool parallel);
+	template<P2G2PType transferType>
+	void g2pTransferKernel(bool parallel);
 };
 
 
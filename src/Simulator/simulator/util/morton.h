@@ -0,0 +1,34 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+
+namespace genericfsim::util {
+
+/**
+ * Spreads the lowest 21 bits of a number, so that there are 2 zero bits between each of them.
+ * 
+ * \param v - the number
+ * \return - the spread bits
+ */
+inline uint64_t spreadBits(uint64_t v) {
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffff;
+	v = (v | v << 16) & 0x1f0000ff0000ff;
+	v = (v | v << 8) & 0x100f00f00f00f00f;
+	v = (v | v << 4) & 0x10c30c30c30c30c3;
+	v = (v | v << 2) & 0x1249249249249249;
+	return v;
+}
+
+/**
+ * Returns the Z-order (Morton) key of a non-negative grid coordinate (21 bits per axis).
+ * 
+ * \param coord - the grid coordinate
+ * \return - the interleaved bits of the coordinates
+ */
+inline uint64_t getMortonKey(const glm::ivec3& coord) {
+	return spreadBits(coord.x) | spreadBits(coord.y) << 1 | spreadBits(coord.z) << 2;
+}
+
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+namespace genericfsim::util {
+
+/**
+ * The floating point type of the particle and grid storage (the simulation state).
+ * The arithmetic is still done in double, only the stored values are rounded, so single precision
+ * halves the memory traffic of the transfers. It can be switched with the SIMULATOR_SINGLE_PRECISION cmake option.
+ */
+#ifdef GENERICFSIM_SINGLE_PRECISION
+using Real = float;
+#else
+using Real = double;
+#endif
+
+using RealVec3 = glm::vec<3, Real>;
+
+}
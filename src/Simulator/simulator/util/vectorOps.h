@@ -0,0 +1,214 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+namespace genericfsim::util {
+
+/**
+ * Runs a function for each index in the [xStart, xEnd) range.
+ * 
+ * \param parallel - if true the loop runs in parallel
+ * \param xStart - the first index
+ * \param xEnd - the end of the range (exclusive)
+ * \param func - the function to run for each index
+ */
+template<typename F>
+inline void parallelFor(bool parallel, int xStart, int xEnd, F&& func) {
+	if (parallel) {
+#pragma omp parallel for
+		for (int x = xStart; x < xEnd; x++) {
+			func(x);
+		}
+	}
+	else {
+		for (int x = xStart; x < xEnd; x++) {
+			func(x);
+		}
+	}
+}
+
+/**
+ * Runs a function for each index in the (xEnd, xStart] range in reverse order.
+ * 
+ * \param parallel - if true the loop runs in parallel
+ * \param xStart - the first index
+ * \param xEnd - the end of the range (exclusive)
+ * \param func - the function to run for each index
+ */
+template<typename F>
+inline void reverseParallelFor(bool parallel, int xStart, int xEnd, F&& func) {
+	if (parallel) {
+#pragma omp parallel for
+		for (int x = xStart; x > xEnd; x--) {
+			func(x);
+		}
+	}
+	else {
+		for (int x = xStart; x > xEnd; x--) {
+			func(x);
+		}
+	}
+}
+
+/**
+ * Sums the values returned by a function for each index in the [xStart, xEnd) range.
+ * 
+ * \param parallel - if true the loop runs in parallel
+ * \param xStart - the first index
+ * \param xEnd - the end of the range (exclusive)
+ * \param func - the function to run for each index
+ * \return - the sum of the returned values
+ */
+template<typename F>
+inline double parallelSum(bool parallel, int xStart, int xEnd, F&& func) {
+	double result = 0.0;
+	if (parallel) {
+#pragma omp parallel for reduction(+:result)
+		for (int x = xStart; x < xEnd; x++) {
+			result += func(x);
+		}
+	}
+	else {
+		for (int x = xStart; x < xEnd; x++) {
+			result += func(x);
+		}
+	}
+	return result;
+}
+
+/**
+ * Returns the maximum of the values returned by a function for each index in the [xStart, xEnd) range.
+ * 
+ * \param parallel - if true the loop runs in parallel
+ * \param xStart - the first index
+ * \param xEnd - the end of the range (exclusive)
+ * \param func - the function to run for each index
+ * \return - the maximum of the returned values (0 for an empty range)
+ */
+template<typename F>
+inline double parallelMax(bool parallel, int xStart, int xEnd, F&& func) {
+	double result = 0.0;
+	if (parallel) {
+#pragma omp parallel for reduction(max:result)
+		for (int x = xStart; x < xEnd; x++) {
+			result = std::max<double>(result, func(x));
+		}
+	}
+	else {
+		for (int x = xStart; x < xEnd; x++) {
+			result = std::max<double>(result, func(x));
+		}
+	}
+	return result;
+}
+
+/**
+ * Replaces each element of an integer counter array with the sum of the elements up to and including it.
+ * 
+ * \param parallel - if true each thread sums a contiguous block, then the block sums are added in a second pass
+ * \param vec - the counters (anything that converts to and can be assigned from int)
+ */
+template<typename T>
+inline void prefixSum(bool parallel, std::vector<T>& vec) {
+	const int size = vec.size();
+	if (!parallel) {
+		int sum = 0;
+		for (int i = 0; i < size; i++) {
+			sum += vec[i];
+			vec[i] = sum;
+		}
+		return;
+	}
+	std::vector<int> blockSums;
+#pragma omp parallel
+	{
+		const int threadNum = omp_get_num_threads();
+		const int thread = omp_get_thread_num();
+#pragma omp single
+		blockSums.assign(threadNum + 1, 0);
+		const int begin = static_cast<long long>(size) * thread / threadNum;
+		const int end = static_cast<long long>(size) * (thread + 1) / threadNum;
+		int sum = 0;
+		for (int i = begin; i < end; i++) {
+			sum += vec[i];
+			vec[i] = sum;
+		}
+		blockSums[thread + 1] = sum;
+#pragma omp barrier
+#pragma omp single
+		for (int t = 0; t < threadNum; t++) {
+			blockSums[t + 1] += blockSums[t];
+		}
+		const int offset = blockSums[thread];
+		for (int i = begin; i < end; i++) {
+			vec[i] = vec[i] + offset;
+		}
+	}
+}
+
+/**
+ * Calculates the dot product of two vectors (always accumulated in double).
+ * 
+ * \param parallel - if true the calculation runs in parallel
+ * \return - the dot product
+ */
+template<typename T>
+inline double dotProduct(bool parallel, const std::vector<T>& vec1, const std::vector<T>& vec2) {
+	double result = 0.0;
+	if (parallel) {
+		#pragma omp parallel for reduction(+:result)
+		for (int i = 0; i < vec1.size(); i++) {
+			result += static_cast<double>(vec1[i]) * vec2[i];
+		}
+	}
+	else {
+		for (int i = 0; i < vec1.size(); i++) {
+			result += static_cast<double>(vec1[i]) * vec2[i];
+		}
+	}
+	return result;
+}
+
+/**
+ * Calculates vec += vec1 * scalar.
+ * 
+ * \param parallel - if true the calculation runs in parallel
+ */
+template<typename T>
+inline void multAdd(bool parallel, std::vector<T>& vec, const std::vector<T>& vec1, double scalar) {
+	if (parallel) {
+#pragma omp parallel for
+		for (int i = 0; i < vec.size(); i++) {
+			vec[i] += vec1[i] * scalar;
+		}
+	}
+	else {
+		for (int i = 0; i < vec.size(); i++) {
+			vec[i] += vec1[i] * scalar;
+		}
+	}
+}
+
+/**
+ * Calculates vec = vec * scalar + vec1.
+ * 
+ * \param parallel - if true the calculation runs in parallel
+ */
+template<typename T>
+inline void multSelfAndAdd(bool parallel, std::vector<T>& vec, const std::vector<T>& vec1, double scalar) {
+	if (parallel) {
+#pragma omp parallel for
+		for (int i = 0; i < vec.size(); i++) {
+			vec[i] = vec[i] * scalar + vec1[i];
+		}
+	}
+	else {
+		for (int i = 0; i < vec.size(); i++) {
+			vec[i] = vec[i] * scalar + vec1[i];
+		}
+	}
+}
+
+}
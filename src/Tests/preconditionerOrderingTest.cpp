@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include "simulator/simulator.h"
+#include "simulator/macGrid/bridsonSolverGrid.h"
+
+using namespace genericfsim;
+using namespace genericfsim::macgrid;
+using PreconditionerOrdering = BridsonSolverGrid::PreconditionerOrdering;
+
+/**
+ * Checks that the parallel preconditioner orderings of BridsonSolverGrid solve to the same pressure as the serial
+ * lexicographic ordering: WAVEFRONT with the default iteration limit, RED_BLACK (a weaker preconditioner) with a raised
+ * one.
+ */
+
+namespace {
+
+constexpr double dt = 0.01;
+constexpr int warmupStepCount = 10;
+constexpr int defaultIterationCount = 80;
+constexpr int raisedIterationCount = 1000;
+constexpr double wavefrontTolerance = 1e-4;
+constexpr double redBlackTolerance = 1e-3;
+
+struct SolveResult {
+	std::vector<util::Real> pressure;
+	int iterationCount;
+};
+
+/**
+ * Runs a dam break scene with the lexicographic ordering, then solves the next step with the given ordering. The scene
+ * is the same on every call (the particles are seeded from the same random seed and the P2G transfer is colored, so
+ * the result does not depend on the thread count).
+ */
+SolveResult solveScene(bool twoD, PreconditionerOrdering ordering, int iterationCount) {
+	std::srand(1);
+	const glm::dvec3 dimensions(30, 20, twoD ? 5 : 15);
+	auto grid = std::make_shared<BridsonSolverGrid>(dimensions, 2.0, twoD, 1.0);
+	grid->incompressibilityMaxIterationCount = defaultIterationCount;
+	grid->residualTolerance = 1e-6;
+	grid->preconditionerOrdering = PreconditionerOrdering::LEXICOGRAPHIC;
+	auto particles = std::make_shared<particles::HashedParticles>(twoD ? 8000 : 30000, 0.15, grid->dimensions, grid->cellD, twoD, dimensions.z / 2);
+
+	simulator::Simulator::SimulatorConfig config;
+	config.p2gScheduling = simulator::Simulator::P2GScheduling::COLORED;
+	simulator::Simulator simulator(config, particles, grid);
+	for (int step = 0; step < warmupStepCount; step++)
+		simulator.simulate(dt);
+
+	grid->preconditionerOrdering = ordering;
+	grid->incompressibilityMaxIterationCount = iterationCount;
+	simulator.simulate(dt);
+	return { grid->getPressure(), static_cast<int>(simulator.getStepDuration().at("Incompressibility it count")) };
+}
+
+/**
+ * Returns the max difference of two pressure fields relative to the max norm of the reference.
+ */
+double relativeDifference(const std::vector<util::Real>& pressure, const std::vector<util::Real>& reference) {
+	double maxDifference = 0.0;
+	double maxReference = 0.0;
+	for (int i = 0; i < reference.size(); i++) {
+		maxDifference = std::max<double>(maxDifference, std::abs(pressure[i] - reference[i]));
+		maxReference = std::max<double>(maxReference, std::abs(reference[i]));
+	}
+	return maxDifference / std::max(maxReference, 1e-12);
+}
+
+bool checkOrdering(bool twoD, const char* name, const SolveResult& result, const SolveResult& reference, int iterationCount, double tolerance) {
+	if (result.pressure.size() != reference.pressure.size() || reference.pressure.empty()) {
+		std::printf("FAIL %s %s: %zu fluid cells instead of %zu\n", twoD ? "2D" : "3D", name, result.pressure.size(), reference.pressure.size());
+		return false;
+	}
+	const double difference = relativeDifference(result.pressure, reference.pressure);
+	const bool converged = result.iterationCount < iterationCount;
+	const bool passed = converged && difference < tolerance;
+	std::printf("%s %s %s: %d iterations (lexicographic %d), relative pressure difference %g\n", passed ? "OK  " : "FAIL",
+		twoD ? "2D" : "3D", name, result.iterationCount, reference.iterationCount, difference);
+	return passed;
+}
+
+}
+
+int main() {
+	bool passed = true;
+	for (bool twoD : { false, true }) {
+		const SolveResult lexicographic = solveScene(twoD, PreconditionerOrdering::LEXICOGRAPHIC, defaultIterationCount);
+		const SolveResult wavefront = solveScene(twoD, PreconditionerOrdering::WAVEFRONT, defaultIterationCount);
+		const SolveResult redBlack = solveScene(twoD, PreconditionerOrdering::RED_BLACK, raisedIterationCount);
+		passed &= lexicographic.iterationCount < defaultIterationCount;
+		passed &= checkOrdering(twoD, "wavefront", wavefront, lexicographic, defaultIterationCount, wavefrontTolerance);
+		passed &= checkOrdering(twoD, "red-black", redBlack, lexicographic, raisedIterationCount, redBlackTolerance);
+	}
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}